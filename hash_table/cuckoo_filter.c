@@ -0,0 +1,510 @@
+#include "cuckoo_filter.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BUCKET_SIZE 4UL
+#define STASH_SIZE 8UL
+#define MAX_KICKS 500UL
+#define FILTER_BATCH_SIZE 32UL
+#define MAX_LOAD 0.95
+#define MIN_FINGERPRINT_BITS 4UL
+#define MAX_FINGERPRINT_BITS 16UL
+#define MAX_TABLE_SIZE 48UL
+
+#define FILTER_FILE_MAGIC "CKFILTR2"
+#define FILTER_FILE_BYTE_ORDER 0x0102030405060708UL
+
+/* Approximate membership with the two-choice buckets of set_bucketed.c, but
+ * a bucket holds BUCKET_SIZE fingerprints of fingerprint_bits bits instead
+ * of keys. Since an evicted entry has only its fingerprint left, its other
+ * bucket is derived from the one it is in (partial-key cuckoo hashing):
+ *
+ *     i_1 = hash(key) & mask, i_2 = i_1 ^ (hash(fingerprint) & mask)
+ *
+ * which is its own inverse. A lookup compares 2 * BUCKET_SIZE fingerprints,
+ * so false positives come at a rate of about 2 * BUCKET_SIZE /
+ * 2^fingerprint_bits when full. Fingerprints are packed at their width, so
+ * a full filter costs fingerprint_bits / MAX_LOAD bits per key, 12.6 for
+ * 12-bit ones. Every size_t is a valid key; the fingerprint 0 marks an empty
+ * slot. There are no false negatives as long as only inserted keys are
+ * deleted. */
+typedef struct stash_t {
+	size_t index; /* either bucket of fingerprint */
+	size_t fingerprint; /* 0 if free */
+} stash_t;
+
+struct cuckoo_filter_t {
+	size_t table_size; /* log2 of the buckets */
+	size_t fingerprint_bits;
+	uint64_t low; /* the lowest bit of every slot of a bucket */
+	size_t key_count;
+	size_t kick; /* LCG state picking the slots the cuckoo walk evicts */
+	size_t h[8][256];
+	size_t h_fingerprint[2][256];
+	stash_t stash[STASH_SIZE];
+	unsigned char *table;
+};
+
+/* The file is the header, the hash tables, the stash and the buckets as
+ * they are in memory */
+typedef struct filter_file_t {
+	char magic[8];
+	uint64_t byte_order;
+	uint64_t pointer_size;
+	uint64_t table_size, fingerprint_bits, key_count, kick;
+} filter_file_t;
+
+static void generate_hash(size_t m, size_t n, size_t T[m][n]) {
+	arc4random_buf(T, sizeof(size_t) * m * n);
+}
+
+static inline size_t hash(size_t key, size_t T[8][256]) {
+	size_t H = 0;
+	for (size_t i = 0; i < sizeof(size_t); i++) {
+		H ^= T[i][(unsigned char)(key >> 8 * i)];
+	}
+
+	return H;
+}
+
+static inline size_t filter_mask(const cuckoo_filter_t *filter) {
+	return (1UL << filter->table_size) - 1;
+}
+
+/* The top bits of H, which the bucket index below does not use */
+static inline size_t filter_fingerprint(const cuckoo_filter_t *filter,
+                                        size_t H) {
+	size_t fingerprint = H >> (64 - filter->fingerprint_bits);
+	return fingerprint ? fingerprint : 1;
+}
+
+static inline size_t filter_alt(const cuckoo_filter_t *filter, size_t index,
+                                size_t fingerprint) {
+	return (index ^ filter->h_fingerprint[0][fingerprint & 0xff] ^
+	        filter->h_fingerprint[1][fingerprint >> 8]) &
+	       filter_mask(filter);
+}
+
+/* Buckets are packed back to back, BUCKET_SIZE * fingerprint_bits bits
+ * each, from the low bits of each byte up. A bucket starts on a byte if
+ * fingerprint_bits is even and half way through one if it is odd, so with at
+ * most 16 bits it always fits in the 64-bit word loaded from its first byte.
+ * The table has a word of padding for the load of the last bucket. */
+static inline size_t filter_table_bytes(size_t table_size,
+                                        size_t fingerprint_bits) {
+	return ((BUCKET_SIZE * fingerprint_bits << table_size) + 7) / 8;
+}
+
+static inline size_t bucket_bit(const cuckoo_filter_t *filter,
+                                size_t index) {
+	return index * BUCKET_SIZE * filter->fingerprint_bits;
+}
+
+static inline unsigned char *filter_bucket(const cuckoo_filter_t *filter,
+                                           size_t index) {
+	return filter->table + bucket_bit(filter, index) / 8;
+}
+
+static inline uint64_t bucket_mask(const cuckoo_filter_t *filter) {
+	size_t bits = BUCKET_SIZE * filter->fingerprint_bits;
+	return bits == 64 ? ~0UL : (1UL << bits) - 1;
+}
+
+/* The little endian word at p, so that bit offsets run across bytes */
+static inline uint64_t filter_read_word(const unsigned char *p) {
+	uint64_t word;
+	memcpy(&word, p, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	return word;
+}
+
+static inline void filter_write_word(unsigned char *p, uint64_t word) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	memcpy(p, &word, sizeof(word));
+}
+
+/* A bucket as one word, slot i in bits [i * fingerprint_bits, ...) */
+static inline uint64_t bucket_load(const cuckoo_filter_t *filter,
+                                   size_t index) {
+	uint64_t word = filter_read_word(filter_bucket(filter, index));
+	return word >> bucket_bit(filter, index) % 8 & bucket_mask(filter);
+}
+
+/* Leaves the neighbouring buckets that share bytes with index as they are */
+static inline void bucket_store(cuckoo_filter_t *filter, size_t index,
+                                uint64_t word) {
+	unsigned char *p = filter_bucket(filter, index);
+	size_t shift = bucket_bit(filter, index) % 8;
+	uint64_t mask = bucket_mask(filter) << shift;
+
+	filter_write_word(p, (filter_read_word(p) & ~mask) | word << shift);
+}
+
+/* The top bit of every slot of word that holds fingerprint is set, by the
+ * zero byte test on word ^ fingerprint. Bits above a match may be set
+ * spuriously, so only the lowest one locates a slot. */
+static inline uint64_t bucket_match(const cuckoo_filter_t *filter,
+                                    uint64_t word, size_t fingerprint) {
+	uint64_t x = word ^ fingerprint * filter->low;
+
+	return (x - filter->low) & ~x &
+	       filter->low << (filter->fingerprint_bits - 1);
+}
+
+static inline size_t bucket_slot(const cuckoo_filter_t *filter,
+                                 uint64_t match) {
+	return __builtin_ctzl(match) / filter->fingerprint_bits;
+}
+
+static inline size_t bucket_get(const cuckoo_filter_t *filter, uint64_t word,
+                                size_t slot) {
+	size_t bits = filter->fingerprint_bits;
+	return word >> slot * bits & ((1UL << bits) - 1);
+}
+
+static inline uint64_t bucket_set(const cuckoo_filter_t *filter,
+                                  uint64_t word, size_t slot,
+                                  size_t fingerprint) {
+	size_t bits = filter->fingerprint_bits;
+	word &= ~(((1UL << bits) - 1) << slot * bits);
+	return word | (uint64_t)fingerprint << slot * bits;
+}
+
+static cuckoo_filter_t *filter_alloc(size_t table_size,
+                                     size_t fingerprint_bits) {
+	cuckoo_filter_t *filter = malloc(sizeof(cuckoo_filter_t));
+	unsigned char *table = calloc(
+	    filter_table_bytes(table_size, fingerprint_bits) + sizeof(uint64_t),
+	    1);
+	uint64_t low = 0;
+
+	for (size_t i = 0; i < BUCKET_SIZE; i++) {
+		low |= 1UL << i * fingerprint_bits;
+	}
+
+	if (filter != NULL && table != NULL) {
+		*filter = (cuckoo_filter_t){.table_size = table_size,
+		                            .fingerprint_bits = fingerprint_bits,
+		                            .low = low,
+		                            .key_count = 0,
+		                            .kick = 0,
+		                            .stash = {{0}},
+		                            .table = table};
+
+		generate_hash(8, 256, filter->h);
+		generate_hash(2, 256, filter->h_fingerprint);
+		return filter;
+	} else {
+		free(filter);
+		free(table);
+		return NULL;
+	}
+}
+
+/* Sized to hold capacity keys at MAX_LOAD, with the fewest fingerprint bits
+ * that keep false positives at fp_rate or below. Rates under
+ * 2 * BUCKET_SIZE / 2^MAX_FINGERPRINT_BITS get MAX_FINGERPRINT_BITS. */
+cuckoo_filter_t *cuckoo_filter_alloc(size_t capacity, double fp_rate) {
+	size_t bits = MIN_FINGERPRINT_BITS, table_size = 0;
+
+	while (bits < MAX_FINGERPRINT_BITS &&
+	       !(2.0 * BUCKET_SIZE / (1UL << bits) <= fp_rate)) {
+		bits++;
+	}
+	while (table_size < MAX_TABLE_SIZE &&
+	       capacity > MAX_LOAD * (BUCKET_SIZE << table_size)) {
+		table_size++;
+	}
+
+	return filter_alloc(table_size, bits);
+}
+
+void cuckoo_filter_free(cuckoo_filter_t *filter) {
+	if (filter) {
+		free(filter->table);
+		free(filter);
+	}
+}
+
+static bool bucket_insert(cuckoo_filter_t *filter, size_t index,
+                          size_t fingerprint) {
+	uint64_t word = bucket_load(filter, index);
+	uint64_t free_slots = bucket_match(filter, word, 0);
+
+	if (free_slots) {
+		bucket_store(filter, index,
+		             bucket_set(filter, word, bucket_slot(filter, free_slots),
+		                        fingerprint));
+		return true;
+	}
+
+	return false;
+}
+
+/* Places fingerprint in a free slot of one of its buckets, evicting
+ * fingerprints to their other bucket for up to MAX_KICKS steps. What is
+ * left over goes to the stash, which must have a free slot. */
+static void filter_put(cuckoo_filter_t *filter, size_t index,
+                       size_t fingerprint) {
+	if (bucket_insert(filter, index, fingerprint)) {
+		return;
+	}
+
+	index = filter_alt(filter, index, fingerprint);
+	for (size_t i = 0; i < MAX_KICKS; i++) {
+		if (bucket_insert(filter, index, fingerprint)) {
+			return;
+		}
+
+		filter->kick =
+		    filter->kick * 6364136223846793005UL + 1442695040888963407UL;
+		size_t slot = filter->kick >> 62;
+		uint64_t word = bucket_load(filter, index);
+		size_t evicted = bucket_get(filter, word, slot);
+
+		bucket_store(filter, index,
+		             bucket_set(filter, word, slot, fingerprint));
+		fingerprint = evicted;
+		index = filter_alt(filter, index, fingerprint);
+	}
+
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		if (!filter->stash[i].fingerprint) {
+			filter->stash[i] =
+			    (stash_t){.index = index, .fingerprint = fingerprint};
+			return;
+		}
+	}
+}
+
+static bool filter_find(const cuckoo_filter_t *filter, size_t index,
+                        size_t fingerprint) {
+	size_t alt = filter_alt(filter, index, fingerprint);
+
+	if (bucket_match(filter, bucket_load(filter, index), fingerprint) |
+	    bucket_match(filter, bucket_load(filter, alt), fingerprint)) {
+		return true;
+	}
+
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		const stash_t *s = &filter->stash[i];
+		if (s->fingerprint == fingerprint &&
+		    (s->index == index || s->index == alt)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* A filter cannot grow without its keys, so once the stash is full every
+ * insertion fails and leaves the filter as it was. Inserting a key again
+ * adds another copy of its fingerprint, which takes another delete. */
+bool cuckoo_filter_insert(cuckoo_filter_t *filter, size_t key) {
+	bool stash_free = false;
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		stash_free |= filter->stash[i].fingerprint == 0;
+	}
+	if (!stash_free) {
+		return false;
+	}
+
+	size_t H = hash(key, filter->h);
+	filter_put(filter, H & filter_mask(filter),
+	           filter_fingerprint(filter, H));
+
+	filter->key_count++;
+	return true;
+}
+
+/* Removes one copy of the fingerprint of key. Deleting a key that was never
+ * inserted may remove the fingerprint of another key that was. */
+bool cuckoo_filter_delete(cuckoo_filter_t *filter, size_t key) {
+	size_t H = hash(key, filter->h);
+	size_t fingerprint = filter_fingerprint(filter, H);
+	size_t index = H & filter_mask(filter);
+	size_t bucket[2] = {index, filter_alt(filter, index, fingerprint)};
+
+	for (size_t t = 0; t < 2; t++) {
+		uint64_t word = bucket_load(filter, bucket[t]);
+		uint64_t match = bucket_match(filter, word, fingerprint);
+		if (match) {
+			bucket_store(filter, bucket[t],
+			             bucket_set(filter, word, bucket_slot(filter, match),
+			                        0));
+			filter->key_count--;
+			return true;
+		}
+	}
+
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		stash_t *s = &filter->stash[i];
+		if (s->fingerprint == fingerprint &&
+		    (s->index == bucket[0] || s->index == bucket[1])) {
+			s->fingerprint = 0;
+			filter->key_count--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool cuckoo_filter_contains(cuckoo_filter_t *filter, size_t key) {
+	size_t H = hash(key, filter->h);
+	return filter_find(filter, H & filter_mask(filter),
+	                   filter_fingerprint(filter, H));
+}
+
+/* Hashes a block of keys and prefetches both of their buckets before the
+ * first one is touched */
+static void filter_prefetch(cuckoo_filter_t *filter, const size_t *keys,
+                            size_t m, size_t *index, size_t *fingerprint) {
+	for (size_t i = 0; i < m; i++) {
+		size_t H = hash(keys[i], filter->h);
+		index[i] = H & filter_mask(filter);
+		fingerprint[i] = filter_fingerprint(filter, H);
+
+		__builtin_prefetch(filter_bucket(filter, index[i]));
+		__builtin_prefetch(filter_bucket(
+		    filter, filter_alt(filter, index[i], fingerprint[i])));
+	}
+}
+
+/* Stops at the first key that does not fit; returns the number inserted */
+size_t cuckoo_filter_insert_batch(cuckoo_filter_t *filter, const size_t *keys,
+                                  size_t n) {
+	size_t index[FILTER_BATCH_SIZE], fingerprint[FILTER_BATCH_SIZE];
+
+	for (size_t k = 0; k < n; k += FILTER_BATCH_SIZE) {
+		size_t m = n - k < FILTER_BATCH_SIZE ? n - k : FILTER_BATCH_SIZE;
+
+		filter_prefetch(filter, keys + k, m, index, fingerprint);
+		for (size_t i = 0; i < m; i++) {
+			bool stash_free = false;
+			for (size_t j = 0; j < STASH_SIZE; j++) {
+				stash_free |= filter->stash[j].fingerprint == 0;
+			}
+			if (!stash_free) {
+				return k + i;
+			}
+
+			filter_put(filter, index[i], fingerprint[i]);
+			filter->key_count++;
+		}
+	}
+
+	return n;
+}
+
+/* found may be NULL; returns the number of keys that may be present */
+size_t cuckoo_filter_contains_batch(cuckoo_filter_t *filter,
+                                    const size_t *keys, size_t n,
+                                    bool *found) {
+	size_t index[FILTER_BATCH_SIZE], fingerprint[FILTER_BATCH_SIZE];
+	size_t count = 0;
+
+	for (size_t k = 0; k < n; k += FILTER_BATCH_SIZE) {
+		size_t m = n - k < FILTER_BATCH_SIZE ? n - k : FILTER_BATCH_SIZE;
+
+		filter_prefetch(filter, keys + k, m, index, fingerprint);
+		for (size_t i = 0; i < m; i++) {
+			bool hit = filter_find(filter, index[i], fingerprint[i]);
+
+			if (found) {
+				found[k + i] = hit;
+			}
+			count += hit;
+		}
+	}
+
+	return count;
+}
+
+size_t cuckoo_filter_count(cuckoo_filter_t *filter) {
+	return filter->key_count;
+}
+
+size_t cuckoo_filter_capacity(cuckoo_filter_t *filter) {
+	return BUCKET_SIZE << filter->table_size;
+}
+
+size_t cuckoo_filter_fingerprint_bits(cuckoo_filter_t *filter) {
+	return filter->fingerprint_bits;
+}
+
+bool cuckoo_filter_save(cuckoo_filter_t *filter, const char *path) {
+	FILE *stream = fopen(path, "wb");
+	if (!stream) {
+		return false;
+	}
+
+	filter_file_t file = {.byte_order = FILTER_FILE_BYTE_ORDER,
+	                      .pointer_size = sizeof(size_t),
+	                      .table_size = filter->table_size,
+	                      .fingerprint_bits = filter->fingerprint_bits,
+	                      .key_count = filter->key_count,
+	                      .kick = filter->kick};
+	memcpy(file.magic, FILTER_FILE_MAGIC, sizeof(file.magic));
+
+	bool written =
+	    fwrite(&file, sizeof(file), 1, stream) == 1 &&
+	    fwrite(filter->h, sizeof(filter->h), 1, stream) == 1 &&
+	    fwrite(filter->h_fingerprint, sizeof(filter->h_fingerprint), 1,
+	           stream) == 1 &&
+	    fwrite(filter->stash, sizeof(filter->stash), 1, stream) == 1 &&
+	    fwrite(filter->table,
+	           filter_table_bytes(filter->table_size,
+	                              filter->fingerprint_bits),
+	           1, stream) == 1;
+
+	return fclose(stream) == 0 && written;
+}
+
+/* Fails on files written by another build: the buckets are read back as the
+ * words they were, in the byte order and size_t of the writer */
+cuckoo_filter_t *cuckoo_filter_load(const char *path) {
+	FILE *stream = fopen(path, "rb");
+	if (!stream) {
+		return NULL;
+	}
+
+	filter_file_t file;
+	cuckoo_filter_t *filter = NULL;
+	if (fread(&file, sizeof(file), 1, stream) == 1 &&
+	    memcmp(file.magic, FILTER_FILE_MAGIC, sizeof(file.magic)) == 0 &&
+	    file.byte_order == FILTER_FILE_BYTE_ORDER &&
+	    file.pointer_size == sizeof(size_t) &&
+	    file.table_size <= MAX_TABLE_SIZE &&
+	    file.fingerprint_bits >= MIN_FINGERPRINT_BITS &&
+	    file.fingerprint_bits <= MAX_FINGERPRINT_BITS) {
+		filter = filter_alloc(file.table_size, file.fingerprint_bits);
+	}
+
+	if (filter) {
+		filter->key_count = file.key_count;
+		filter->kick = file.kick;
+
+		if (fread(filter->h, sizeof(filter->h), 1, stream) != 1 ||
+		    fread(filter->h_fingerprint, sizeof(filter->h_fingerprint), 1,
+		          stream) != 1 ||
+		    fread(filter->stash, sizeof(filter->stash), 1, stream) != 1 ||
+		    fread(filter->table,
+		          filter_table_bytes(filter->table_size,
+		                             filter->fingerprint_bits),
+		          1, stream) != 1 ||
+		    fgetc(stream) != EOF) {
+			cuckoo_filter_free(filter);
+			filter = NULL;
+		}
+	}
+
+	fclose(stream);
+	return filter;
+}
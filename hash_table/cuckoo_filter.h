@@ -0,0 +1,28 @@
+#ifndef CUCKOO_FILTER_H
+#define CUCKOO_FILTER_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct cuckoo_filter_t cuckoo_filter_t;
+
+cuckoo_filter_t *cuckoo_filter_alloc(size_t capacity, double fp_rate);
+void cuckoo_filter_free(cuckoo_filter_t *filter);
+
+bool cuckoo_filter_insert(cuckoo_filter_t *filter, size_t key);
+bool cuckoo_filter_delete(cuckoo_filter_t *filter, size_t key);
+bool cuckoo_filter_contains(cuckoo_filter_t *filter, size_t key);
+
+size_t cuckoo_filter_insert_batch(cuckoo_filter_t *filter, const size_t *keys,
+                                  size_t n);
+size_t cuckoo_filter_contains_batch(cuckoo_filter_t *filter,
+                                    const size_t *keys, size_t n, bool *found);
+
+size_t cuckoo_filter_count(cuckoo_filter_t *filter);
+size_t cuckoo_filter_capacity(cuckoo_filter_t *filter);
+size_t cuckoo_filter_fingerprint_bits(cuckoo_filter_t *filter);
+
+bool cuckoo_filter_save(cuckoo_filter_t *filter, const char *path);
+cuckoo_filter_t *cuckoo_filter_load(const char *path);
+
+#endif
@@ -0,0 +1,123 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "cuckoo_filter.h"
+
+/* Behaviour tests for cuckoo_filter_t: no false negatives through inserts,
+ * deletes and a save and load, and a false positive rate, measured on keys
+ * that were never inserted, within the rate the filter was sized for. */
+
+#define CAPACITY 124000UL /* just under MAX_LOAD of 2^15 buckets */
+#define PROBES 1000000UL
+
+/* splitmix64, so that inserted keys and probes never collide */
+static uint64_t test_key(uint64_t i) {
+	uint64_t z = i * 0x9e3779b97f4a7c15ULL + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/* Filled to its capacity, the filter finds every key and reports at most
+ * fp_rate of the probes, whatever width fp_rate gives the fingerprints */
+static void test_fp_rate(double fp_rate) {
+	cuckoo_filter_t *filter = cuckoo_filter_alloc(CAPACITY, fp_rate);
+	assert(filter);
+
+	for (size_t i = 0; i < CAPACITY; i++) {
+		assert(cuckoo_filter_insert(filter, test_key(i)));
+	}
+	assert(cuckoo_filter_count(filter) == CAPACITY);
+	for (size_t i = 0; i < CAPACITY; i++) {
+		assert(cuckoo_filter_contains(filter, test_key(i)));
+	}
+
+	size_t positives = 0;
+	for (size_t i = 0; i < PROBES; i++) {
+		positives += cuckoo_filter_contains(filter, test_key(CAPACITY + i));
+	}
+	double measured = (double)positives / PROBES;
+
+	printf("cuckoo_filter_test: target %g, %zu bits, measured %g\n", fp_rate,
+	       cuckoo_filter_fingerprint_bits(filter), measured);
+	assert(measured <= fp_rate);
+
+	cuckoo_filter_free(filter);
+}
+
+/* Deleting half the keys keeps the other half; the batch calls agree with
+ * the single ones */
+static void test_delete_and_batch(size_t fingerprint_bits) {
+	cuckoo_filter_t *filter =
+	    cuckoo_filter_alloc(CAPACITY, 8.0 / (1UL << fingerprint_bits));
+	size_t *keys = malloc(CAPACITY * sizeof(size_t));
+	bool *found = malloc(CAPACITY * sizeof(bool));
+	assert(filter && keys && found);
+	assert(cuckoo_filter_fingerprint_bits(filter) == fingerprint_bits);
+
+	for (size_t i = 0; i < CAPACITY; i++) {
+		keys[i] = test_key(i);
+	}
+	assert(cuckoo_filter_insert_batch(filter, keys, CAPACITY) == CAPACITY);
+	assert(cuckoo_filter_contains_batch(filter, keys, CAPACITY, found) ==
+	       CAPACITY);
+
+	for (size_t i = 0; i < CAPACITY; i += 2) {
+		assert(cuckoo_filter_delete(filter, keys[i]));
+	}
+	assert(cuckoo_filter_count(filter) == CAPACITY / 2);
+	cuckoo_filter_contains_batch(filter, keys, CAPACITY, found);
+	for (size_t i = 0; i < CAPACITY; i++) {
+		assert(found[i] == cuckoo_filter_contains(filter, keys[i]));
+		assert(i % 2 == 0 || found[i]);
+	}
+
+	cuckoo_filter_free(filter);
+	free(keys);
+	free(found);
+}
+
+static void test_save_load(void) {
+	char path[] = "/tmp/cuckoo_filter_test_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	cuckoo_filter_t *filter = cuckoo_filter_alloc(CAPACITY, 0.003);
+	assert(filter);
+	for (size_t i = 0; i < CAPACITY; i++) {
+		assert(cuckoo_filter_insert(filter, test_key(i)));
+	}
+	assert(cuckoo_filter_save(filter, path));
+
+	cuckoo_filter_t *loaded = cuckoo_filter_load(path);
+	assert(loaded);
+	assert(cuckoo_filter_count(loaded) == CAPACITY);
+	assert(cuckoo_filter_fingerprint_bits(loaded) ==
+	       cuckoo_filter_fingerprint_bits(filter));
+	for (size_t i = 0; i < 2 * CAPACITY; i++) {
+		assert(cuckoo_filter_contains(loaded, test_key(i)) ==
+		       cuckoo_filter_contains(filter, test_key(i)));
+	}
+
+	cuckoo_filter_free(filter);
+	cuckoo_filter_free(loaded);
+	unlink(path);
+}
+
+int main(void) {
+	const double rates[] = {0.5, 0.1, 0.03, 0.01, 0.002, 0.0005, 0.0002};
+
+	for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+		test_fp_rate(rates[i]);
+	}
+	for (size_t bits = 4; bits <= 16; bits++) {
+		test_delete_and_batch(bits);
+	}
+	test_save_load();
+
+	puts("cuckoo_filter_test: ok");
+	return 0;
+}
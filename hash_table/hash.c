@@ -1,5 +1,8 @@
 #include "hash.h"
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 size_t strnhash(const void *key, size_t key_size, const void *seed) {
 	const unsigned char *str = key;
@@ -13,6 +16,109 @@ size_t strnhash(const void *key, size_t key_size, const void *seed) {
 	return hash;
 }
 
+/* wyhash: keys are read 16 bytes per step (48 in three independent lanes
+ * for long ones) and folded with 64x64->128 bit multiplies. */
+static const uint64_t wyhash_secret[4] = {
+    0x2d358dccaa6c78a5UL, 0x8bb84b93962eacc9UL, 0x4b33a62ed433d4a3UL,
+    0x4d5a2da51de1aa47UL};
+
+static inline void wyhash_mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+	__uint128_t r = (__uint128_t)*a * *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32;
+	uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm_0 = ha * lb, rm_1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm_0 << 32), c = t < rl;
+	uint64_t lo = t + (rm_1 << 32);
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm_0 >> 32) + (rm_1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t wyhash_mix(uint64_t a, uint64_t b) {
+	wyhash_mum(&a, &b);
+	return a ^ b;
+}
+
+static inline uint64_t wyhash_r8(const unsigned char *p) {
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static inline uint64_t wyhash_r4(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+/* Reads 1 to 3 bytes */
+static inline uint64_t wyhash_r3(const unsigned char *p, size_t k) {
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+/* Hashes key_size bytes of key, seeded with the first word of seed, or
+ * unseeded if seed is NULL */
+size_t wyhash(const void *key, size_t key_size, const void *seed) {
+	const unsigned char *p = key;
+	const uint64_t *s = wyhash_secret;
+	uint64_t h = seed ? *(const uint64_t *)seed : 0;
+	uint64_t a, b;
+
+	h ^= wyhash_mix(h ^ s[0], s[1]);
+
+	if (key_size <= 16) {
+		if (key_size >= 4) {
+			size_t m = (key_size >> 3) << 2;
+			a = (wyhash_r4(p) << 32) | wyhash_r4(p + m);
+			b = (wyhash_r4(p + key_size - 4) << 32) |
+			    wyhash_r4(p + key_size - 4 - m);
+		} else if (key_size > 0) {
+			a = wyhash_r3(p, key_size);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = key_size;
+		if (i > 48) {
+			uint64_t h_1 = h, h_2 = h;
+			do {
+				h = wyhash_mix(wyhash_r8(p) ^ s[1], wyhash_r8(p + 8) ^ h);
+				h_1 = wyhash_mix(wyhash_r8(p + 16) ^ s[2],
+				                 wyhash_r8(p + 24) ^ h_1);
+				h_2 = wyhash_mix(wyhash_r8(p + 32) ^ s[3],
+				                 wyhash_r8(p + 40) ^ h_2);
+				p += 48;
+				i -= 48;
+			} while (i > 48);
+			h ^= h_1 ^ h_2;
+		}
+		while (i > 16) {
+			h = wyhash_mix(wyhash_r8(p) ^ s[1], wyhash_r8(p + 8) ^ h);
+			p += 16;
+			i -= 16;
+		}
+		a = wyhash_r8(p + i - 16);
+		b = wyhash_r8(p + i - 8);
+	}
+
+	a ^= s[1];
+	b ^= h;
+	wyhash_mum(&a, &b);
+	return wyhash_mix(a ^ s[0] ^ key_size, b ^ s[1]);
+}
+
+/* Drop-in for strnhash: hashes key up to its terminating NUL or key_size
+ * bytes, whichever comes first */
+size_t strnwyhash(const void *key, size_t key_size, const void *seed) {
+	return wyhash(key, strnlen(key, key_size), seed);
+}
+
 // MurmurHash3-inspired hash for size_t values
 size_t zhash2(const void *key, size_t key_size, const void *seed) {
 	size_t n = *(const size_t *)key;
@@ -42,53 +148,114 @@ size_t xhash(const void *key, size_t key_size, const void *seed) {
 
 
 
-#ifdef __ARM_NEON__
+/* The kernels behind the batch functions below. pmul_init replaces them with
+ * vectorized ones once at load time, where the CPU has them, so that a batch
+ * call does not test the CPU again. */
+static void xhash_batch_scalar(const size_t *keys, size_t n, size_t h,
+                               size_t *out);
+static void zhash_batch_pmul(const size_t *p, size_t n, const size_t *a,
+                             size_t *out);
+
+static void (*xhash_kernel)(const size_t *, size_t, size_t,
+                            size_t *) = xhash_batch_scalar;
+static void (*zhash_kernel)(const size_t *, size_t, const size_t *,
+                            size_t *) = zhash_batch_pmul;
+
+/* pmul multiplies in GF(2^64) modulo x^64 + x^4 + x^3 + x + 1. Every
+ * implementation below computes the same product; pmul_portable is the
+ * reference for the others. */
+static size_t pmul_portable(size_t a, size_t b) {
+	size_t p = 0;
+	while (a != 0 && b != 0) {
+        if (b & 1) /* if the polynomial for b has a constant term, add the corresponding a to p */
+            p ^= a; /* addition in GF(2^m) is an XOR of the polynomial coefficients */
+
+        if (a & 0x8000000000000000UL) /* GF modulo: if a has a nonzero term x^63, then must be reduced when it becomes x^64 */
+            a = (a << 1) ^ 0x1b; /* subtract (XOR) the low terms of the primitive polynomial x^64 + x^4 + x^3 + x + 1 (0b1_1011) – you can change it but it must be irreducible */
+        else
+            a <<= 1; /* equivalent to a*x */
+        b >>= 1;
+	}
+
+	return p;
+}
+
+#if defined(__ARM_NEON__) && defined(__ARM_FEATURE_CRYPTO)
 #include <arm_neon.h>
 
 poly8_t table[16] = {0, 27, 54, 45, 108, 119, 90, 65, 216, 195, 238, 245, 180, 175, 130, 153};
 
-poly64_t pmul(poly64_t a, poly64_t b) {
+size_t pmul(size_t a, size_t b) {
 	poly64_t p = (poly64_t)a, q = (poly64_t)b, r = (poly64_t)27;
 
 	poly128_t z = vmull_p64(p, q);
-	poly128_t w = vmull_p64(r, z>>64);
+	poly128_t w = vmull_p64(r, (poly64_t)(z>>64));
 
-	return (poly64_t)z ^ (poly64_t)w ^ (poly64_t)table[(size_t)(w>>64)];
+	return (size_t)((poly64_t)z ^ (poly64_t)w ^ (poly64_t)table[(size_t)(w>>64)]);
 }
 
-#elif defined(__i386__) || defined(__x86_64__)
+bool pmul_accelerated(void) { return true; }
+
+#elif defined(__x86_64__) && defined(__GNUC__)
 #include <immintrin.h>
 
-size_t pmul(size_t a, size_t b) {
-	__m128i p = _mm_set1_epi64x((long long)a), q = _mm_set1_epi64x((long long)b), r = _mm_cvtsi64_si128(27);
+/* The high half of the 128-bit product is folded back twice: once by
+ * multiplying it with the low terms of the polynomial, then the at most 4
+ * bits that overflow again. */
+__attribute__((target("pclmul"))) static inline size_t
+pmul_clmul(size_t a, size_t b) {
+	const __m128i r = _mm_cvtsi64_si128(0x1b);
 
-	__i128m z = _mm_clmulepi64_si128(a, b);
-	__i128m w = _mm_clmulepi64_si128(z, r);
-	__m128i table = _mm_setr_epi8(0, 27, 54, 45, 108, 119, 90, 65, 216, 195, 238, 245, 180, 175, 130, 153);
+	__m128i z = _mm_clmulepi64_si128(_mm_cvtsi64_si128((long long)a),
+	                                 _mm_cvtsi64_si128((long long)b), 0x00);
+	__m128i w = _mm_clmulepi64_si128(z, r, 0x01);
+	__m128i y = _mm_clmulepi64_si128(w, r, 0x01);
 
-	__m128i y = _mm_shuffle_epi8(table, _mm_srli_si128(z,8));
-	__m128i temp1 = _mm_xor_si128(z, a);
-	return (size_t)_mm_cvtsi128_si64(_mm_xor_si128(temp1, y));
+	return (size_t)_mm_cvtsi128_si64(_mm_xor_si128(_mm_xor_si128(z, w), y));
 }
 
-#else
+static void xhash_batch_avx2(const size_t *keys, size_t n, size_t h,
+                             size_t *out);
+static void xhash_batch_avx512(const size_t *keys, size_t n, size_t h,
+                               size_t *out);
+static void zhash_batch_clmul(const size_t *p, size_t n, const size_t *a,
+                              size_t *out);
+static void zhash_batch_vpclmul(const size_t *p, size_t n, const size_t *a,
+                                size_t *out);
 
-size_t pmul(size_t a, size_t b) {
-	size_t p = 0;
-	while (a != 0 && b != 0) {
-        if (b & 1) /* if the polynomial for b has a constant term, add the corresponding a to p */
-            p ^= a; /* addition in GF(2^m) is an XOR of the polynomial coefficients */
+/* Set once at load time, so that the branch in pmul is always predicted */
+static bool pmul_has_clmul;
 
-        if (a & 0x8000000000000000UL) /* GF modulo: if a has a nonzero term x^63, then must be reduced when it becomes x^64 */
-            a = (a << 1) ^ 0x11b; /* subtract (XOR) the primitive polynomial x^64 + x^4 + x^3 + x + 1 (0b1_0001_1011) – you can change it but it must be irreducible */
-        else
-            a <<= 1; /* equivalent to a*x */
-        b >>= 1;
+__attribute__((constructor)) static void pmul_init(void) {
+	__builtin_cpu_init();
+	pmul_has_clmul = __builtin_cpu_supports("pclmul");
+
+	if (__builtin_cpu_supports("avx512dq")) {
+		xhash_kernel = xhash_batch_avx512;
+	} else if (__builtin_cpu_supports("avx2")) {
+		xhash_kernel = xhash_batch_avx2;
 	}
 
-	return p;
+	if (pmul_has_clmul && __builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("vpclmulqdq")) {
+		zhash_kernel = zhash_batch_vpclmul;
+	} else if (pmul_has_clmul) {
+		zhash_kernel = zhash_batch_clmul;
+	}
+}
+
+size_t pmul(size_t a, size_t b) {
+	return pmul_has_clmul ? pmul_clmul(a, b) : pmul_portable(a, b);
 }
 
+bool pmul_accelerated(void) { return pmul_has_clmul; }
+
+#else
+
+size_t pmul(size_t a, size_t b) { return pmul_portable(a, b); }
+
+bool pmul_accelerated(void) { return false; }
+
 #endif
 
 /* default hash for integer keys */
@@ -115,4 +282,143 @@ size_t id_hash(const void *key, size_t key_size, const void *seed) {
 	
 	
 	return p;
-}
\ No newline at end of file
+}
+/* Batch variants hash the n size_t keys at keys into out, giving the same
+ * values as the single key functions. xhash and zhash2 are vectorized with
+ * AVX-512 or AVX2, zhash with VPCLMULQDQ or else PCLMULQDQ, whichever the
+ * CPU has. */
+
+static inline size_t xhash_mix(size_t n) {
+	n ^= n >> 33;
+	n *= 0xff51afd7ed558ccdUL;
+	n ^= n >> 33;
+	return n;
+}
+
+static void xhash_batch_scalar(const size_t *keys, size_t n, size_t h,
+                               size_t *out) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = h ^ xhash_mix(keys[i]);
+	}
+}
+
+static void zhash_batch_pmul(const size_t *p, size_t n, const size_t *a,
+                             size_t *out) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = a[0] + pmul(p[i], a[1]);
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+/* AVX2 has no 64-bit multiply: the low 64 bits of n * c are
+ * lo(n) * lo(c) + ((hi(n) * lo(c) + lo(n) * hi(c)) << 32) */
+__attribute__((target("avx2"))) static void
+xhash_batch_avx2(const size_t *keys, size_t n, size_t h, size_t *out) {
+	const __m256i c = _mm256_set1_epi64x((long long)0xff51afd7ed558ccdUL);
+	const __m256i c_hi = _mm256_srli_epi64(c, 32);
+	const __m256i x = _mm256_set1_epi64x((long long)h);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(keys + i));
+		v = _mm256_xor_si256(v, _mm256_srli_epi64(v, 33));
+
+		__m256i lo = _mm256_mul_epu32(v, c);
+		__m256i cross =
+		    _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(v, 32), c),
+		                     _mm256_mul_epu32(v, c_hi));
+		v = _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+
+		v = _mm256_xor_si256(v, _mm256_srli_epi64(v, 33));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_xor_si256(v, x));
+	}
+
+	xhash_batch_scalar(keys + i, n - i, h, out + i);
+}
+
+__attribute__((target("avx512f,avx512dq"))) static void
+xhash_batch_avx512(const size_t *keys, size_t n, size_t h, size_t *out) {
+	const __m512i c = _mm512_set1_epi64((long long)0xff51afd7ed558ccdUL);
+	const __m512i x = _mm512_set1_epi64((long long)h);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m512i v = _mm512_loadu_si512(keys + i);
+		v = _mm512_xor_si512(v, _mm512_srli_epi64(v, 33));
+		v = _mm512_mullo_epi64(v, c);
+		v = _mm512_xor_si512(v, _mm512_srli_epi64(v, 33));
+		_mm512_storeu_si512(out + i, _mm512_xor_si512(v, x));
+	}
+
+	xhash_batch_scalar(keys + i, n - i, h, out + i);
+}
+
+/* pmul_clmul inlines here, so the keys are multiplied back to back */
+__attribute__((target("pclmul"))) static void
+zhash_batch_clmul(const size_t *p, size_t n, const size_t *a, size_t *out) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = a[0] + pmul_clmul(p[i], a[1]);
+	}
+}
+
+/* pmul_clmul in each 128-bit lane, of which only the low half is kept */
+__attribute__((target("avx512f,vpclmulqdq"))) static inline __m512i
+zhash_reduce_512(__m512i z, __m512i r) {
+	__m512i w = _mm512_clmulepi64_epi128(z, r, 0x01);
+	__m512i y = _mm512_clmulepi64_epi128(w, r, 0x01);
+	return _mm512_xor_si512(_mm512_xor_si512(z, w), y);
+}
+
+/* Each VPCLMULQDQ multiplies four keys by a[1], one per 128-bit lane: the
+ * even keys of the eight loaded from the low half of their lane, then the
+ * odd ones from the high half. */
+__attribute__((target("avx512f,vpclmulqdq"))) static void
+zhash_batch_vpclmul(const size_t *p, size_t n, const size_t *a, size_t *out) {
+	const __m512i b = _mm512_set1_epi64((long long)a[1]);
+	const __m512i r = _mm512_set1_epi64(0x1b);
+	const __m512i x = _mm512_set1_epi64((long long)a[0]);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m512i v = _mm512_loadu_si512(p + i);
+		__m512i even =
+		    zhash_reduce_512(_mm512_clmulepi64_epi128(v, b, 0x00), r);
+		__m512i odd =
+		    zhash_reduce_512(_mm512_clmulepi64_epi128(v, b, 0x01), r);
+		_mm512_storeu_si512(
+		    out + i, _mm512_add_epi64(_mm512_unpacklo_epi64(even, odd), x));
+	}
+
+	zhash_batch_clmul(p + i, n - i, a, out + i);
+}
+
+#endif
+
+void xhash_batch(const void *keys, size_t n, const void *seed, size_t *out) {
+	xhash_kernel(keys, n, 0, out);
+}
+
+void zhash2_batch(const void *keys, size_t n, const void *seed, size_t *out) {
+	const size_t *seed_ptr = (const size_t *)seed;
+	size_t h = seed_ptr ? *seed_ptr : 0xc15d213aa4d7a795UL;
+
+	xhash_kernel(keys, n, h, out);
+}
+
+void zhash_batch(const void *keys, size_t n, const void *seed, size_t *out) {
+	zhash_kernel(keys, n, seed, out);
+}
+
+/* The batch variant of hash, or NULL if it has none */
+hash_batch_t hash_batch_for(hash_t hash) {
+	if (hash == xhash) {
+		return xhash_batch;
+	} else if (hash == zhash2) {
+		return zhash2_batch;
+	} else if (hash == zhash) {
+		return zhash_batch;
+	} else {
+		return NULL;
+	}
+}
@@ -1,14 +1,28 @@
 #ifndef HASH_H
 #define HASH_H
 
+#include <stdbool.h>
 #include <stdlib.h>
 
 #define SEED_SIZE (1<<12UL)
 
 typedef size_t (*hash_t)(const void *key, size_t key_size, const void *seed);
+typedef void (*hash_batch_t)(const void *keys, size_t n, const void *seed,
+                             size_t *out);
 
 size_t strnhash(const void *key, size_t key_size, const void *seed);
+size_t strnwyhash(const void *key, size_t key_size, const void *seed);
+size_t wyhash(const void *key, size_t key_size, const void *seed);
 size_t zhash(const void *key, size_t key_size, const void *seed);
 size_t xhash(const void *key, size_t key_size, const void *seed);
+size_t zhash2(const void *key, size_t key_size, const void *seed);
+
+void zhash_batch(const void *keys, size_t n, const void *seed, size_t *out);
+void xhash_batch(const void *keys, size_t n, const void *seed, size_t *out);
+void zhash2_batch(const void *keys, size_t n, const void *seed, size_t *out);
+hash_batch_t hash_batch_for(hash_t hash);
+
+size_t pmul(size_t a, size_t b);
+bool pmul_accelerated(void);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,283 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+/* Measures the hash functions of hash.c and prints one CSV row per result:
+ *
+ *     test,hash,key_size,metric,value
+ *
+ * speed rows give ns and cycles per key for a dependent chain of hashes
+ * (latency) and for independent keys (throughput). Cycles are TSC ticks
+ * where there is a TSC and 0 otherwise. The quality rows are avalanche bias,
+ * bucket chi-square at table_size masks and collisions of sequential and
+ * clustered integers.
+ *
+ *     hash_bench [keys] > results.csv */
+
+size_t id_hash(const void *key, size_t key_size, const void *seed);
+
+typedef struct bench_hash_t {
+	const char *name;
+	hash_t hash;
+	bool integer; /* reads exactly one size_t */
+	bool strn; /* stops at the first NUL */
+} bench_hash_t;
+
+static const bench_hash_t bench_hashes[] = {
+    {"strnhash", strnhash, false, true},
+    {"strnwyhash", strnwyhash, false, true},
+    {"wyhash", wyhash, false, false},
+    {"zhash", zhash, true, false},
+    {"xhash", xhash, true, false},
+    {"zhash2", zhash2, true, false},
+    {"id_hash", id_hash, true, false},
+};
+
+#define BENCH_HASH_COUNT (sizeof(bench_hashes) / sizeof(bench_hashes[0]))
+#define BENCH_MAX_KEY 256UL
+
+static const size_t bench_key_sizes[] = {8, 16, 32, 64, 256};
+static const size_t bench_table_sizes[] = {8, 12, 16, 20};
+
+static double bench_clock(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+static uint64_t bench_ticks(void) {
+#if defined(__i386__) || defined(__x86_64__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void bench_row(const char *test, const char *hash, size_t key_size,
+                      const char *metric, double value) {
+	printf("%s,%s,%zu,%s,%.6g\n", test, hash, key_size, metric, value);
+}
+
+/* Random key bytes without NULs, so that strn hashes see all of them */
+static void bench_fill(unsigned char *keys, size_t size) {
+	arc4random_buf(keys, size);
+	for (size_t i = 0; i < size; i++) {
+		keys[i] |= keys[i] ? 0 : 1;
+	}
+}
+
+/* Feeding each hash into the next key makes every call wait for the one
+ * before it; the throughput loop only folds the hashes into a sink. */
+static void bench_speed(const bench_hash_t *b, const unsigned char *keys,
+                        size_t key_size, size_t n, const void *seed) {
+	unsigned char key[BENCH_MAX_KEY];
+	size_t sink = 0, h = 0;
+
+	memcpy(key, keys, key_size);
+	double t_0 = bench_clock();
+	uint64_t c_0 = bench_ticks();
+	for (size_t i = 0; i < n; i++) {
+		key[0] ^= (unsigned char)(h | 1);
+		h = b->hash(key, key_size, seed);
+	}
+	uint64_t c_1 = bench_ticks();
+	double t_1 = bench_clock();
+	sink ^= h;
+
+	for (size_t i = 0; i < n; i++) {
+		sink += b->hash(keys + (i & 1023) * key_size, key_size, seed);
+	}
+	uint64_t c_2 = bench_ticks();
+	double t_2 = bench_clock();
+
+	bench_row("latency", b->name, key_size, "ns_per_key",
+	          1e9 * (t_1 - t_0) / n);
+	bench_row("latency", b->name, key_size, "cycles_per_key",
+	          (double)(c_1 - c_0) / n);
+	bench_row("throughput", b->name, key_size, "ns_per_key",
+	          1e9 * (t_2 - t_1) / n);
+	bench_row("throughput", b->name, key_size, "cycles_per_key",
+	          (double)(c_2 - c_1) / n);
+
+	if (sink == 42) {
+		fputs("", stderr); // keeps the loops from being optimized out
+	}
+}
+
+/* Flips every input bit of random keys and records how often each output bit
+ * flips with it. Reports the worst bias from 1/2 over all bit pairs and the
+ * mean number of output bits flipped. */
+static void bench_avalanche(const bench_hash_t *b, size_t key_size,
+                            size_t rounds, const void *seed) {
+	static uint32_t flips[BENCH_MAX_KEY * 8][64];
+	unsigned char key[BENCH_MAX_KEY];
+	size_t bits = key_size * 8;
+	double total = 0;
+
+	memset(flips, 0, sizeof(flips));
+	for (size_t r = 0; r < rounds; r++) {
+		bench_fill(key, key_size);
+		size_t h = b->hash(key, key_size, seed);
+
+		for (size_t i = 0; i < bits; i++) {
+			key[i / 8] ^= 1 << (i % 8);
+			size_t d = h ^ b->hash(key, key_size, seed);
+			key[i / 8] ^= 1 << (i % 8);
+
+			total += __builtin_popcountl(d);
+			for (; d; d &= d - 1) {
+				flips[i][__builtin_ctzl(d)]++;
+			}
+		}
+	}
+
+	double bias = 0;
+	for (size_t i = 0; i < bits; i++) {
+		for (size_t j = 0; j < 64; j++) {
+			double p = fabs((double)flips[i][j] / rounds - 0.5);
+			bias = p > bias ? p : bias;
+		}
+	}
+
+	bench_row("avalanche", b->name, key_size, "max_bias", bias);
+	bench_row("avalanche", b->name, key_size, "mean_bits_flipped",
+	          total / (rounds * bits));
+}
+
+/* Chi-square of n sequential integer keys over the 2^table_size buckets that
+ * map_index selects, divided by its degrees of freedom: about 1 for a
+ * uniform spread. */
+static void bench_buckets(const bench_hash_t *b, size_t table_size, size_t n,
+                          const void *seed) {
+	size_t buckets = 1UL << table_size;
+	uint32_t *count = calloc(buckets, sizeof(uint32_t));
+
+	if (!count) {
+		return;
+	}
+
+	for (size_t k = 0; k < n; k++) {
+		count[b->hash(&k, sizeof(k), seed) & (buckets - 1)]++;
+	}
+
+	double expected = (double)n / buckets, chi = 0;
+	for (size_t i = 0; i < buckets; i++) {
+		chi += (count[i] - expected) * (count[i] - expected) / expected;
+	}
+
+	char metric[32];
+	snprintf(metric, sizeof(metric), "chi2_per_df_%zu", table_size);
+	bench_row("buckets", b->name, sizeof(size_t), metric, chi / (buckets - 1));
+	free(count);
+}
+
+static int bench_compare(const void *a, const void *b) {
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+	return (x > y) - (x < y);
+}
+
+/* Counts equal hashes among n keys, over all 64 bits and over the low 32 */
+static void bench_collisions(const bench_hash_t *b, const char *set,
+                             const size_t *keys, size_t n, const void *seed) {
+	size_t *h = malloc(n * sizeof(size_t));
+	size_t full = 0, low = 0;
+
+	if (!h) {
+		return;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		h[i] = b->hash(&keys[i], sizeof(size_t), seed);
+	}
+	qsort(h, n, sizeof(size_t), bench_compare);
+	for (size_t i = 1; i < n; i++) {
+		full += h[i] == h[i - 1];
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		h[i] &= 0xffffffffUL;
+	}
+	qsort(h, n, sizeof(size_t), bench_compare);
+	for (size_t i = 1; i < n; i++) {
+		low += h[i] == h[i - 1];
+	}
+
+	char metric[48];
+	snprintf(metric, sizeof(metric), "%s_full", set);
+	bench_row("collisions", b->name, sizeof(size_t), metric, full);
+	snprintf(metric, sizeof(metric), "%s_low32", set);
+	bench_row("collisions", b->name, sizeof(size_t), metric, low);
+	free(h);
+}
+
+int main(int argc, char **argv) {
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	void *seed = aligned_alloc(64, SEED_SIZE);
+	unsigned char *keys = malloc(1024 * BENCH_MAX_KEY);
+	size_t *ints = malloc(n * sizeof(size_t));
+
+	if (n < 2 || !seed || !keys || !ints) {
+		free(seed);
+		free(keys);
+		free(ints);
+		return 1;
+	}
+
+	arc4random_buf(seed, SEED_SIZE);
+	bench_fill(keys, 1024 * BENCH_MAX_KEY);
+
+	puts("test,hash,key_size,metric,value");
+	bench_row("pmul", pmul_accelerated() ? "clmul" : "portable", 8,
+	          "accelerated", pmul_accelerated());
+
+	for (size_t i = 0; i < BENCH_HASH_COUNT; i++) {
+		const bench_hash_t *b = &bench_hashes[i];
+
+		for (size_t j = 0; j < sizeof(bench_key_sizes) / sizeof(size_t); j++) {
+			size_t key_size = bench_key_sizes[j];
+			if (!b->integer || key_size == sizeof(size_t)) {
+				bench_speed(b, keys, key_size, n, seed);
+			}
+		}
+
+		bench_avalanche(b, sizeof(size_t), 10000, seed);
+		if (!b->integer) {
+			bench_avalanche(b, 32, 10000, seed);
+		}
+
+		/* The rest feeds integer keys, as the maps' size_t keys would. Their
+		 * zero bytes would cut strn hashes short. */
+		if (b->strn) {
+			continue;
+		}
+
+		for (size_t j = 0; j < sizeof(bench_table_sizes) / sizeof(size_t);
+		     j++) {
+			bench_buckets(b, bench_table_sizes[j], n, seed);
+		}
+
+		for (size_t k = 0; k < n; k++) {
+			ints[k] = k;
+		}
+		bench_collisions(b, "sequential", ints, n, seed);
+
+		/* Runs of 16 neighbours spaced 2^32 apart */
+		for (size_t k = 0; k < n; k++) {
+			ints[k] = (k / 16) << 32 | (k % 16);
+		}
+		bench_collisions(b, "clustered", ints, n, seed);
+	}
+
+	free(seed);
+	free(keys);
+	free(ints);
+	return 0;
+}
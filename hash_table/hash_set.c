@@ -1,11 +1,16 @@
-#include "hash_table.h"
+#include "hash_set.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #define STASH_SIZE 8
-#define MAP_INIT_SIZE 8
+#define SET_INIT_SIZE 8
 #define ALPHA 4
 #define EPSILON 1.5f
+#define SET_BATCH_SIZE 32UL
 
-struct map_t {
+struct set_t {
 	size_t table_size;
 	size_t key_count;
 	size_t insertion_count;
@@ -14,7 +19,7 @@ struct map_t {
 	size_t *table; /* 1 << table_size + 1 */
 };
 
-void generate_hash(size_t m, size_t n, size_t T[m][n]) {
+static void generate_hash(size_t m, size_t n, size_t T[m][n]) {
 	arc4random_buf(T, sizeof(size_t) * m * n);
 	for (size_t i = 0; i < m; i++) {
 		for (size_t j = 0; j < n; j++) {
@@ -22,7 +27,7 @@ void generate_hash(size_t m, size_t n, size_t T[m][n]) {
 	}
 }
 
-size_t hash(size_t key, size_t T[8][256]) {
+static size_t hash(size_t key, size_t T[8][256]) {
 	size_t H = 0;
 	for (size_t i = 0; i < sizeof(size_t); i++) {
 		H ^= T[i][(unsigned char)(key >> 8 * i)];
@@ -31,30 +36,30 @@ size_t hash(size_t key, size_t T[8][256]) {
 	return H;
 }
 
-map_t *map_alloc(size_t element_size) {
-	map_t *map = malloc(sizeof(map_t));
-	size_t *table = calloc(1 << MAP_INIT_SIZE, sizeof(size_t));
+set_t *set_alloc(void) {
+	set_t *set = malloc(sizeof(set_t));
+	size_t *table = calloc(1 << SET_INIT_SIZE, sizeof(size_t));
 
-	if (map != NULL && map != NULL) {
-		*map = (map_t){.table_size = MAP_INIT_SIZE,
+	if (set != NULL && table != NULL) {
+		*set = (set_t){.table_size = SET_INIT_SIZE,
 		               .key_count = 0,
 		               .stash = {0},
 		               .insertion_count = 0,
 		               .table = table};
 
-		generate_hash(8, 256, map->h_0);
-		generate_hash(8, 256, map->h_1);
-		return map;
+		generate_hash(8, 256, set->h_0);
+		generate_hash(8, 256, set->h_1);
+		return set;
 	} else {
-		free(map);
+		free(set);
 		free(table);
 		return NULL;
 	}
 }
 
-void map_free(map_t *map) {
-	free(map->table);
-	free(map);
+void set_free(set_t *set) {
+	free(set->table);
+	free(set);
 }
 
 static void swap(size_t *a, size_t *b) {
@@ -63,39 +68,39 @@ static void swap(size_t *a, size_t *b) {
 	*b = temp;
 }
 
-static inline size_t *map_resize(map_t *map, size_t map_size) {
-	size_t *new_table = realloc(map->table, sizeof(size_t) * (1 << (map_size)));
+static inline size_t *set_resize(set_t *set, size_t set_size) {
+	size_t *new_table = realloc(set->table, sizeof(size_t) * (1 << (set_size)));
 
 	if (new_table != NULL) {
-		map->table = new_table;
+		set->table = new_table;
 
-		for (size_t i = 1 << (map_size - 1); i < (1 << map_size); i++) {
-			map->table[i] = 0;
+		for (size_t i = 1 << set->table_size; i < (1 << set_size); i++) {
+			set->table[i] = 0;
 		}
-		return map->table;
+		return set->table;
 	} else {
 		return NULL;
 	}
 }
 
-static size_t map_cuckoo(map_t *map, size_t key, size_t N) {
+static size_t set_cuckoo(set_t *set, size_t key, size_t N) {
 	if (key) {
 		for (size_t i = 0; i < N; i++) {
 			size_t h_0 =
-			    (hash(key, map->h_0) & (1 << (map->table_size)) - 1) & ~1;
-			swap(&key, &map->table[h_0]);
+			    (hash(key, set->h_0) & (1 << (set->table_size)) - 1) & ~1;
+			swap(&key, &set->table[h_0]);
 			if (key == 0)
 				return 0;
 
 			size_t h_1 =
-			    (hash(key, map->h_1) & (1 << (map->table_size)) - 1) | 1;
-			swap(&key, &map->table[h_1]);
+			    (hash(key, set->h_1) & (1 << (set->table_size)) - 1) | 1;
+			swap(&key, &set->table[h_1]);
 			if (key == 0)
 				return 0;
 		}
 
 		for (size_t i = 0; i < STASH_SIZE; i++) {
-			swap(&key, &map->stash[i]);
+			swap(&key, &set->stash[i]);
 			if (key == 0)
 				return 0;
 		}
@@ -104,92 +109,102 @@ static size_t map_cuckoo(map_t *map, size_t key, size_t N) {
 	return key;
 }
 
-static void map_rehash(map_t *map) {
+static void set_rehash(set_t *set) {
 	bool rehashed;
-	size_t max_iter = ALPHA * map->table_size;
+	size_t max_iter = ALPHA * set->table_size;
 	size_t key = 0;
 
 	do {
 		rehashed = true;
-		generate_hash(8, 256, map->h_0);
-		generate_hash(8, 256, map->h_1);
+		generate_hash(8, 256, set->h_0);
+		generate_hash(8, 256, set->h_1);
 
-		if (key = map_cuckoo(map, key, max_iter)) {
+		if (key = set_cuckoo(set, key, max_iter)) {
 			rehashed = false;
 			continue;
 		}
 
-		for (size_t i = 0; i < 1 << (map->table_size) && rehashed; i++) {
-			key = map->table[i];
-			map->table[i] = 0;
-			if (key = map_cuckoo(map, key, max_iter)) {
+		for (size_t i = 0; i < 1 << (set->table_size) && rehashed; i++) {
+			key = set->table[i];
+			set->table[i] = 0;
+			if (key = set_cuckoo(set, key, max_iter)) {
 				rehashed = false;
 			}
 		}
 
 	} while (!rehashed);
 
-	map->insertion_count = 0;
+	set->insertion_count = 0;
 }
 
-bool map_insert(map_t *map, size_t key) {
+bool set_insert(set_t *set, size_t key) {
 	if (!key) {
 		return false; // 0 is not a valid key
-	} else if (map_search(map, key)) {
+	} else if (set_search(set, key)) {
 		return true;
 	} else {
-		if (1UL << map->table_size <= (3 * map->key_count)) {
-			size_t new_size = map->table_size + 2;
+		if (1UL << set->table_size <= (3 * set->key_count)) {
+			size_t new_size = set->table_size + 2;
 
-			if (!map_resize(map, new_size)) {
+			if (!set_resize(set, new_size)) {
 				return false;
 			} else {
-				map->table_size = new_size;
-				map_rehash(map);
+				set->table_size = new_size;
+				set_rehash(set);
 			}
 		}
 
-		if ((1 << map->table_size) < map->insertion_count) {
-			map_rehash(map);
+		if ((1 << set->table_size) < set->insertion_count) {
+			set_rehash(set);
 		}
 
-		size_t max_iter = ALPHA * map->table_size;
+		/* A stashed key is taken out before it is moved back, or a full
+		 * stash would be rotated onto its own slot and keep a second copy.
+		 * The emptied slot means set_cuckoo always places it. */
+		size_t max_iter = ALPHA * set->table_size;
 		for (size_t i = 0; i < STASH_SIZE; i++) {
-			if (map->stash[i]) {
-				map->stash[i] = map_cuckoo(map, map->stash[i], max_iter);
+			size_t stashed = set->stash[i];
+
+			if (stashed) {
+				set->stash[i] = 0;
+				set_cuckoo(set, stashed, max_iter);
 			}
 		}
-		while (key = map_cuckoo(map, key, max_iter)) {
-			map_rehash(map);
+		while (key = set_cuckoo(set, key, max_iter)) {
+			set_rehash(set);
 		}
 
-		map->key_count++;
-		map->insertion_count++;
+		set->key_count++;
+		set->insertion_count++;
 		return true;
 	}
 }
 
-bool map_delete(map_t *map, size_t key) {
+bool set_delete(set_t *set, size_t key) {
 	size_t *key_0;
+
+	if (!key) {
+		return false; // 0 marks an empty slot
+	}
 	key_0 =
-	    &map->table[(hash(key, map->h_0) & (1 << (map->table_size)) - 1) & ~1];
+	    &set->table[(hash(key, set->h_0) & (1 << (set->table_size)) - 1) & ~1];
 	if (*key_0 == key) {
 		*key_0 = 0;
-		map->key_count--;
+		set->key_count--;
 		return true;
 	}
 	key_0 =
-	    &map->table[(hash(key, map->h_1) & (1 << (map->table_size)) - 1) | 1];
+	    &set->table[(hash(key, set->h_1) & (1 << (set->table_size)) - 1) | 1];
 	if (*key_0 == key) {
 		*key_0 = 0;
-		map->key_count--;
+		set->key_count--;
 		return true;
 	}
 
 	for (size_t i = 0; i < STASH_SIZE; i++) {
-		if (map->table[i] == key) {
-			map->table[i] = 0;
-			map->key_count--;
+		if (set->stash[i] == key) {
+			set->stash[i] = 0;
+			set->key_count--;
 			return true;
 		}
 	}
@@ -197,25 +212,145 @@ bool map_delete(map_t *map, size_t key) {
 	return false;
 }
 
-bool map_search(map_t *map, size_t key) {
+bool set_search(set_t *set, size_t key) {
 	bool key_found = 0;
 
 	if (key ==
-	    map->table[(hash(key, map->h_0) & (1 << (map->table_size)) - 1) & ~1])
+	    set->table[(hash(key, set->h_0) & (1 << (set->table_size)) - 1) & ~1])
 		return true;
 	if (key ==
-	    map->table[(hash(key, map->h_1) & (1 << (map->table_size)) - 1) | 1])
+	    set->table[(hash(key, set->h_1) & (1 << (set->table_size)) - 1) | 1])
 		return true;
 
-	// key_found |= (key == map->table[(hash(key, map->h_0) & (1 <<
-	// (map->table_size)) - 1) & ~1]); key_found |= (key ==
-	// map->table[(hash(key, map->h_1) & (1 << (map->table_size)) - 1) |
+	// key_found |= (key == set->table[(hash(key, set->h_0) & (1 <<
+	// (set->table_size)) - 1) & ~1]); key_found |= (key ==
+	// set->table[(hash(key, set->h_1) & (1 << (set->table_size)) - 1) |
 	// 1]);
 
 	for (size_t i = 0; i < STASH_SIZE; i++) {
-		if (key == map->stash[i])
+		if (key == set->stash[i])
 			return true;
 	}
 
 	return false;
-}
\ No newline at end of file
+}
+
+size_t set_count(set_t *set) { return set->key_count; }
+
+/* The batched operations hash SET_BATCH_SIZE keys at a time. Tabulation
+ * lookups of different keys are independent, so with AVX2 four keys are
+ * hashed together, one gather per key byte. Both candidate slots of every
+ * key in the block are prefetched before the first one is probed. */
+static void set_hash_scalar(const size_t *keys, size_t n, size_t T[8][256],
+                            size_t *out) {
+	for (size_t i = 0; i < n; i++) {
+		out[i] = hash(keys[i], T);
+	}
+}
+
+/* Set once at load time rather than tested for every block */
+static void (*set_hash_batch)(const size_t *, size_t, size_t[8][256],
+                              size_t *) = set_hash_scalar;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+
+__attribute__((target("avx2"))) static void
+set_hash_avx2(const size_t *keys, size_t n, size_t T[8][256], size_t *out) {
+	const __m256i byte = _mm256_set1_epi64x(0xff);
+	size_t i = 0;
+
+	for (; i + 4 <= n; i += 4) {
+		__m256i k = _mm256_loadu_si256((const __m256i *)(keys + i));
+		__m256i h = _mm256_setzero_si256();
+
+		for (size_t j = 0; j < sizeof(size_t); j++) {
+			__m256i index = _mm256_and_si256(k, byte);
+			h = _mm256_xor_si256(
+			    h, _mm256_i64gather_epi64((const long long *)T[j], index, 8));
+			k = _mm256_srli_epi64(k, 8);
+		}
+
+		_mm256_storeu_si256((__m256i *)(out + i), h);
+	}
+
+	set_hash_scalar(keys + i, n - i, T, out + i);
+}
+
+__attribute__((constructor)) static void set_hash_init(void) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		set_hash_batch = set_hash_avx2;
+	}
+}
+
+#endif
+
+/* Looks up a block of at most SET_BATCH_SIZE keys, storing whether each is
+ * present in found, and returns the number present */
+static size_t set_search_block(set_t *set, const size_t *keys, size_t n,
+                               bool *found) {
+	size_t h_0[SET_BATCH_SIZE], h_1[SET_BATCH_SIZE];
+	size_t mask = (1UL << set->table_size) - 1;
+	size_t count = 0;
+
+	set_hash_batch(keys, n, set->h_0, h_0);
+	set_hash_batch(keys, n, set->h_1, h_1);
+
+	for (size_t i = 0; i < n; i++) {
+		h_0[i] = (h_0[i] & mask) & ~1UL;
+		h_1[i] = (h_1[i] & mask) | 1;
+		__builtin_prefetch(&set->table[h_0[i]]);
+		__builtin_prefetch(&set->table[h_1[i]]);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		size_t key = keys[i];
+		bool hit = key == set->table[h_0[i]] || key == set->table[h_1[i]];
+
+		for (size_t j = 0; j < STASH_SIZE && !hit; j++) {
+			hit = key == set->stash[j];
+		}
+
+		found[i] = hit;
+		count += hit;
+	}
+
+	return count;
+}
+
+/* set_search for n keys. found may be NULL; returns the number present. */
+size_t set_search_batch(set_t *set, const size_t *keys, size_t n,
+                        bool *found) {
+	bool block_found[SET_BATCH_SIZE];
+	size_t count = 0;
+
+	for (size_t k = 0; k < n; k += SET_BATCH_SIZE) {
+		size_t m = n - k < SET_BATCH_SIZE ? n - k : SET_BATCH_SIZE;
+
+		count += set_search_block(set, keys + k, m,
+		                          found ? found + k : block_found);
+	}
+
+	return count;
+}
+
+/* set_insert for n keys. A block is searched with batched hashing first, so
+ * only the keys that are absent go through the cuckoo insertion. Returns the
+ * number of keys processed, which is less than n only if an insertion
+ * failed. */
+size_t set_insert_batch(set_t *set, const size_t *keys, size_t n) {
+	bool found[SET_BATCH_SIZE];
+
+	for (size_t k = 0; k < n; k += SET_BATCH_SIZE) {
+		size_t m = n - k < SET_BATCH_SIZE ? n - k : SET_BATCH_SIZE;
+
+		set_search_block(set, keys + k, m, found);
+		for (size_t i = 0; i < m; i++) {
+			if (!found[i] && !set_insert(set, keys[k + i])) {
+				return k + i;
+			}
+		}
+	}
+
+	return n;
+}
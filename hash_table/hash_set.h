@@ -0,0 +1,22 @@
+#ifndef HASH_SET_H
+#define HASH_SET_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* Cuckoo set of nonzero size_t keys, with tabulation hashing and a stash */
+typedef struct set_t set_t;
+
+set_t *set_alloc(void);
+void set_free(set_t *set);
+
+bool set_insert(set_t *set, size_t key);
+bool set_delete(set_t *set, size_t key);
+bool set_search(set_t *set, size_t key);
+size_t set_count(set_t *set);
+
+size_t set_search_batch(set_t *set, const size_t *keys, size_t n,
+                        bool *found);
+size_t set_insert_batch(set_t *set, const size_t *keys, size_t n);
+
+#endif
@@ -0,0 +1,138 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hash_set.h"
+
+/* Behaviour tests for set_t. Random operations on keys of a small universe
+ * are mirrored in a reference array, and the set, searched one key at a
+ * time and in batches, must agree with it. */
+
+#define UNIVERSE 4096UL
+
+static uint64_t test_state = 0x9e3779b97f4a7c15UL;
+
+static size_t test_rand(size_t n) {
+	test_state ^= test_state << 13;
+	test_state ^= test_state >> 7;
+	test_state ^= test_state << 17;
+	return test_state % n;
+}
+
+/* Keys 1 to UNIVERSE - 1 of a set that holds the present ones */
+static void test_agree(set_t *set, const bool *present, size_t count) {
+	static size_t keys[UNIVERSE - 1];
+	static bool found[UNIVERSE - 1];
+
+	for (size_t k = 1; k < UNIVERSE; k++) {
+		keys[k - 1] = k;
+		assert(set_search(set, k) == present[k]);
+	}
+	assert(set_count(set) == count);
+
+	/* Batches of every length up to a few blocks, at every offset */
+	for (size_t n = 0; n < 100; n++) {
+		size_t start = test_rand(UNIVERSE - n);
+		assert(set_search_batch(set, keys + start, n, found) <= n);
+		for (size_t i = 0; i < n; i++) {
+			assert(found[i] == present[keys[start + i]]);
+		}
+	}
+	assert(set_search_batch(set, keys, UNIVERSE - 1, NULL) == count);
+}
+
+static void test_reference(void) {
+	set_t *set = set_alloc();
+	bool *present = calloc(UNIVERSE, sizeof(bool));
+	size_t count = 0;
+	assert(set && present);
+
+	assert(!set_insert(set, 0));
+	assert(!set_delete(set, 0));
+
+	for (size_t i = 1; i <= 64 * UNIVERSE; i++) {
+		size_t k = 1 + test_rand(UNIVERSE - 1);
+
+		if (test_rand(2)) {
+			assert(set_insert(set, k));
+			count += !present[k];
+			present[k] = true;
+		} else {
+			assert(set_delete(set, k) == present[k]);
+			count -= present[k];
+			present[k] = false;
+		}
+		assert(set_search(set, k) == present[k]);
+
+		if (i % (4 * UNIVERSE) == 0) {
+			test_agree(set, present, count);
+		}
+	}
+
+	set_free(set);
+	free(present);
+}
+
+/* set_insert_batch over keys with repeats, some already present */
+static void test_insert_batch(void) {
+	set_t *set = set_alloc();
+	size_t *keys = malloc(8 * UNIVERSE * sizeof(size_t));
+	bool *present = calloc(UNIVERSE, sizeof(bool));
+	size_t count = 0;
+	assert(set && keys && present);
+
+	for (size_t k = 1; k < UNIVERSE; k += 3) {
+		assert(set_insert(set, k));
+		present[k] = true;
+		count++;
+	}
+	for (size_t i = 0; i < 8 * UNIVERSE; i++) {
+		keys[i] = 1 + test_rand(UNIVERSE - 1);
+	}
+
+	for (size_t i = 0; i < 8 * UNIVERSE; i += 1000) {
+		size_t n = 8 * UNIVERSE - i < 1000 ? 8 * UNIVERSE - i : 1000;
+		assert(set_insert_batch(set, keys + i, n) == n);
+		for (size_t j = i; j < i + n; j++) {
+			count += !present[keys[j]];
+			present[keys[j]] = true;
+		}
+		assert(set_count(set) == count);
+	}
+	test_agree(set, present, count);
+
+	set_free(set);
+	free(keys);
+	free(present);
+}
+
+/* Keys far apart, enough of them that the set grows several times */
+static void test_growth(void) {
+	set_t *set = set_alloc();
+	size_t n = 200000;
+	assert(set);
+
+	for (size_t i = 1; i <= n; i++) {
+		assert(set_insert(set, i * 0x9e3779b97f4a7c15UL));
+	}
+	assert(set_count(set) == n);
+	for (size_t i = 1; i <= n; i++) {
+		assert(set_search(set, i * 0x9e3779b97f4a7c15UL));
+		assert(!set_search(set, i * 0x9e3779b97f4a7c15UL + 1));
+	}
+	for (size_t i = 1; i <= n; i += 2) {
+		assert(set_delete(set, i * 0x9e3779b97f4a7c15UL));
+	}
+	assert(set_count(set) == n / 2);
+
+	set_free(set);
+}
+
+int main(void) {
+	test_reference();
+	test_insert_batch();
+	test_growth();
+
+	puts("hash_set_test: ok");
+	return 0;
+}
@@ -1,11 +1,50 @@
 #include "hash_table.h"
+#include "swiss_table.h"
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef MAP_STATS
+#include <time.h>
+#define MAP_STAT_INC(map, field) ((map)->stats.field++)
+#define MAP_STAT_ADD(map, field, n) ((map)->stats.field += (n))
+#else
+#define MAP_STAT_INC(map, field) ((void)0)
+#define MAP_STAT_ADD(map, field, n) ((void)(n))
+#endif
 
 #define BUCKET_SIZE 4UL
 #define STASH_SIZE 8UL
 #define MAP_INIT_SIZE 8UL
 #define ALPHA 5UL
 #define EPSILON 1.5f
-#define BUCKET_ALIGNMENT 8UL*BUCKET_SIZE
+#define BUCKET_ALIGNMENT 64UL
+#define MATCH_STASH (2 * BUCKET_SIZE)
+#define MATCH_NONE (MATCH_STASH + STASH_SIZE)
+#define MAP_BATCH_SIZE 32UL
+#define MIGRATE_STEP 4UL
+#define MAX_LOAD 0.2f
+#define SHRINK_RATIO 4UL
+#define CUCKOO_MAX_NODES 512UL
+#define CUCKOO_ROOT UINT32_MAX
+#define ARENA_CHUNK_SIZE (1UL << 16)
+#define SLAB_MIN_COUNT 64UL
+#define SLAB_MAX_COUNT (1UL << 16)
+#define MAP_FILE_MAGIC "MAPSNAP2" /* 2: zhash reduces by x^4 + x^3 + x + 1 */
+#define MAP_FILE_BYTE_ORDER 0x0102030405060708UL
+#define MAP_FILE_MAX_TABLE_SIZE 48UL
+#define LOCK_STRIPES 1024UL
+#define MAP_MAX_READERS 256UL
+#define RETIRE_BATCH 64UL
+#define SPINS_BEFORE_YIELD 64UL
 
 #define table_construct(KEY_TYPE, VALUE_TYPE)                                  \
 	map_alloc(sizeof(KEY_TYPE), sizeof(VALUE_TYPE),                            \
@@ -13,16 +52,82 @@
 	              ? _Alignof(KEY_TYPE)                                         \
 	              : _Alignof(VALUE_TYPE))
 
+/* A bucket keeps a 16-bit fingerprint of every occupied slot next to the slot
+ * pointers, so that a probe can discard non-matching slots without touching
+ * entry memory. Empty slots carry tag 0, which map_tag never produces. */
+typedef struct bucket_t {
+	_Alignas(BUCKET_ALIGNMENT) uint16_t tag[BUCKET_SIZE];
+	void *slot[BUCKET_SIZE];
+} bucket_t;
+
+/* The tags of a bucket, or of half the stash, as one word. Optimistic
+ * readers of a concurrent map load them, and the slots, while a writer may
+ * be storing to them, so both sides access them atomically: that keeps the
+ * race defined, and the versions decide whether its result is kept. */
+typedef uint64_t __attribute__((may_alias)) tag_word_t;
+_Static_assert(BUCKET_SIZE == 4 && STASH_SIZE == 8, "tags fill whole words");
+
+/* Entries are carved out of slabs, each slab holding twice as many entries as
+ * the previous one up to SLAB_MAX_COUNT. Released entries are threaded onto a
+ * free list through their first word and reused before the slab is bumped.
+ * Bit i of live is set while the i-th entry of the slab is in the map, which
+ * lets iteration stream through the slabs instead of chasing slots. */
+typedef struct slab_t {
+	size_t entry_count;
+	char *entries;
+	uint64_t live[];
+} slab_t;
+
+/* String keys are copied into append-only chunks that never move, so the
+ * map_str_t in an entry can point straight at its bytes. */
+typedef struct arena_chunk_t arena_chunk_t;
+struct arena_chunk_t {
+	arena_chunk_t *next;
+	size_t used, size;
+	char data[];
+};
+
+/* A slot visited by the breadth-first search for a cuckoo path. alt_hash is
+ * the hash of the slot's entry for the other table, where it would move. */
+typedef struct cuckoo_node_t {
+	bucket_t *bucket;
+	size_t alt_hash;
+	uint32_t parent;
+	uint8_t slot, table, depth;
+} cuckoo_node_t;
+
+/* Concurrent readers announce the epoch they started in, and memory retired
+ * by a writer is reclaimed once every announced epoch is newer than its
+ * retirement. The reader slots are shared by all maps of the process and
+ * padded, so that readers never write to a common cache line. */
+typedef struct reader_t {
+	_Alignas(BUCKET_ALIGNMENT) size_t epoch; /* 0 while not reading */
+	bool in_use;
+} reader_t;
+
+typedef struct retired_t {
+	void *ptr;
+	size_t epoch;
+	bool entry; /* back to the free list rather than to free */
+} retired_t;
+
+static void map_rehash(map_t *map);
+static void *map_cuckoo(map_t *map, void *item, size_t max_iter);
+
 struct map_t {
 	size_t entry_count;
 	size_t insertion_count;
 	size_t table_size;
+	size_t min_table_size; /* set by map_reserve, deletions stay above */
+	size_t generation; /* bumped whenever the seeds change */
+	float max_load;
 
 	size_t key_size;
 	size_t value_size;
 	size_t alignment;
 
 	size_t (*hash)(const void *restrict, size_t, const void *restrict);
+	hash_batch_t hash_batch; /* of hash, for size_t keys, or NULL */
 	int (*compare)(const void *, const void *, size_t);
 
 	void (*key_write)(void *restrict, const void *restrict, size_t);
@@ -31,8 +136,59 @@ struct map_t {
 	size_t seed_size;
 	void *seed_0, *seed_1;
 
-	void *(*table_0)[BUCKET_SIZE], *(*table_1)[BUCKET_SIZE];
+	bucket_t *table_0, *table_1;
 	void *stash[STASH_SIZE];
+	_Alignas(uint64_t) uint16_t stash_tag[STASH_SIZE];
+
+	/* Incremental growth keeps the seeds and splits bucket i of the old
+	 * tables into buckets i and i + old size of the new ones. Buckets below
+	 * migrate_index have been split, the rest still live in the old tables. */
+	bool incremental;
+	bucket_t *old_table_0, *old_table_1;
+	size_t migrate_index;
+
+	/* With hash_cache set, every entry carries its seed_0 and seed_1 hashes
+	 * at hash_offset, behind the value, so displacement and incremental
+	 * growth never rehash a key. Only a rehash with new seeds recomputes
+	 * them. */
+	bool hash_cache;
+	size_t hash_offset;
+
+	/* slabs is ordered by address, so that the slab of an entry can be
+	 * found by binary search. slab_current is the one being bumped. */
+	size_t entry_stride;
+	slab_t **slabs;
+	size_t slab_count, slab_size;
+	slab_t *slab_current;
+	char *slab_next, *slab_end;
+	void *free_list;
+
+	bool str_keys;
+	arena_chunk_t *key_arena;
+
+	/* In concurrent mode writers hold write_lock and make the version of
+	 * whatever they modify odd for the duration: stripes[LOCK_STRIPES]
+	 * covers the stash, the other stripes are shared by the buckets that
+	 * hash to them and table_version covers the seeds and the tables. */
+	bool concurrent;
+	pthread_mutex_t write_lock;
+	size_t table_version, table_writes; /* table_writes is the nesting */
+	size_t *stripes;
+	retired_t *retired;
+	size_t retired_count, retired_size;
+
+	/* A map opened by map_open_mmap is read-only. Its seeds and tables
+	 * live in the mapping, and slots hold entry offsets into it. */
+	const char *mapped;
+	size_t mapped_size;
+
+	/* A MAP_ENGINE_SWISS map keeps its entries in swiss and has no tables;
+	 * the public functions hand over to it. */
+	swiss_t *swiss;
+
+#ifdef MAP_STATS
+	map_stats_t stats;
+#endif
 };
 
 void *ptr_align_up(void *ptr, size_t alignment) {
@@ -48,31 +204,499 @@ size_t entry_size(size_t key_size, size_t value_size, size_t alignment) {
 	return offset;
 }
 
-void *alloc_entry(size_t key_size, size_t value_size, size_t alignment) {
-	return malloc(entry_size(key_size, value_size, alignment));
+static size_t entry_stride(size_t key_size, size_t value_size,
+                           size_t alignment) {
+	size_t stride = entry_size(key_size, value_size, alignment);
+	if (stride < sizeof(void *)) {
+		stride = sizeof(void *); // room for the free list link
+	}
+	return (stride + alignment - 1) & ~(alignment - 1);
 }
 
-void generate_seed(void *T, size_t n) { arc4random_buf(T, n); }
+static size_t map_slab_grow_count(map_t *map) {
+	size_t count = map->slab_current ? 2 * map->slab_current->entry_count
+	                                 : SLAB_MIN_COUNT;
+	return count < SLAB_MAX_COUNT ? count : SLAB_MAX_COUNT;
+}
 
-size_t map_count(map_t *map) { return map->entry_count; }
+static size_t map_slab_words(size_t count) { return (count + 63) / 64; }
 
-void map_free(map_t *map) {
-	for (size_t i = 0; i < (1 << map->table_size); i++) {
-		for (size_t j = 0; j < BUCKET_SIZE; j++) {
-			free(map->table_0[i][j]);
-			free(map->table_1[i][j]);
+static slab_t *map_slab_alloc(map_t *map, size_t count) {
+	if (map->slab_count == map->slab_size) {
+		size_t size = map->slab_size ? 2 * map->slab_size : 16;
+		slab_t **slabs = realloc(map->slabs, size * sizeof(slab_t *));
+		if (!slabs) {
+			return NULL;
+		}
+		map->slabs = slabs;
+		map->slab_size = size;
+	}
+
+	size_t words = map_slab_words(count);
+	slab_t *slab = malloc(sizeof(slab_t) + words * sizeof(uint64_t) +
+	                      map->alignment - 1 + count * map->entry_stride);
+	if (slab) {
+		slab->entry_count = count;
+		slab->entries = ptr_align_up(slab->live + words, map->alignment);
+		memset(slab->live, 0, words * sizeof(uint64_t));
+
+		size_t i = map->slab_count++;
+		for (; i && (uintptr_t)slab < (uintptr_t)map->slabs[i - 1]; i--) {
+			map->slabs[i] = map->slabs[i - 1];
+		}
+		map->slabs[i] = slab;
+
+		map->slab_current = slab;
+		map->slab_next = slab->entries;
+		map->slab_end = map->slab_next + count * map->entry_stride;
+	}
+
+	return slab;
+}
+
+static void map_slab_free_all(map_t *map) {
+	for (size_t i = 0; i < map->slab_count; i++) {
+		free(map->slabs[i]);
+	}
+	free(map->slabs);
+
+	map->slabs = NULL;
+	map->slab_count = map->slab_size = 0;
+	map->slab_current = NULL;
+	map->slab_next = map->slab_end = NULL;
+	map->free_list = NULL;
+}
+
+static slab_t *map_entry_slab(map_t *map, const void *item) {
+	size_t lo = 0, hi = map->slab_count;
+
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if ((uintptr_t)map->slabs[mid]->entries <= (uintptr_t)item) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return map->slabs[lo];
+}
+
+static void map_entry_set_live(map_t *map, const void *item, bool live) {
+	slab_t *slab = map_entry_slab(map, item);
+	size_t i = ((const char *)item - slab->entries) / map->entry_stride;
+
+	if (live) {
+		slab->live[i / 64] |= 1UL << (i % 64);
+	} else {
+		slab->live[i / 64] &= ~(1UL << (i % 64));
+	}
+}
+
+static void *map_entry_alloc(map_t *map) {
+	void *item = map->free_list;
+
+	if (item) {
+		memcpy(&map->free_list, item, sizeof(void *));
+		return item;
+	} else if (map->slab_next == map->slab_end &&
+	           !map_slab_alloc(map, map_slab_grow_count(map))) {
+		return NULL;
+	} else {
+		item = map->slab_next;
+		map->slab_next += map->entry_stride;
+		return item;
+	}
+}
+
+static void map_entry_release(map_t *map, void *item) {
+	memcpy(item, &map->free_list, sizeof(void *));
+	map->free_list = item;
+}
+
+/* Makes room for count more entries in a single slab. What is left of the
+ * current slab is handed to the free list so that it is not lost. */
+static bool map_slab_reserve(map_t *map, size_t count) {
+	size_t available = (map->slab_end - map->slab_next) / map->entry_stride;
+
+	if (count <= available) {
+		return true;
+	}
+
+	for (; map->slab_next != map->slab_end;
+	     map->slab_next += map->entry_stride) {
+		map_entry_release(map, map->slab_next);
+	}
+
+	return map_slab_alloc(map, count - available) != NULL;
+}
+
+static reader_t map_readers[MAP_MAX_READERS];
+static size_t map_epoch = 1;
+static pthread_once_t map_reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t map_reader_key;
+static _Thread_local size_t map_reader_slot = SIZE_MAX;
+
+static void map_reader_exit(void *slot) {
+	__atomic_store_n(&map_readers[(uintptr_t)slot - 1].in_use, false,
+	                 __ATOMIC_RELEASE);
+}
+
+static void map_reader_init(void) {
+	pthread_key_create(&map_reader_key, map_reader_exit);
+}
+
+/* Enters the epoch the calling thread reads in, claiming a reader slot on
+ * its first read. Returns NULL if every slot is taken. */
+static reader_t *map_read_begin(void) {
+	if (map_reader_slot == SIZE_MAX) {
+		pthread_once(&map_reader_once, map_reader_init);
+		for (size_t i = 0; i < MAP_MAX_READERS; i++) {
+			bool in_use = false;
+			if (__atomic_compare_exchange_n(&map_readers[i].in_use, &in_use,
+			                                true, false, __ATOMIC_ACQUIRE,
+			                                __ATOMIC_RELAXED)) {
+				pthread_setspecific(map_reader_key, (void *)(i + 1));
+				map_reader_slot = i;
+				break;
+			}
+		}
+		if (map_reader_slot == SIZE_MAX) {
+			return NULL;
+		}
+	}
+
+	reader_t *reader = &map_readers[map_reader_slot];
+	__atomic_store_n(&reader->epoch,
+	                 __atomic_load_n(&map_epoch, __ATOMIC_ACQUIRE),
+	                 __ATOMIC_RELAXED);
+	/* Pairs with the fence in map_reclaim: either the writer sees this
+	 * epoch, or this reader sees what the writer published before retiring
+	 * the old memory. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return reader;
+}
+
+static void map_read_end(reader_t *reader) {
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Returns the oldest epoch a reader is still in, SIZE_MAX if none is */
+static size_t map_oldest_epoch(void) {
+	size_t oldest = SIZE_MAX;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (size_t i = 0; i < MAP_MAX_READERS; i++) {
+		size_t epoch = __atomic_load_n(&map_readers[i].epoch, __ATOMIC_ACQUIRE);
+		if (epoch && epoch < oldest) {
+			oldest = epoch;
+		}
+	}
+
+	return oldest;
+}
+
+/* Backs off a thread that spins on others, yielding once pausing has not
+ * helped */
+static inline void map_relax(size_t *spins) {
+	if (++*spins < SPINS_BEFORE_YIELD) {
+#ifdef __SSE2__
+		_mm_pause();
+#endif
+	} else {
+		sched_yield();
+	}
+}
+
+/* Returns once every reader that started before the call has finished */
+static void map_wait_readers(void) {
+	size_t epoch = __atomic_fetch_add(&map_epoch, 1, __ATOMIC_ACQ_REL);
+	for (size_t spins = 0; map_oldest_epoch() <= epoch; map_relax(&spins)) {
+	}
+}
+
+static void map_reclaim_ptr(map_t *map, void *ptr, bool entry) {
+	if (entry) {
+		map_entry_release(map, ptr);
+	} else {
+		free(ptr);
+	}
+}
+
+/* Frees whatever no reader can reach anymore, or everything if all is set */
+static void map_reclaim(map_t *map, bool all) {
+	size_t oldest = all ? SIZE_MAX : map_oldest_epoch();
+	size_t kept = 0;
+
+	for (size_t i = 0; i < map->retired_count; i++) {
+		retired_t *retired = &map->retired[i];
+		if (all || retired->epoch < oldest) {
+			map_reclaim_ptr(map, retired->ptr, retired->entry);
+		} else {
+			map->retired[kept++] = *retired;
+		}
+	}
+	map->retired_count = kept;
+}
+
+/* Hands ptr, already unlinked from the map, back once no reader can hold it.
+ * Entries go to the free list, anything else to free. If the retired list
+ * cannot grow, the writer waits for the current readers instead. */
+static void map_retire(map_t *map, void *ptr, bool entry) {
+	if (!map->concurrent) {
+		map_reclaim_ptr(map, ptr, entry);
+		return;
+	}
+
+	if (map->retired_count == map->retired_size) {
+		size_t size = map->retired_size ? 2 * map->retired_size : RETIRE_BATCH;
+		retired_t *retired = realloc(map->retired, size * sizeof(retired_t));
+		if (!retired) {
+			map_wait_readers();
+			map_reclaim_ptr(map, ptr, entry);
+			return;
 		}
+		map->retired = retired;
+		map->retired_size = size;
+	}
+
+	map->retired[map->retired_count++] = (retired_t){
+	    .ptr = ptr,
+	    .epoch = __atomic_fetch_add(&map_epoch, 1, __ATOMIC_ACQ_REL),
+	    .entry = entry};
+
+	if (map->retired_count % RETIRE_BATCH == 0) {
+		map_reclaim(map, false);
+	}
+}
+
+static inline void map_lock(map_t *map) {
+	if (map->concurrent) {
+		pthread_mutex_lock(&map->write_lock);
+	}
+}
+
+static inline void map_unlock(map_t *map) {
+	if (map->concurrent) {
+		pthread_mutex_unlock(&map->write_lock);
+	}
+}
+
+/* The version of bucket, or of the stash if bucket is NULL */
+static inline size_t *map_stripe(map_t *map, const bucket_t *bucket) {
+	if (!bucket) {
+		return &map->stripes[LOCK_STRIPES];
+	}
+	return &map->stripes[((uintptr_t)bucket / sizeof(bucket_t)) &
+	                     (LOCK_STRIPES - 1)];
+}
+
+static inline void map_version_begin(size_t *version) {
+	__atomic_store_n(version, *version + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void map_version_end(size_t *version) {
+	__atomic_store_n(version, *version + 1, __ATOMIC_RELEASE);
+}
+
+/* Brackets a writer's change to one bucket (or the stash) so that optimistic
+ * readers of it retry. Pairs must not nest, two buckets may share a
+ * stripe. */
+static inline void map_write_begin(map_t *map, const bucket_t *bucket) {
+	if (map->concurrent) {
+		map_version_begin(map_stripe(map, bucket));
+	}
+}
+
+static inline void map_write_end(map_t *map, const bucket_t *bucket) {
+	if (map->concurrent) {
+		map_version_end(map_stripe(map, bucket));
+	}
+}
+
+/* Table writes nest, a rebuild may have to rehash */
+static inline void map_table_write_begin(map_t *map) {
+	if (map->concurrent && map->table_writes++ == 0) {
+		map_version_begin(&map->table_version);
 	}
+}
+
+static inline void map_table_write_end(map_t *map) {
+	if (map->concurrent && --map->table_writes == 0) {
+		map_version_end(&map->table_version);
+	}
+}
+
+void generate_seed(void *T, size_t n) { arc4random_buf(T, n); }
+
+size_t map_count(map_t *map) {
+	return map->swiss ? swiss_count(map->swiss) : map->entry_count;
+}
+
+/* Slots of both tables, the stash aside. An insertion grows the map once it
+ * holds the maximum load of them. */
+size_t map_capacity(map_t *map) {
+	return map->swiss ? swiss_capacity(map->swiss)
+	                  : (1UL << (map->table_size + 1)) * BUCKET_SIZE;
+}
+
+#ifdef MAP_STATS
+static double map_stats_clock(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+#endif
+
+/* Counters are only kept when built with MAP_STATS; otherwise stats is
+ * zeroed and false is returned. */
+bool map_get_stats(map_t *map, map_stats_t *stats) {
+#ifdef MAP_STATS
+	*stats = map->stats;
+	stats->stash_count = 0;
 	for (size_t i = 0; i < STASH_SIZE; i++) {
-		free(map->stash[i]);
+		stats->stash_count += map->stash[i] != NULL;
+	}
+	return true;
+#else
+	*stats = (map_stats_t){0};
+	return false;
+#endif
+}
+
+void map_reset_stats(map_t *map) {
+#ifdef MAP_STATS
+	map->stats = (map_stats_t){0};
+#endif
+}
+
+static inline size_t map_index(map_t *map, size_t h) {
+	return h & ((1UL << map->table_size) - 1);
+}
+
+static inline bucket_t *map_bucket(map_t *map, bucket_t *table,
+                                   bucket_t *old_table, size_t h) {
+	if (old_table) {
+		size_t i = h & ((1UL << (map->table_size - 1)) - 1);
+		if (map->migrate_index <= i) {
+			return &old_table[i];
+		}
+	}
+	return &table[map_index(map, h)];
+}
+
+static inline bucket_t *map_bucket_0(map_t *map, size_t h) {
+	return map_bucket(map, map->table_0, map->old_table_0, h);
+}
+
+static inline bucket_t *map_bucket_1(map_t *map, size_t h) {
+	return map_bucket(map, map->table_1, map->old_table_1, h);
+}
+
+static inline uint16_t map_tag(size_t h) {
+	uint16_t tag = (uint16_t)(h >> 48);
+	return tag ? tag : 1;
+}
+
+static inline size_t map_entry_hash_0(map_t *map, const void *item) {
+	if (map->hash_cache) {
+		size_t h;
+		memcpy(&h, (const char *)item + map->hash_offset, sizeof(size_t));
+		return h;
+	}
+	return map->hash(item, map->key_size, map->seed_0);
+}
+
+static inline size_t map_entry_hash_1(map_t *map, const void *item) {
+	if (map->hash_cache) {
+		size_t h;
+		memcpy(&h, (const char *)item + map->hash_offset + sizeof(size_t),
+		       sizeof(size_t));
+		return h;
+	}
+	return map->hash(item, map->key_size, map->seed_1);
+}
+
+static inline void map_entry_set_hash(map_t *map, void *item, size_t h_0,
+                                      size_t h_1) {
+	memcpy((char *)item + map->hash_offset, &h_0, sizeof(size_t));
+	memcpy((char *)item + map->hash_offset + sizeof(size_t), &h_1,
+	       sizeof(size_t));
+}
+
+static void map_rehash_cache(map_t *map, void *item) {
+	if (item) {
+		map_entry_set_hash(map, item,
+		                   map->hash(item, map->key_size, map->seed_0),
+		                   map->hash(item, map->key_size, map->seed_1));
+	}
+}
+
+static inline uint64_t map_tags_load(const uint16_t *tags) {
+	return __atomic_load_n((const tag_word_t *)tags, __ATOMIC_RELAXED);
+}
+
+/* Replaces one tag of its word */
+static inline void map_tag_store(uint16_t *tag, uint16_t value) {
+	tag_word_t *word = (tag_word_t *)((uintptr_t)tag & ~(uintptr_t)7);
+	uint64_t bits = __atomic_load_n(word, __ATOMIC_RELAXED);
+	uint16_t tags[4];
+
+	memcpy(tags, &bits, sizeof(bits));
+	tags[tag - (uint16_t *)word] = value;
+	memcpy(&bits, tags, sizeof(bits));
+	__atomic_store_n(word, bits, __ATOMIC_RELAXED);
+}
+
+/* Publishes item, whose key and value are already written, in slot */
+static inline void map_slot_store(void **slot, uint16_t *tag, void *item,
+                                  uint16_t value) {
+	__atomic_store_n(slot, item, __ATOMIC_RELEASE);
+	map_tag_store(tag, value);
+}
+
+static inline void *map_slot_load(void *const *slot) {
+	return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+static void map_bucket_clear(bucket_t *bucket) {
+	for (size_t i = 0; i < BUCKET_SIZE; i++) {
+		map_slot_store(&bucket->slot[i], &bucket->tag[i], NULL, 0);
+	}
+}
+
+void map_free(map_t *map) {
+	if (map->concurrent) {
+		map_reclaim(map, true);
+		pthread_mutex_destroy(&map->write_lock);
+	}
+	free(map->retired);
+	free(map->stripes);
+
+	map_slab_free_all(map);
+
+	if (map->mapped) {
+		munmap((void *)map->mapped, map->mapped_size);
+		map->table_0 = map->table_1 = NULL;
+		map->seed_0 = map->seed_1 = NULL;
 	}
 
 	free(map->table_0);
 	free(map->table_1);
+	free(map->old_table_0);
+	free(map->old_table_1);
 
 	free(map->seed_0);
 	free(map->seed_1);
 
+	swiss_free(map->swiss);
+
+	for (arena_chunk_t *chunk = map->key_arena, *next; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
 	free(map);
 }
 
@@ -84,24 +708,28 @@ map_t *map_alloc(size_t key_size, size_t value_size, size_t alignment) {
 	map_t *map = malloc(sizeof(map_t));
 	void *seed_0 = aligned_alloc(BUCKET_ALIGNMENT, SEED_SIZE);
 	void *seed_1 = aligned_alloc(BUCKET_ALIGNMENT, SEED_SIZE);
-	void *table_0 = aligned_alloc(
-	    BUCKET_ALIGNMENT, sizeof(void *) * BUCKET_SIZE * (1 << MAP_INIT_SIZE));
-	void *table_1 = aligned_alloc(
-	    BUCKET_ALIGNMENT, sizeof(void *) * BUCKET_SIZE * (1 << MAP_INIT_SIZE));
-	void *stash = aligned_alloc(BUCKET_ALIGNMENT, sizeof(void *) * STASH_SIZE);
+	void *table_0 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << MAP_INIT_SIZE));
+	void *table_1 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << MAP_INIT_SIZE));
 
 	if (map != NULL && map != NULL && seed_0 != NULL && seed_1 != NULL &&
-	    table_0 != NULL && table_1 != NULL && stash != NULL) {
+	    table_0 != NULL && table_1 != NULL) {
 		*map = (map_t){
 		    .entry_count = 0,
 		    .insertion_count = 0,
 		    .table_size = MAP_INIT_SIZE,
+		    .min_table_size = MAP_INIT_SIZE,
+		    .generation = 0,
+		    .max_load = MAX_LOAD,
 
 		    .key_size = key_size,
 		    .value_size = value_size,
 		    .alignment = alignment,
 
 		    .hash = zhash,
+		    .hash_batch =
+		        key_size == sizeof(size_t) ? hash_batch_for(zhash) : NULL,
 		    .compare = memcmp,
 
 		    .key_write =
@@ -115,36 +743,93 @@ map_t *map_alloc(size_t key_size, size_t value_size, size_t alignment) {
 
 		    .table_0 = table_0,
 		    .table_1 = table_1,
-		    .stash = stash};
+
+		    .incremental = false,
+		    .old_table_0 = NULL,
+		    .old_table_1 = NULL,
+		    .migrate_index = 0,
+
+		    .hash_cache = false,
+		    .hash_offset = 0,
+
+		    .entry_stride = entry_stride(key_size, value_size, alignment),
+		    .slabs = NULL,
+		    .slab_count = 0,
+		    .slab_size = 0,
+		    .slab_current = NULL,
+		    .slab_next = NULL,
+		    .slab_end = NULL,
+		    .free_list = NULL,
+
+		    .str_keys = false,
+		    .key_arena = NULL,
+
+		    .concurrent = false,
+		    .table_version = 0,
+		    .table_writes = 0,
+		    .stripes = NULL,
+		    .retired = NULL,
+		    .retired_count = 0,
+		    .retired_size = 0,
+
+		    .mapped = NULL,
+		    .mapped_size = 0,
+
+		    .swiss = NULL};
+
+		map_reset_stats(map);
 
 		generate_seed(seed_0, SEED_SIZE);
 		generate_seed(seed_1, SEED_SIZE);
 
 		for (size_t i = 0; i < (1 << map->table_size); i++) {
-			for (size_t j = 0; j < BUCKET_SIZE; j++) {
-				map->table_0[i][j] = NULL;
-				map->table_1[i][j] = NULL;
-			}
+			map_bucket_clear(&map->table_0[i]);
+			map_bucket_clear(&map->table_1[i]);
 		}
 
 		for (size_t i = 0; i < STASH_SIZE; i++) {
 			map->stash[i] = NULL;
+			map->stash_tag[i] = 0;
 		}
 		return map;
 	} else {
-		free(map->seed_0);
-		free(map->seed_1);
-		free(map->table_0);
-		free(map->table_1);
-		free(map->stash);
+		free(seed_0);
+		free(seed_1);
+		free(table_0);
+		free(table_1);
 		free(map);
 		return NULL;
 	}
 }
 
+/* Allocates a map on the given engine. MAP_ENGINE_SWISS stores entries inline
+ * in an open addressing table (see swiss_table.h): cheaper insertions and no
+ * pointer to chase, but a value pointer is only valid until the next
+ * insertion moves it. Such maps cannot be concurrent, saved or hash cached,
+ * and ignore map_set_max_load and map_set_incremental. */
+map_t *map_alloc_engine(size_t key_size, size_t value_size, size_t alignment,
+                        map_engine_t engine) {
+	map_t *map = map_alloc(key_size, value_size, alignment);
+
+	if (map && engine == MAP_ENGINE_SWISS) {
+		map->swiss = swiss_alloc(key_size, value_size,
+		                         alignment ? alignment : 1);
+		if (!map->swiss) {
+			map_free(map);
+			return NULL;
+		}
+
+		free(map->table_0);
+		free(map->table_1);
+		map->table_0 = map->table_1 = NULL;
+	}
+
+	return map;
+}
+
 map_t *map_alloc_strn(size_t key_size, size_t value_size) {
 	map_t *map = map_alloc(key_size, value_size, _Alignof(char));
-	map_set_hash(map, strnhash);
+	map_set_hash(map, strnwyhash);
 	map_set_compare(map, (int (*)(const void *, const void *, size_t))strncmp);
 	map_set_key_write(
 	    map, (void (*)(void *restrict, const void *restrict, size_t))strncpy);
@@ -153,36 +838,123 @@ map_t *map_alloc_strn(size_t key_size, size_t value_size) {
 	return map;
 }
 
+/* Unseeded wyhash, used as the seed independent fingerprint of string keys */
+static size_t map_str_fingerprint(const char *data, size_t length) {
+	return wyhash(data, length, NULL);
+}
+
+map_str_t map_str_key(const char *data, size_t length) {
+	return (map_str_t){.data = data,
+	                   .length = length,
+	                   .hash = map_str_fingerprint(data, length)};
+}
+
+/* The seeded hash only mixes the cached fingerprint, so string keys are never
+ * rescanned, not even by a rehash with new seeds. */
+static size_t map_str_hash(const void *key, size_t key_size,
+                           const void *seed) {
+	size_t h = ((const map_str_t *)key)->hash ^ *(const size_t *)seed;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdUL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53UL;
+	return h ^ (h >> 33);
+}
+
+static int map_str_compare(const void *a, const void *b, size_t key_size) {
+	const map_str_t *s = a, *t = b;
+	if (s->length != t->length || s->hash != t->hash) {
+		return 1;
+	}
+	return memcmp(s->data, t->data, s->length);
+}
+
+/* Copies the bytes of the key in item into the arena and points it there */
+static bool map_str_intern(map_t *map, void *item) {
+	map_str_t *key = item;
+	arena_chunk_t *chunk = map->key_arena;
+
+	if (!chunk || chunk->size - chunk->used < key->length) {
+		size_t size =
+		    key->length < ARENA_CHUNK_SIZE ? ARENA_CHUNK_SIZE : key->length;
+		chunk = malloc(sizeof(arena_chunk_t) + size);
+		if (!chunk) {
+			return false;
+		}
+		*chunk = (arena_chunk_t){
+		    .next = map->key_arena, .used = 0, .size = size};
+		map->key_arena = chunk;
+	}
+
+	char *data = chunk->data + chunk->used;
+	memcpy(data, key->data, key->length);
+	chunk->used += key->length;
+	key->data = data;
+	return true;
+}
+
+/* Keys of any length are passed as map_str_t (see map_str_key) and stored as
+ * a pointer into the map's key arena, their length and a cached fingerprint.
+ * Lookups compare length and fingerprint before touching the bytes. Arena
+ * space of deleted keys is not reused. */
+map_t *map_alloc_str(size_t value_size, size_t alignment) {
+	if (alignment < _Alignof(map_str_t)) {
+		alignment = _Alignof(map_str_t);
+	}
+
+	map_t *map = map_alloc(sizeof(map_str_t), value_size, alignment);
+	if (map) {
+		map_set_hash(map, map_str_hash);
+		map_set_compare(map, map_str_compare);
+		map->str_keys = true;
+	}
+	return map;
+}
+
 void map_set_hash(map_t *map,
                   size_t (*hash)(const void *, size_t, const void *)) {
 	map->hash = hash;
+	map->hash_batch =
+	    map->key_size == sizeof(size_t) ? hash_batch_for(hash) : NULL;
+	if (map->swiss) {
+		swiss_set_hash(map->swiss, hash);
+	}
 }
 void map_set_compare(map_t *map,
                       int (*compare)(const void *, const void *, size_t)) {
 	map->compare = compare;
+	if (map->swiss) {
+		swiss_set_compare(map->swiss, compare);
+	}
 }
 void map_set_key_write(map_t *map,
                        void (*key_write)(void *restrict, const void *restrict,
                                          size_t)) {
 	map->key_write = key_write;
+	if (map->swiss) {
+		swiss_set_key_write(map->swiss, key_write);
+	}
 }
 void map_set_value_write(map_t *map,
                          void (*value_write)(void *restrict,
                                              const void *restrict, size_t)) {
 	map->value_write = value_write;
+	if (map->swiss) {
+		swiss_set_value_write(map->swiss, value_write);
+	}
 }
 
 static inline bool map_resize(map_t *map, size_t new_size) {
-	void *new_table_0 = aligned_alloc(
-	    BUCKET_ALIGNMENT, sizeof(void *) * BUCKET_SIZE * (1 << (new_size)));
-	void *new_table_1 = aligned_alloc(
-	    BUCKET_ALIGNMENT, sizeof(void *) * BUCKET_SIZE * (1 << (new_size)));
+	void *new_table_0 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
+	void *new_table_1 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
 
 	if (new_table_0 != NULL && new_table_1 != NULL) {
 		memcpy(new_table_0, map->table_0,
-		       sizeof(void *) * BUCKET_SIZE * (1 << (map->table_size)));
+		       sizeof(bucket_t) * (1 << (map->table_size)));
 		memcpy(new_table_1, map->table_1,
-		       sizeof(void *) * BUCKET_SIZE * (1 << (map->table_size)));
+		       sizeof(bucket_t) * (1 << (map->table_size)));
 
 		free(map->table_0);
 		free(map->table_1);
@@ -191,10 +963,8 @@ static inline bool map_resize(map_t *map, size_t new_size) {
 		map->table_1 = new_table_1;
 
 		for (size_t i = (1 << map->table_size); i < (1 << new_size); i++) {
-			for (size_t j = 0; j < BUCKET_SIZE; j++) {
-				map->table_0[i][j] = NULL;
-				map->table_1[i][j] = NULL;
-			}
+			map_bucket_clear(&map->table_0[i]);
+			map_bucket_clear(&map->table_1[i]);
 		}
 
 		map->table_size = new_size;
@@ -207,102 +977,717 @@ static inline bool map_resize(map_t *map, size_t new_size) {
 }
 
 static bool map_should_resize(map_t *map) {
-	return ((1UL << (map->table_size + 1)) * BUCKET_SIZE <=
-	        (5 * map->entry_count));
+	return ((1UL << (map->table_size + 1)) * BUCKET_SIZE * map->max_load <=
+	        map->entry_count);
 }
 
-static void *map_probe_bucket(map_t *map, void *bucket[BUCKET_SIZE],
-                              const void *restrict key) {
-	for (size_t i = 0; i < BUCKET_SIZE; i++) {
-		if (bucket[i] && map->compare(key, bucket[i], map->key_size) == 0) {
-			return bucket[i];
-		}
+/* Deletions shrink the tables once the map has fallen to 1/SHRINK_RATIO of
+ * the size that makes it grow, into tables that are half full */
+static bool map_should_shrink(map_t *map) {
+	return map->table_size > map->min_table_size &&
+	       map->entry_count * SHRINK_RATIO <
+	           (1UL << (map->table_size + 1)) * BUCKET_SIZE * map->max_load;
+}
+
+/* The smallest table size that holds count entries without growing, and is
+ * no smaller than what map_reserve asked for */
+static size_t map_fit_size(map_t *map, size_t count) {
+	size_t size = map->min_table_size;
+
+	while ((1UL << (size + 1)) * BUCKET_SIZE * map->max_load <= count) {
+		size++;
 	}
 
-	return NULL;
+	return size;
 }
 
-static void *map_probe_stash(map_t *map, const void *restrict key) {
-	for (size_t i = 0; i < STASH_SIZE; i++) {
-		if (map->stash[i] &&
-		    map->compare(key, map->stash[i], map->key_size) == 0) {
-			return map->stash[i];
-		}
+void map_set_max_load(map_t *map, float max_load) {
+	if (0 < max_load && max_load < 1) {
+		map->max_load = max_load;
 	}
-
-	return NULL;
 }
 
-static void *map_cuckoo_bucket(void *item, void *bucket[BUCKET_SIZE], size_t seed) {
-	for (size_t i = 0; i < BUCKET_SIZE; i++) {
-		if (bucket[i] == NULL) {
-			bucket[i] = item;
-			return NULL;
+/* Spreads the entries of bucket over the buckets of table, which has
+ * 2^table_size of them, sharing its index in the low bits */
+static void map_migrate_bucket(map_t *map, bucket_t *table, size_t table_size,
+                               bucket_t *bucket,
+                               size_t (*entry_hash)(map_t *, const void *)) {
+	for (size_t j = 0; j < BUCKET_SIZE; j++) {
+		void *item = bucket->slot[j];
+		if (item) {
+			size_t h = entry_hash(map, item);
+			bucket_t *split = &table[h & ((1UL << table_size) - 1)];
+
+			/* The split buckets are empty until bucket i is migrated, so
+			 * they always have room for its entries. */
+			for (size_t k = 0; k < BUCKET_SIZE; k++) {
+				if (!split->slot[k]) {
+					map_slot_store(&split->slot[k], &split->tag[k], item,
+					               bucket->tag[j]);
+					break;
+				}
+			}
 		}
 	}
+}
+
+/* Splits up to count buckets of the old tables, releasing them once the
+ * last bucket has moved. */
+static void map_migrate(map_t *map, size_t count) {
+	size_t old_size = 1UL << (map->table_size - 1);
+
+	if (!map->old_table_0) {
+		return;
+	}
 
-	void *temp = item;
-	item = bucket[seed % BUCKET_SIZE];
-	bucket[seed % BUCKET_SIZE] = temp;
+	for (; count && map->migrate_index < old_size; count--) {
+		size_t i = map->migrate_index++;
+		MAP_STAT_INC(map, migrated_buckets);
+		map_migrate_bucket(map, map->table_0, map->table_size,
+		                   &map->old_table_0[i], map_entry_hash_0);
+		map_migrate_bucket(map, map->table_1, map->table_size,
+		                   &map->old_table_1[i], map_entry_hash_1);
+	}
 
-	return item;
+	if (map->migrate_index == old_size) {
+		free(map->old_table_0);
+		free(map->old_table_1);
+		map->old_table_0 = NULL;
+		map->old_table_1 = NULL;
+		map->migrate_index = 0;
+	}
 }
 
-static inline void *map_cuckoo(map_t *map, void *item, size_t max_iter) {
-	if (item) {
-		for (size_t i = 0; i < max_iter; i++) {
-			size_t h_0 = (map->hash(item, map->key_size, map->seed_0) &
-			              ((1 << (map->table_size)) - 1));
-			item = map_cuckoo_bucket(item, map->table_0[h_0], h_0 ^ (*((size_t *)map->seed_0 + i)));
-			if (!item)
-				return NULL;
+/* Starts an incremental migration into tables twice the current size */
+static bool map_grow(map_t *map) {
+	size_t new_size = map->table_size + 1;
+	bucket_t *new_table_0 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
+	bucket_t *new_table_1 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
 
-			size_t h_1 = (map->hash(item, map->key_size, map->seed_1) &
-			              ((1 << (map->table_size)) - 1));
-			item = map_cuckoo_bucket(item, map->table_1[h_1], h_1 ^ (*((size_t *)map->seed_1 + i)));
-			if (!item)
-				return NULL;
+	if (new_table_0 != NULL && new_table_1 != NULL) {
+		map_migrate(map, SIZE_MAX);
+
+		for (size_t i = 0; i < (1 << new_size); i++) {
+			map_bucket_clear(&new_table_0[i]);
+			map_bucket_clear(&new_table_1[i]);
 		}
 
-		for (size_t i = 0; i < STASH_SIZE; i++) {
-			if (!map->stash[i]) {
-				map->stash[i] = item;
-				return NULL;
+		map->old_table_0 = map->table_0;
+		map->old_table_1 = map->table_1;
+		map->table_0 = new_table_0;
+		map->table_1 = new_table_1;
+		map->table_size = new_size;
+		map->migrate_index = 0;
+		return true;
+	} else {
+		free(new_table_0);
+		free(new_table_1);
+		return false;
+	}
+}
+
+/* Grows a concurrent map: every bucket is split into fresh tables that no
+ * reader can see yet, which are then published at once. The seeds stay the
+ * same. */
+static bool map_split(map_t *map, size_t new_size) {
+	bucket_t *new_table_0 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
+	bucket_t *new_table_1 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
+
+	if (new_table_0 != NULL && new_table_1 != NULL) {
+		bucket_t *old_table_0 = map->table_0;
+		bucket_t *old_table_1 = map->table_1;
+
+		for (size_t i = 0; i < (1 << new_size); i++) {
+			map_bucket_clear(&new_table_0[i]);
+			map_bucket_clear(&new_table_1[i]);
+		}
+
+		for (size_t i = 0; i < (1 << map->table_size); i++) {
+			map_migrate_bucket(map, new_table_0, new_size, &old_table_0[i],
+			                   map_entry_hash_0);
+			map_migrate_bucket(map, new_table_1, new_size, &old_table_1[i],
+			                   map_entry_hash_1);
+		}
+
+		map_table_write_begin(map);
+		__atomic_store_n(&map->table_0, new_table_0, __ATOMIC_RELAXED);
+		__atomic_store_n(&map->table_1, new_table_1, __ATOMIC_RELAXED);
+		__atomic_store_n(&map->table_size, new_size, __ATOMIC_RELEASE);
+		map_table_write_end(map);
+
+		map_retire(map, old_table_0, false);
+		map_retire(map, old_table_1, false);
+		return true;
+	} else {
+		free(new_table_0);
+		free(new_table_1);
+		return false;
+	}
+}
+
+/* The entry layout changes with the cache, so it can only be toggled while
+ * the map is empty. */
+bool map_set_hash_cache(map_t *map, bool hash_cache) {
+	if (map->entry_count || map->swiss) {
+		return false;
+	}
+
+	map_reclaim(map, true);
+	map_slab_free_all(map);
+
+	size_t size = entry_size(map->key_size, map->value_size, map->alignment);
+	map->hash_cache = hash_cache;
+	map->hash_offset = (size + _Alignof(size_t) - 1) & ~(_Alignof(size_t) - 1);
+	map->entry_stride =
+	    hash_cache ? entry_stride(map->hash_offset + 2 * sizeof(size_t), 0,
+	                              map->alignment)
+	               : entry_stride(map->key_size, map->value_size,
+	                              map->alignment);
+	return true;
+}
+
+/* Concurrent maps always grow by map_split */
+void map_set_incremental(map_t *map, bool incremental) {
+	if (!incremental) {
+		map_migrate(map, SIZE_MAX);
+	}
+	map->incremental = incremental && !map->concurrent;
+}
+
+/* In concurrent mode any number of threads may call map_lookup, map_search
+ * and map_lookup_batch while others write. Writers are serialized by a
+ * mutex, readers take no lock at all: they probe optimistically and retry if
+ * a writer changed the buckets they read in the meantime (see
+ * map_lookup_optimistic). Growth never blocks readers, it splits the
+ * buckets into fresh tables and publishes them at once. Three writes do
+ * rebuild the tables in place, and readers wait until they finish, which
+ * takes time linear in the size of the map: a rehash with new seeds, which
+ * takes a full stash; the shrinking of the tables once deletions take
+ * them below a quarter of the maximum load, which the floor set by
+ * map_reserve holds off; and map_shrink_to_fit.
+ *
+ * Deleted entries and replaced tables are retired and only reused or freed
+ * once no reader can still see them, so a value pointer returned by a lookup
+ * stays readable for the reading thread but may already belong to another
+ * key: concurrent readers should copy values out through lookup_dst. Values
+ * must only be changed through map_upsert and map_for, which write them to
+ * a copy of the entry that then replaces it, not through the pointers that
+ * map_find_or_insert and map_upsert return. Stats are approximate.
+ *
+ * The mode may only be switched while no other thread uses the map. Turning
+ * it on turns incremental growth off. */
+bool map_set_concurrent(map_t *map, bool concurrent) {
+	if (concurrent == map->concurrent) {
+		return true;
+	} else if (map->mapped) {
+		return false; // read-only, and safe to share as it is
+	} else if (map->swiss) {
+		return false;
+	}
+
+	if (concurrent) {
+		size_t *stripes = calloc(LOCK_STRIPES + 1, sizeof(size_t));
+		if (!stripes || pthread_mutex_init(&map->write_lock, NULL)) {
+			free(stripes);
+			return false;
+		}
+		map_set_incremental(map, false);
+		map->stripes = stripes;
+		map->concurrent = true;
+	} else {
+		map_reclaim(map, true);
+		pthread_mutex_destroy(&map->write_lock);
+		free(map->retired);
+		free(map->stripes);
+		map->retired = NULL;
+		map->retired_count = map->retired_size = 0;
+		map->stripes = NULL;
+		map->concurrent = false;
+	}
+	return true;
+}
+
+/* Bit i of the result is set when the i-th candidate slot carries the probed
+ * tag: bits [0, BUCKET_SIZE) cover bucket_0, the next BUCKET_SIZE bits cover
+ * bucket_1 and the bits from MATCH_STASH on cover the stash. */
+static inline unsigned map_match(map_t *map, const bucket_t *bucket_0,
+                                 uint16_t tag_0, const bucket_t *bucket_1,
+                                 uint16_t tag_1) {
+	uint64_t tags_0 = map_tags_load(bucket_0->tag);
+	uint64_t tags_1 = map_tags_load(bucket_1->tag);
+	uint64_t stash_0 = map_tags_load(map->stash_tag);
+	uint64_t stash_1 = map_tags_load(map->stash_tag + 4);
+#if defined(__AVX2__) && BUCKET_SIZE == 4 && STASH_SIZE == 8
+	__m128i tags = _mm_set_epi64x((long long)tags_1, (long long)tags_0);
+	__m256i all = _mm256_inserti128_si256(
+	    _mm256_castsi128_si256(tags),
+	    _mm_set_epi64x((long long)stash_1, (long long)stash_0), 1);
+	__m256i probe = _mm256_setr_epi16(tag_0, tag_0, tag_0, tag_0, tag_1, tag_1,
+	                                  tag_1, tag_1, tag_0, tag_0, tag_0, tag_0,
+	                                  tag_0, tag_0, tag_0, tag_0);
+	__m256i eq = _mm256_packs_epi16(_mm256_cmpeq_epi16(all, probe),
+	                                _mm256_setzero_si256());
+	unsigned match = (unsigned)_mm256_movemask_epi8(eq);
+	return (match & 0xFF) | ((match >> 8) & 0xFF00);
+#elif defined(__SSE2__) && BUCKET_SIZE == 4 && STASH_SIZE == 8
+	__m128i tags = _mm_set_epi64x((long long)tags_1, (long long)tags_0);
+	__m128i probe = _mm_setr_epi16(tag_0, tag_0, tag_0, tag_0, tag_1, tag_1,
+	                               tag_1, tag_1);
+	__m128i stash = _mm_set_epi64x((long long)stash_1, (long long)stash_0);
+	return (unsigned)_mm_movemask_epi8(
+	    _mm_packs_epi16(_mm_cmpeq_epi16(tags, probe),
+	                    _mm_cmpeq_epi16(stash, _mm_set1_epi16(tag_0))));
+#else
+	uint16_t tag[2][4], stash[8];
+	unsigned match = 0;
+
+	memcpy(tag[0], &tags_0, sizeof(tags_0));
+	memcpy(tag[1], &tags_1, sizeof(tags_1));
+	memcpy(stash, &stash_0, sizeof(stash_0));
+	memcpy(stash + 4, &stash_1, sizeof(stash_1));
+	for (size_t i = 0; i < BUCKET_SIZE; i++) {
+		match |= (unsigned)(tag[0][i] == tag_0) << i;
+		match |= (unsigned)(tag[1][i] == tag_1) << (BUCKET_SIZE + i);
+	}
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		match |= (unsigned)(stash[i] == tag_0) << (MATCH_STASH + i);
+	}
+	return match;
+#endif
+}
+
+static inline void **map_match_slot(map_t *map, bucket_t *bucket_0,
+                                    bucket_t *bucket_1, size_t i) {
+	if (i < BUCKET_SIZE) {
+		return &bucket_0->slot[i];
+	} else if (i < MATCH_STASH) {
+		return &bucket_1->slot[i - BUCKET_SIZE];
+	} else {
+		return &map->stash[i - MATCH_STASH];
+	}
+}
+
+/* The bucket holding candidate i, or NULL for the stash */
+static inline bucket_t *map_match_bucket(bucket_t *bucket_0,
+                                         bucket_t *bucket_1, size_t i) {
+	if (i < BUCKET_SIZE) {
+		return bucket_0;
+	} else if (i < MATCH_STASH) {
+		return bucket_1;
+	} else {
+		return NULL;
+	}
+}
+
+static inline uint16_t *map_match_tag(map_t *map, bucket_t *bucket_0,
+                                      bucket_t *bucket_1, size_t i) {
+	if (i < BUCKET_SIZE) {
+		return &bucket_0->tag[i];
+	} else if (i < MATCH_STASH) {
+		return &bucket_1->tag[i - BUCKET_SIZE];
+	} else {
+		return &map->stash_tag[i - MATCH_STASH];
+	}
+}
+
+static inline void map_stat_probe(map_t *map, size_t i, size_t compared) {
+#ifdef MAP_STATS
+	if (i < BUCKET_SIZE) {
+		map->stats.hits_0++;
+	} else if (i < MATCH_STASH) {
+		map->stats.hits_1++;
+	} else if (i < MATCH_NONE) {
+		map->stats.hits_stash++;
+	} else {
+		map->stats.misses++;
+	}
+	map->stats.probe_length[compared < MAP_STATS_PROBE_LENGTHS
+	                            ? compared
+	                            : MAP_STATS_PROBE_LENGTHS - 1]++;
+#endif
+}
+
+/* Returns the candidate index of key (see map_match), or MATCH_NONE if the key
+ * is not present. Only slots whose tag matches are dereferenced; under an
+ * optimistic read such a slot may have been emptied since its tag was
+ * read. */
+static size_t map_find(map_t *map, const void *key, bucket_t *bucket_0,
+                       uint16_t tag_0, bucket_t *bucket_1, uint16_t tag_1) {
+	unsigned match = map_match(map, bucket_0, tag_0, bucket_1, tag_1);
+
+	size_t compared = 0;
+
+	MAP_STAT_INC(map, probes);
+	for (; match; match &= match - 1) {
+		size_t i = __builtin_ctz(match);
+		void *item = map_slot_load(map_match_slot(map, bucket_0, bucket_1, i));
+		compared++;
+		if (item && map->compare(key, item, map->key_size) == 0) {
+			map_stat_probe(map, i, compared);
+			return i;
+		}
+	}
+
+	map_stat_probe(map, MATCH_NONE, compared);
+	return MATCH_NONE;
+}
+
+static inline size_t map_bucket_vacancy(const bucket_t *bucket) {
+	for (size_t i = 0; i < BUCKET_SIZE; i++) {
+		if (bucket->slot[i] == NULL) {
+			return i;
+		}
+	}
+
+	return BUCKET_SIZE;
+}
+
+static bool map_cuckoo_on_path(cuckoo_node_t *nodes, uint32_t n,
+                               const bucket_t *bucket) {
+	for (; n != CUCKOO_ROOT; n = nodes[n].parent) {
+		if (nodes[n].bucket == bucket) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Shifts every entry on the path ending in node n one step towards the free
+ * slot of bucket, starting from the end so that each entry is written to its
+ * new slot before its old one is reused. Returns the root of the path. */
+static uint32_t map_cuckoo_path(map_t *map, cuckoo_node_t *nodes, uint32_t n,
+                                bucket_t *bucket, size_t slot) {
+	for (;;) {
+		cuckoo_node_t *node = &nodes[n];
+		MAP_STAT_INC(map, cuckoo_kicks);
+		map_write_begin(map, bucket);
+		map_slot_store(&bucket->slot[slot], &bucket->tag[slot],
+		               node->bucket->slot[node->slot],
+		               map_tag(node->alt_hash));
+		map_write_end(map, bucket);
+
+		bucket = node->bucket;
+		slot = node->slot;
+		if (node->parent == CUCKOO_ROOT) {
+			return n;
+		}
+		n = node->parent;
+	}
+}
+
+static bool map_stash_put(map_t *map, void *item) {
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		if (!map->stash[i]) {
+			MAP_STAT_INC(map, stash_puts);
+			map_write_begin(map, NULL);
+			map_slot_store(&map->stash[i], &map->stash_tag[i], item,
+			               map_tag(map_entry_hash_0(map, item)));
+			map_write_end(map, NULL);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Stash tags are derived from seed_0 and must follow it when it changes */
+static void map_stash_retag(map_t *map) {
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		if (map->stash[i]) {
+			map_tag_store(&map->stash_tag[i],
+			              map_tag(map_entry_hash_0(map, map->stash[i])));
+		}
+	}
+}
+
+/* Places item by breadth-first search over the slots of its two candidate
+ * buckets, looking for the shortest chain of at most max_iter displacements
+ * that ends in a free slot. Nothing moves until such a chain is found, and
+ * then every entry is written to its new slot before its old one is reused,
+ * so concurrent readers never lose sight of it. Returns false if the search
+ * runs out of nodes. */
+static bool map_cuckoo_search(map_t *map, void *item, size_t h_0, size_t h_1,
+                              size_t max_iter) {
+	cuckoo_node_t nodes[CUCKOO_MAX_NODES];
+	size_t h[2] = {h_0, h_1};
+	bucket_t *root[2] = {map_bucket_0(map, h[0]), map_bucket_1(map, h[1])};
+	size_t count = 0;
+
+	MAP_STAT_INC(map, cuckoo_searches);
+
+	for (size_t t = 0; t < 2; t++) {
+		size_t j = map_bucket_vacancy(root[t]);
+		if (j < BUCKET_SIZE) {
+			map_write_begin(map, root[t]);
+			map_slot_store(&root[t]->slot[j], &root[t]->tag[j], item,
+			               map_tag(h[t]));
+			map_write_end(map, root[t]);
+			return true;
+		}
+	}
+
+	for (size_t t = 0; t < 2; t++) {
+		for (size_t j = 0; j < BUCKET_SIZE; j++) {
+			nodes[count++] = (cuckoo_node_t){.bucket = root[t],
+			                                 .parent = CUCKOO_ROOT,
+			                                 .slot = j,
+			                                 .table = t,
+			                                 .depth = 1};
+		}
+	}
+
+	for (size_t n = 0; n < count; n++) {
+		cuckoo_node_t *node = &nodes[n];
+		void *entry = node->bucket->slot[node->slot];
+		MAP_STAT_INC(map, cuckoo_nodes);
+		bucket_t *alt;
+
+		if (node->table) {
+			node->alt_hash = map_entry_hash_0(map, entry);
+			alt = map_bucket_0(map, node->alt_hash);
+		} else {
+			node->alt_hash = map_entry_hash_1(map, entry);
+			alt = map_bucket_1(map, node->alt_hash);
+		}
+
+		size_t j = map_bucket_vacancy(alt);
+		if (j < BUCKET_SIZE) {
+			cuckoo_node_t *first =
+			    &nodes[map_cuckoo_path(map, nodes, n, alt, j)];
+			map_write_begin(map, first->bucket);
+			map_slot_store(&first->bucket->slot[first->slot],
+			               &first->bucket->tag[first->slot], item,
+			               map_tag(h[first->table]));
+			map_write_end(map, first->bucket);
+			return true;
+		}
+
+		if (node->depth < max_iter && !map_cuckoo_on_path(nodes, n, alt)) {
+			for (size_t k = 0; k < BUCKET_SIZE && count < CUCKOO_MAX_NODES;
+			     k++) {
+				nodes[count++] = (cuckoo_node_t){.bucket = alt,
+				                                 .parent = n,
+				                                 .slot = k,
+				                                 .table = !node->table,
+				                                 .depth = node->depth + 1};
 			}
 		}
+	}
+
+	MAP_STAT_INC(map, cuckoo_failures);
+	return false;
+}
 
+/* Places item by map_cuckoo_search, or else in the stash. The item is handed
+ * back to the caller only when the stash is full as well. */
+static void *map_cuckoo_hashed(map_t *map, void *item, size_t h_0,
+                               size_t h_1, size_t max_iter) {
+	if (item && !map_cuckoo_search(map, item, h_0, h_1, max_iter) &&
+	    !map_stash_put(map, item)) {
 		return item;
 	} else {
 		return NULL;
 	}
 }
 
+static void *map_cuckoo(map_t *map, void *item, size_t max_iter) {
+	if (item) {
+		return map_cuckoo_hashed(map, item, map_entry_hash_0(map, item),
+		                         map_entry_hash_1(map, item), max_iter);
+	} else {
+		return NULL;
+	}
+}
+
+static void *map_probe_hashed(map_t *map, const void *key, size_t h_0,
+                              size_t h_1) {
+	bucket_t *bucket_0 = map_bucket_0(map, h_0);
+	bucket_t *bucket_1 = map_bucket_1(map, h_1);
+
+	size_t i =
+	    map_find(map, key, bucket_0, map_tag(h_0), bucket_1, map_tag(h_1));
+	if (i != MATCH_NONE) {
+		return *map_match_slot(map, bucket_0, bucket_1, i);
+	}
+
+	return NULL;
+}
+
 static void *map_probe(map_t *map, const void *key) {
-	size_t h_0 = (map->hash(key, map->key_size, map->seed_0) &
-	              ((1 << (map->table_size)) - 1));
-	void *item = map_probe_bucket(map, map->table_0[h_0], key);
-	if (item)
-		return item;
+	return map_probe_hashed(map, key,
+	                        map->hash(key, map->key_size, map->seed_0),
+	                        map->hash(key, map->key_size, map->seed_1));
+}
 
-	size_t h_1 = (map->hash(key, map->key_size, map->seed_1) &
-	              ((1 << (map->table_size)) - 1));
-	item = map_probe_bucket(map, map->table_1[h_1], key);
-	if (item)
-		return item;
+static inline void *map_entry_value(map_t *map, void *item) {
+	return ptr_align_up((char *)item + map->key_size, map->alignment);
+}
 
-	item = map_probe_stash(map, key);
-	if (item)
-		return item;
+/* The generation of the tables an optimistic lookup reads */
+typedef struct {
+	size_t version;
+	size_t mask;
+	bucket_t *table_0, *table_1;
+	const void *seed_0, *seed_1;
+} map_view_t;
+
+/* Reads the size, the tables and the seeds of one generation, which must
+ * agree before any key is hashed. Returns false if a rehash with new seeds
+ * is under way or the generation changed while they were read. */
+static bool map_view(map_t *map, map_view_t *view) {
+	view->version = __atomic_load_n(&map->table_version, __ATOMIC_ACQUIRE);
+	if (view->version & 1) {
+		return false;
+	}
+
+	view->mask =
+	    (1UL << __atomic_load_n(&map->table_size, __ATOMIC_RELAXED)) - 1;
+	view->table_0 = __atomic_load_n(&map->table_0, __ATOMIC_RELAXED);
+	view->table_1 = __atomic_load_n(&map->table_1, __ATOMIC_RELAXED);
+	view->seed_0 = __atomic_load_n(&map->seed_0, __ATOMIC_RELAXED);
+	view->seed_1 = __atomic_load_n(&map->seed_1, __ATOMIC_RELAXED);
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&map->table_version, __ATOMIC_RELAXED) ==
+	       view->version;
+}
+
+/* One optimistic probe for a key hashed with the seeds of view. It reads
+ * the versions of both candidate buckets and of the stash first, and
+ * returns false, to be retried, if any of them was odd or has changed by
+ * the time the value has been copied out, or if the generation has. */
+static bool map_probe_view(map_t *map, const map_view_t *view,
+                           const void *key, size_t h_0, size_t h_1,
+                           void *lookup_dst, void **value) {
+	bucket_t *bucket_0 = &view->table_0[h_0 & view->mask];
+	bucket_t *bucket_1 = &view->table_1[h_1 & view->mask];
+
+	size_t *stripe[3] = {map_stripe(map, bucket_0), map_stripe(map, bucket_1),
+	                     map_stripe(map, NULL)};
+	size_t seen[3];
+	for (size_t i = 0; i < 3; i++) {
+		seen[i] = __atomic_load_n(stripe[i], __ATOMIC_ACQUIRE);
+	}
+	if ((seen[0] | seen[1] | seen[2]) & 1) {
+		return false;
+	}
+
+	size_t i =
+	    map_find(map, key, bucket_0, map_tag(h_0), bucket_1, map_tag(h_1));
+	void *item = NULL;
+	if (i != MATCH_NONE) {
+		item = map_slot_load(map_match_slot(map, bucket_0, bucket_1, i));
+	}
+
+	*value = item ? map_entry_value(map, item) : NULL;
+	if (*value && lookup_dst) {
+		map->value_write(lookup_dst, *value, map->value_size);
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(stripe[0], __ATOMIC_RELAXED) == seen[0] &&
+	       __atomic_load_n(stripe[1], __ATOMIC_RELAXED) == seen[1] &&
+	       __atomic_load_n(stripe[2], __ATOMIC_RELAXED) == seen[2] &&
+	       __atomic_load_n(&map->table_version, __ATOMIC_RELAXED) ==
+	           view->version;
+}
+
+/* Lock-free lookup of a concurrent map, retried until a probe (see
+ * map_probe_view) is undisturbed. Writers move entries along a cuckoo path
+ * copy first, so a key that is present throughout is never missed, and
+ * retired memory outlives the reader's epoch, so whatever a racing probe
+ * dereferences stays valid. Every retry enters a new epoch, so that a
+ * writer waiting for the readers before it (see map_wait_readers) is not
+ * held up by one that waits for the writer in turn. Threads beyond
+ * MAP_MAX_READERS fall back to the write lock. */
+static void *map_lookup_optimistic(map_t *map, const void *key,
+                                   void *lookup_dst) {
+	reader_t *reader = map_read_begin();
+	void *value = NULL;
+
+	if (!reader) {
+		pthread_mutex_lock(&map->write_lock);
+		void *item = map_probe(map, key);
+		if (item) {
+			value = map_entry_value(map, item);
+			if (lookup_dst) {
+				map->value_write(lookup_dst, value, map->value_size);
+			}
+		}
+		pthread_mutex_unlock(&map->write_lock);
+		return value;
+	}
+
+	for (size_t spins = 0;; map_read_end(reader), map_relax(&spins),
+	                        reader = map_read_begin()) {
+		map_view_t view;
+		if (!map_view(map, &view)) {
+			continue;
+		}
+
+		size_t h_0 = map->hash(key, map->key_size, view.seed_0);
+		size_t h_1 = map->hash(key, map->key_size, view.seed_1);
+		if (map_probe_view(map, &view, key, h_0, h_1, lookup_dst, &value)) {
+			break;
+		}
+	}
+
+	map_read_end(reader);
+	return value;
+}
+
+/* Probe of a mapped map, whose slots hold offsets into the mapping */
+static void *map_probe_mapped_hashed(map_t *map, const void *key, size_t h_0,
+                                     size_t h_1) {
+	bucket_t *bucket_0 = &map->table_0[map_index(map, h_0)];
+	bucket_t *bucket_1 = &map->table_1[map_index(map, h_1)];
+	unsigned match =
+	    map_match(map, bucket_0, map_tag(h_0), bucket_1, map_tag(h_1));
+
+	for (; match; match &= match - 1) {
+		void *item =
+		    (char *)map->mapped +
+		    (uintptr_t)*map_match_slot(map, bucket_0, bucket_1,
+		                               __builtin_ctz(match));
+		if (map->compare(key, item, map->key_size) == 0) {
+			return item;
+		}
+	}
 
 	return NULL;
 }
 
+static void *map_probe_mapped(map_t *map, const void *key) {
+	return map_probe_mapped_hashed(
+	    map, key, map->hash(key, map->key_size, map->seed_0),
+	    map->hash(key, map->key_size, map->seed_1));
+}
+
 void *map_lookup(map_t *map, const void *key, void *lookup_dst) {
+	if (map->swiss) {
+		return swiss_lookup(map->swiss, key, lookup_dst);
+	} else if (map->concurrent) {
+		return map_lookup_optimistic(map, key, lookup_dst);
+	} else if (map->mapped) {
+		void *item = map_probe_mapped(map, key);
+		void *value = item ? map_entry_value(map, item) : NULL;
+		if (value && lookup_dst) {
+			map->value_write(lookup_dst, value, map->value_size);
+		}
+		return value;
+	}
+
+	map_migrate(map, MIGRATE_STEP);
+
 	void *item = map_probe(map, key);
 
 	if (item) {
-		void *value =
-		    ptr_align_up((char *)item + map->key_size, map->alignment);
+		void *value = map_entry_value(map, item);
 
 		if (lookup_dst) {
 			map->value_write(lookup_dst, value, map->value_size);
@@ -314,73 +1699,290 @@ void *map_lookup(map_t *map, const void *key, void *lookup_dst) {
 	}
 }
 
-bool map_insert(map_t *map, const void *key, const void *value) {
-	if (!key || !value) {
-		return false; // 0 is not a valid key or value
-	} else if (map_probe(map, key)) {
-		return true;
+bool map_search(map_t *map, const void *key) {
+	return map_lookup(map, key, NULL) != NULL;
+}
+
+/* Returns the entry of key, creating it from value (or zero-filled when value
+ * is NULL) if the key is absent, or NULL if that creation failed. The hashes
+ * of the key are computed once by the caller and reused for the probe and the
+ * placement unless a resize changes the seeds in between. */
+static void *map_find_or_insert_hashed(map_t *map, const void *key,
+                                       const void *value, size_t h_0,
+                                       size_t h_1, bool *created) {
+	size_t generation = map->generation;
+
+	if (map->mapped) {
+		return NULL;
+	}
+
+	map_migrate(map, MIGRATE_STEP);
+
+	void *entry = map_probe_hashed(map, key, h_0, h_1);
+	if (entry) {
+		if (created) {
+			*created = false;
+		}
+		return entry;
 	} else {
 		if (map_should_resize(map)) {
 			size_t new_size = map->table_size + 1;
 
-			if (!map_resize(map, new_size)) {
-				return false;
+			MAP_STAT_INC(map, resizes);
+			if (map->concurrent) {
+				if (!map_split(map, new_size)) {
+					return NULL;
+				}
+			} else if (map->incremental) {
+				if (!map_grow(map)) {
+					return NULL;
+				}
+			} else if (!map_resize(map, new_size)) {
+				return NULL;
+			} else {
+				map_rehash(map);
 			}
-
-			map_rehash(map);
 		}
 
-		void *item =
-		    alloc_entry(map->key_size, map->value_size, map->alignment);
+		void *item = map_entry_alloc(map);
 		if (!item)
-			return false;
+			return NULL;
 
 		map->key_write(item, key, map->key_size);
-		void *value_ptr =
-		    ptr_align_up((char *)item + map->key_size, map->alignment);
-		map->value_write(value_ptr, value, map->value_size);
+		if (map->str_keys && !map_str_intern(map, item)) {
+			map_entry_release(map, item);
+			return NULL;
+		}
+		if (value) {
+			map->value_write(map_entry_value(map, item), value,
+			                 map->value_size);
+		} else {
+			memset(map_entry_value(map, item), 0, map->value_size);
+		}
+
+		if (generation != map->generation) {
+			h_0 = map->hash(key, map->key_size, map->seed_0);
+			h_1 = map->hash(key, map->key_size, map->seed_1);
+		}
+		if (map->hash_cache) {
+			map_entry_set_hash(map, item, h_0, h_1);
+		}
+		map_entry_set_live(map, item, true);
 
 		size_t max_iter = ALPHA*map->table_size;
 		for (size_t i = 0; i < STASH_SIZE; i++) {
-			if (map->stash[i] != NULL) {
-				/* Try to reinsert items in the stash */
-				map->stash[i] = map_cuckoo(map, map->stash[i], max_iter);
+			void *stashed = map->stash[i];
+			/* Try to reinsert items in the stash. An item only leaves the
+			 * stash once it has been placed in a bucket. */
+			if (stashed != NULL &&
+			    map_cuckoo_search(map, stashed, map_entry_hash_0(map, stashed),
+			                      map_entry_hash_1(map, stashed), max_iter)) {
+				map_write_begin(map, NULL);
+				map_slot_store(&map->stash[i], &map->stash_tag[i], NULL, 0);
+				map_write_end(map, NULL);
 			}
 		}
-		
- 
-		while (item = map_cuckoo(map, item, max_iter)) {
-			map_rehash(map);
+
+		/* A failed placement hands back the item itself */
+		entry = item;
+		if (item = map_cuckoo_hashed(map, item, h_0, h_1, max_iter)) {
+			do {
+				map_rehash(map);
+				if (map->hash_cache) {
+					map_rehash_cache(map, item);
+				}
+			} while (item = map_cuckoo(map, item, max_iter));
 		}
 
 		map->entry_count++;
 		map->insertion_count++;
-		return true;
+		if (created) {
+			*created = true;
+		}
+		return entry;
+	}
+}
+
+static bool map_insert_hashed(map_t *map, const void *key, const void *value,
+                              size_t h_0, size_t h_1) {
+	return map_find_or_insert_hashed(map, key, value, h_0, h_1, NULL) != NULL;
+}
+
+bool map_insert(map_t *map, const void *key, const void *value) {
+	if (!key || !value) {
+		return false; // 0 is not a valid key or value
+	} else if (map->swiss) {
+		return swiss_find_or_insert(map->swiss, key, value, NULL) != NULL;
+	} else {
+		map_lock(map);
+		bool inserted =
+		    map_insert_hashed(map, key, value,
+		                      map->hash(key, map->key_size, map->seed_0),
+		                      map->hash(key, map->key_size, map->seed_1));
+		map_unlock(map);
+		return inserted;
+	}
+}
+
+/* Returns the value slot of key, inserting value first if the key is absent.
+ * A NULL value inserts a zero-filled one. The slot stays valid until the
+ * entry is deleted. */
+void *map_find_or_insert(map_t *map, const void *key, const void *value,
+                         bool *created) {
+	if (!key) {
+		return NULL;
+	} else if (map->swiss) {
+		return swiss_find_or_insert(map->swiss, key, value, created);
+	}
+
+	map_lock(map);
+	void *item = map_find_or_insert_hashed(
+	    map, key, value, map->hash(key, map->key_size, map->seed_0),
+	    map->hash(key, map->key_size, map->seed_1), created);
+	map_unlock(map);
+	return item ? map_entry_value(map, item) : NULL;
+}
+
+/* Optimistic readers may be copying the value of a published entry, so a
+ * concurrent map never writes to one. The new value goes into a copy of
+ * item, which map_entry_swap then puts in its place. */
+static void *map_entry_copy(map_t *map, const void *item) {
+	void *copy = map_entry_alloc(map);
+	if (copy) {
+		memcpy(copy, item, map->entry_stride);
+	}
+	return copy;
+}
+
+static void map_entry_swap(map_t *map, void *item, void *copy, size_t h_0,
+                           size_t h_1) {
+	bucket_t *bucket_0 = map_bucket_0(map, h_0);
+	bucket_t *bucket_1 = map_bucket_1(map, h_1);
+
+	for (size_t i = 0; i < MATCH_NONE; i++) {
+		void **slot = map_match_slot(map, bucket_0, bucket_1, i);
+		if (*slot == item) {
+			__atomic_store_n(slot, copy, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+
+	map_entry_set_live(map, copy, true);
+	map_entry_set_live(map, item, false);
+	map_retire(map, item, true);
+}
+
+/* Like map_find_or_insert, but overwrites the value of an existing key. In
+ * concurrent mode that replaces the entry, see map_entry_copy. */
+void *map_upsert(map_t *map, const void *key, const void *value,
+                 bool *created) {
+	if (!key || !value) {
+		return NULL;
+	} else if (map->swiss) {
+		return swiss_upsert(map->swiss, key, value, created);
+	}
+
+	map_lock(map);
+
+	bool inserted;
+	size_t h_0 = map->hash(key, map->key_size, map->seed_0);
+	size_t h_1 = map->hash(key, map->key_size, map->seed_1);
+	void *item =
+	    map_find_or_insert_hashed(map, key, value, h_0, h_1, &inserted);
+	if (!item) {
+		map_unlock(map);
+		return NULL;
 	}
+
+	void *slot = map_entry_value(map, item);
+	if (!inserted && map->concurrent) {
+		void *copy = map_entry_copy(map, item);
+		if (!copy) {
+			map_unlock(map);
+			return NULL;
+		}
+		slot = map_entry_value(map, copy);
+		map->value_write(slot, value, map->value_size);
+		/* Nothing has moved since the probe, the hashes still hold */
+		map_entry_swap(map, item, copy, h_0, h_1);
+	} else if (!inserted) {
+		map->value_write(slot, value, map->value_size);
+	}
+	map_unlock(map);
+
+	if (created) {
+		*created = inserted;
+	}
+	return slot;
 }
 
-void map_rehash(map_t *map) {
+static void map_rehash(map_t *map) {
 	size_t max_iter = ALPHA * map->table_size;
+	size_t attempts = 0;
 	void *item = NULL;
+#ifdef MAP_STATS
+	double start = map_stats_clock();
+#endif
+
+	map_migrate(map, SIZE_MAX);
+	map_table_write_begin(map);
+
+	/* Readers of a concurrent map may still be hashing with the seeds, so
+	 * the new ones go into fresh memory. Failing that they are rewritten in
+	 * place once those readers are done; later ones wait for the rehash. */
+	void *old_seed_0 = NULL, *old_seed_1 = NULL;
+	if (map->concurrent) {
+		void *seed_0 = aligned_alloc(BUCKET_ALIGNMENT, SEED_SIZE);
+		void *seed_1 = aligned_alloc(BUCKET_ALIGNMENT, SEED_SIZE);
+		if (seed_0 && seed_1) {
+			old_seed_0 = map->seed_0;
+			old_seed_1 = map->seed_1;
+			__atomic_store_n(&map->seed_0, seed_0, __ATOMIC_RELAXED);
+			__atomic_store_n(&map->seed_1, seed_1, __ATOMIC_RELAXED);
+		} else {
+			free(seed_0);
+			free(seed_1);
+			map_wait_readers();
+		}
+	}
 
 	do {
 		retry:
+		attempts++;
 		generate_seed(map->seed_0, SEED_SIZE);
 		generate_seed(map->seed_1, SEED_SIZE);
 
+		/* Every cached hash must follow the new seeds before the first
+		 * entry is displaced */
+		if (map->hash_cache) {
+			map_rehash_cache(map, item);
+			for (size_t i = 0; i < 1 << (map->table_size); i++) {
+				for (size_t j = 0; j < BUCKET_SIZE; j++) {
+					map_rehash_cache(map, map->table_0[i].slot[j]);
+					map_rehash_cache(map, map->table_1[i].slot[j]);
+				}
+			}
+			for (size_t i = 0; i < STASH_SIZE; i++) {
+				map_rehash_cache(map, map->stash[i]);
+			}
+		}
+		map_stash_retag(map);
+
 		if (item = map_cuckoo(map, item, max_iter))
 			goto retry;
 
 		for (size_t i = 0; i < 1 << (map->table_size); i++) {
 			for (size_t j = 0; j < BUCKET_SIZE; j++) {
-				item = map->table_0[i][j];
-				map->table_0[i][j] = NULL;
+				item = map->table_0[i].slot[j];
+				map_slot_store(&map->table_0[i].slot[j],
+				               &map->table_0[i].tag[j], NULL, 0);
 				if (item = map_cuckoo(map, item, max_iter))
 					goto retry;
 			}
 			for (size_t j = 0; j < BUCKET_SIZE; j++) {
-				item = map->table_1[i][j];
-				map->table_1[i][j] = NULL;
+				item = map->table_1[i].slot[j];
+				map_slot_store(&map->table_1[i].slot[j],
+				               &map->table_1[i].tag[j], NULL, 0);
 				if (item = map_cuckoo(map, item, max_iter))
 					goto retry;
 			}
@@ -388,30 +1990,238 @@ void map_rehash(map_t *map) {
 	} while (item);
 
 	map->insertion_count = 0;
-}
+	map->generation++;
+	map_table_write_end(map);
 
-static bool map_delete_bucket(map_t *map, void *bucket[BUCKET_SIZE],
-                              const void *restrict key) {
-	for (size_t i = 0; i < BUCKET_SIZE; i++) {
-		if (bucket[i] && map->compare(key, bucket[i], map->key_size) == 0) {
-			free(bucket[i]);
-			bucket[i] = NULL;
-			return true;
-		}
+	if (old_seed_0) {
+		map_retire(map, old_seed_0, false);
+		map_retire(map, old_seed_1, false);
 	}
 
-	return false;
+	MAP_STAT_INC(map, rehashes);
+	MAP_STAT_ADD(map, rehash_retries, attempts - 1);
+#ifdef MAP_STATS
+	map->stats.rehash_seconds += map_stats_clock() - start;
+#endif
 }
 
-static bool map_delete_stash(map_t *map, const void *restrict key) {
+/* Replaces the tables with new_table_0 and new_table_1, of 2^new_size
+ * buckets, and places every live entry of the slabs into them. The entries
+ * stay where they are. The seeds only change if an entry cannot be placed.
+ * Readers of a concurrent map wait for the rebuild, the old tables are
+ * retired. */
+static void map_place_all(map_t *map, bucket_t *new_table_0,
+                          bucket_t *new_table_1, size_t new_size) {
+	MAP_STAT_INC(map, shrinks);
+	map_table_write_begin(map);
+
+	bucket_t *old_table_0 = map->table_0;
+	bucket_t *old_table_1 = map->table_1;
+
+	for (size_t i = 0; i < (1 << new_size); i++) {
+		map_bucket_clear(&new_table_0[i]);
+		map_bucket_clear(&new_table_1[i]);
+	}
 	for (size_t i = 0; i < STASH_SIZE; i++) {
-		if (map->stash[i] &&
-		    map->compare(key, map->stash[i], map->key_size) == 0) {
-			free(map->stash[i]);
-			map->stash[i] = NULL;
-			return true;
+		map_slot_store(&map->stash[i], &map->stash_tag[i], NULL, 0);
+	}
+	__atomic_store_n(&map->table_0, new_table_0, __ATOMIC_RELAXED);
+	__atomic_store_n(&map->table_1, new_table_1, __ATOMIC_RELAXED);
+	__atomic_store_n(&map->table_size, new_size, __ATOMIC_RELAXED);
+
+	size_t generation = map->generation;
+	size_t max_iter = ALPHA * new_size;
+	for (size_t i = 0; i < map->slab_count; i++) {
+		slab_t *slab = map->slabs[i];
+		for (size_t j = 0; j < slab->entry_count; j++) {
+			if (!(slab->live[j / 64] >> (j % 64) & 1)) {
+				continue;
+			}
+
+			void *item = slab->entries + j * map->entry_stride;
+			if (map->hash_cache && generation != map->generation) {
+				map_rehash_cache(map, item);
+			}
+			while (item = map_cuckoo(map, item, max_iter)) {
+				map_rehash(map);
+				if (map->hash_cache) {
+					map_rehash_cache(map, item);
+				}
+			}
+		}
+	}
+
+	map_table_write_end(map);
+
+	map_retire(map, old_table_0, false);
+	map_retire(map, old_table_1, false);
+}
+
+/* Rebuilds the map into tables of 2^new_size buckets, leaving its entries
+ * and the pointers to them as they are. */
+static bool map_shrink_tables(map_t *map, size_t new_size) {
+	bucket_t *new_table_0 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
+	bucket_t *new_table_1 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
+
+	if (map->mapped || new_table_0 == NULL || new_table_1 == NULL) {
+		free(new_table_0);
+		free(new_table_1);
+		return false;
+	}
+
+	map_migrate(map, SIZE_MAX);
+	map_place_all(map, new_table_0, new_table_1, new_size);
+	return true;
+}
+
+/* Rebuilds the map into tables of 2^new_size buckets. The live entries are
+ * first copied in slab order into a single fresh slab, and the keys of a
+ * string map into a fresh arena, so that the memory of deleted ones is given
+ * back. Every entry moves, the old memory is retired. */
+static bool map_compact(map_t *map, size_t new_size) {
+	size_t count = map->entry_count;
+	bucket_t *new_table_0 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
+	bucket_t *new_table_1 =
+	    aligned_alloc(BUCKET_ALIGNMENT, sizeof(bucket_t) * (1 << (new_size)));
+
+	if (map->mapped || new_table_0 == NULL || new_table_1 == NULL) {
+		free(new_table_0);
+		free(new_table_1);
+		return false;
+	}
+
+	map_migrate(map, SIZE_MAX);
+
+	slab_t **slabs = map->slabs;
+	size_t slab_count = map->slab_count, slab_size = map->slab_size;
+	slab_t *slab_current = map->slab_current;
+	char *slab_next = map->slab_next, *slab_end = map->slab_end;
+	void *free_list = map->free_list;
+	arena_chunk_t *key_arena = map->key_arena;
+
+	map->slabs = NULL;
+	map->slab_count = map->slab_size = 0;
+	map->slab_current = NULL;
+	map->slab_next = map->slab_end = NULL;
+	map->free_list = NULL;
+	map->key_arena = NULL;
+
+	bool copied =
+	    map_slab_alloc(map, count < SLAB_MIN_COUNT ? SLAB_MIN_COUNT : count);
+	for (size_t i = 0; copied && i < slab_count; i++) {
+		for (size_t j = 0; copied && j < slabs[i]->entry_count; j++) {
+			if (slabs[i]->live[j / 64] >> (j % 64) & 1) {
+				void *item = map_entry_alloc(map);
+				memcpy(item, slabs[i]->entries + j * map->entry_stride,
+				       map->entry_stride);
+				copied = !map->str_keys || map_str_intern(map, item);
+				map_entry_set_live(map, item, true);
+			}
+		}
+	}
+
+	if (!copied) {
+		for (arena_chunk_t *chunk = map->key_arena, *next; chunk;
+		     chunk = next) {
+			next = chunk->next;
+			free(chunk);
+		}
+		map_slab_free_all(map);
+
+		map->slabs = slabs;
+		map->slab_count = slab_count;
+		map->slab_size = slab_size;
+		map->slab_current = slab_current;
+		map->slab_next = slab_next;
+		map->slab_end = slab_end;
+		map->free_list = free_list;
+		map->key_arena = key_arena;
+
+		free(new_table_0);
+		free(new_table_1);
+		return false;
+	}
+
+	map_place_all(map, new_table_0, new_table_1, new_size);
+
+	/* Deleted entries waiting for readers are retired with their slabs */
+	size_t kept = 0;
+	for (size_t i = 0; i < map->retired_count; i++) {
+		if (!map->retired[i].entry) {
+			map->retired[kept++] = map->retired[i];
 		}
 	}
+	map->retired_count = kept;
+
+	for (size_t i = 0; i < slab_count; i++) {
+		map_retire(map, slabs[i], false);
+	}
+	free(slabs);
+	for (arena_chunk_t *chunk = key_arena, *next; chunk; chunk = next) {
+		next = chunk->next;
+		map_retire(map, chunk, false);
+	}
+
+	return true;
+}
+
+/* Shrinks the tables to the smallest size that holds the map and compacts
+ * its entries. Unlike the shrinking done by deletions, this moves every
+ * entry, so value pointers from map_find_or_insert and map_lookup are
+ * invalid afterwards. Returns false if the new memory could not be
+ * allocated, in which case the map is left as it was. */
+bool map_shrink_to_fit(map_t *map) {
+	if (map->swiss) {
+		return swiss_shrink_to_fit(map->swiss);
+	}
+
+	/* The map_reserve floor only goes once the tables have been rebuilt */
+	map_lock(map);
+	size_t min_table_size = map->min_table_size;
+	map->min_table_size = MAP_INIT_SIZE;
+	bool compacted = map_compact(map, map_fit_size(map, map->entry_count));
+	if (!compacted) {
+		map->min_table_size = min_table_size;
+	}
+	map_unlock(map);
+	return compacted;
+}
+
+static bool map_delete_hashed(map_t *map, const void *key, size_t h_0,
+                              size_t h_1) {
+	if (map->mapped) {
+		return false;
+	}
+
+	map_migrate(map, MIGRATE_STEP);
+
+	bucket_t *bucket_0 = map_bucket_0(map, h_0);
+	bucket_t *bucket_1 = map_bucket_1(map, h_1);
+
+	size_t i =
+	    map_find(map, key, bucket_0, map_tag(h_0), bucket_1, map_tag(h_1));
+	if (i != MATCH_NONE) {
+		void **slot = map_match_slot(map, bucket_0, bucket_1, i);
+		bucket_t *bucket = map_match_bucket(bucket_0, bucket_1, i);
+		void *item = *slot;
+		map_write_begin(map, bucket);
+		map_slot_store(slot, map_match_tag(map, bucket_0, bucket_1, i), NULL,
+		               0);
+		map_write_end(map, bucket);
+		map_entry_set_live(map, item, false);
+		map_retire(map, item, true);
+		map->entry_count--;
+
+		/* Only the tables shrink, so that the slots of the remaining
+		 * entries stay valid. A failed shrink leaves the map as it was. */
+		if (map_should_shrink(map)) {
+			map_shrink_tables(map, map_fit_size(map, 2 * map->entry_count));
+		}
+		return true;
+	}
 
 	return false;
 }
@@ -419,26 +2229,756 @@ static bool map_delete_stash(map_t *map, const void *restrict key) {
 bool map_delete(map_t *map, const void *key) {
 	if (!key) {
 		return false;
+	} else if (map->swiss) {
+		return swiss_delete(map->swiss, key);
 	}
 
-	size_t h_0 = (map->hash(key, map->key_size, map->seed_0) &
-	              ((1 << (map->table_size)) - 1));
-	if (map_delete_bucket(map, map->table_0[h_0], key)) {
-		map->entry_count--;
-		return true;
+	map_lock(map);
+	bool deleted =
+	    map_delete_hashed(map, key, map->hash(key, map->key_size, map->seed_0),
+	                      map->hash(key, map->key_size, map->seed_1));
+	map_unlock(map);
+	return deleted;
+}
+
+/* Batched operations work through the keys MAP_BATCH_SIZE at a time: every
+ * key of a block is hashed and both of its candidate buckets are prefetched
+ * before the first one is probed, so the bucket misses of independent keys
+ * overlap instead of being taken one after the other. Keys and values are
+ * packed arrays of key_size and value_size elements. Hash functions with a
+ * batch variant hash a whole block per call. */
+static void map_batch_hash_seeded(map_t *map, const char *keys, size_t n,
+                                  const void *seed_0, const void *seed_1,
+                                  size_t h_0[], size_t h_1[]) {
+	if (map->hash_batch) {
+		map->hash_batch(keys, n, seed_0, h_0);
+		map->hash_batch(keys, n, seed_1, h_1);
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			h_0[i] = map->hash(keys + i * map->key_size, map->key_size, seed_0);
+			h_1[i] = map->hash(keys + i * map->key_size, map->key_size, seed_1);
+		}
 	}
+}
 
-	size_t h_1 = (map->hash(key, map->key_size, map->seed_1) &
-	              ((1 << (map->table_size)) - 1));
-	if (map_delete_bucket(map, map->table_1[h_1], key)) {
-		map->entry_count--;
-		return true;
+static void map_batch_hash(map_t *map, const char *keys, size_t n,
+                           size_t h_0[], size_t h_1[]) {
+	map_batch_hash_seeded(map, keys, n, map->seed_0, map->seed_1, h_0, h_1);
+
+	for (size_t i = 0; i < n; i++) {
+		__builtin_prefetch(map_bucket_0(map, h_0[i]));
+		__builtin_prefetch(map_bucket_1(map, h_1[i]));
 	}
+}
 
-	if (map_delete_stash(map, key)) {
-		map->entry_count--;
-		return true;
+/* A block of a concurrent map is hashed with the seeds of one generation
+ * and prefetched as a whole, under a single epoch, before the optimistic
+ * probes. Keys whose probe was disturbed by a writer, and whole blocks read
+ * during a rehash, are looked up again one at a time. */
+static size_t map_lookup_block_optimistic(map_t *map, const char *block,
+                                          size_t m, char *out_values,
+                                          bool *out_found) {
+	size_t h_0[MAP_BATCH_SIZE], h_1[MAP_BATCH_SIZE];
+	void *value[MAP_BATCH_SIZE];
+	uint64_t retry = (1UL << m) - 1;
+	reader_t *reader = map_read_begin();
+	map_view_t view;
+
+	if (reader && map_view(map, &view)) {
+		map_batch_hash_seeded(map, block, m, view.seed_0, view.seed_1, h_0,
+		                      h_1);
+		for (size_t i = 0; i < m; i++) {
+			__builtin_prefetch(&view.table_0[h_0[i] & view.mask]);
+			__builtin_prefetch(&view.table_1[h_1[i] & view.mask]);
+		}
+
+		for (size_t i = 0; i < m; i++) {
+			void *dst = out_values ? out_values + i * map->value_size : NULL;
+			if (map_probe_view(map, &view, block + i * map->key_size, h_0[i],
+			                   h_1[i], dst, &value[i])) {
+				retry &= ~(1UL << i);
+			}
+		}
+	}
+	if (reader) {
+		map_read_end(reader);
+	}
+
+	for (uint64_t r = retry; r; r &= r - 1) {
+		size_t i = __builtin_ctzl(r);
+		void *dst = out_values ? out_values + i * map->value_size : NULL;
+		value[i] = map_lookup_optimistic(map, block + i * map->key_size, dst);
+	}
+
+	size_t found = 0;
+	for (size_t i = 0; i < m; i++) {
+		if (out_found) {
+			out_found[i] = value[i] != NULL;
+		}
+		found += value[i] != NULL;
+	}
+
+	return found;
+}
+
+size_t map_lookup_batch(map_t *map, const void *keys, size_t n,
+                        void *out_values, bool *out_found) {
+	size_t h_0[MAP_BATCH_SIZE], h_1[MAP_BATCH_SIZE];
+	size_t found = 0;
+
+	if (map->swiss) {
+		return swiss_lookup_batch(map->swiss, keys, n, out_values, out_found);
+	}
+
+	for (size_t k = 0; k < n; k += MAP_BATCH_SIZE) {
+		const char *block = (const char *)keys + k * map->key_size;
+		size_t m = n - k < MAP_BATCH_SIZE ? n - k : MAP_BATCH_SIZE;
+
+		if (map->concurrent) {
+			found += map_lookup_block_optimistic(
+			    map, block, m,
+			    out_values ? (char *)out_values + k * map->value_size : NULL,
+			    out_found ? out_found + k : NULL);
+			continue;
+		}
+
+		map_batch_hash(map, block, m, h_0, h_1);
+
+		/* Second stage: prefetch the first candidate entry of each key. The
+		 * slots of a mapped map hold offsets into the mapping. */
+		for (size_t i = 0; i < m; i++) {
+			bucket_t *bucket_0 = map_bucket_0(map, h_0[i]);
+			bucket_t *bucket_1 = map_bucket_1(map, h_1[i]);
+			unsigned match = map_match(map, bucket_0, map_tag(h_0[i]),
+			                           bucket_1, map_tag(h_1[i]));
+			if (match) {
+				char *item = *map_match_slot(map, bucket_0, bucket_1,
+				                             __builtin_ctz(match));
+				__builtin_prefetch(map->mapped ? (char *)map->mapped +
+				                                     (uintptr_t)item
+				                               : item);
+			}
+		}
+
+		for (size_t i = 0; i < m; i++) {
+			const void *key = block + i * map->key_size;
+			void *item = map->mapped
+			                 ? map_probe_mapped_hashed(map, key, h_0[i], h_1[i])
+			                 : map_probe_hashed(map, key, h_0[i], h_1[i]);
+			if (item) {
+				if (out_values) {
+					map->value_write((char *)out_values +
+					                     (k + i) * map->value_size,
+					                 map_entry_value(map, item),
+					                 map->value_size);
+				}
+				found++;
+			}
+			if (out_found) {
+				out_found[k + i] = item != NULL;
+			}
+		}
+	}
+
+	return found;
+}
+
+/* Returns the number of keys processed, which is less than n only if an
+ * insertion failed to allocate. */
+size_t map_insert_batch(map_t *map, const void *keys, const void *values,
+                        size_t n) {
+	size_t h_0[MAP_BATCH_SIZE], h_1[MAP_BATCH_SIZE];
+
+	if (map->swiss) {
+		for (size_t i = 0; i < n; i++) {
+			if (!swiss_find_or_insert(
+			        map->swiss, (const char *)keys + i * map->key_size,
+			        (const char *)values + i * map->value_size, NULL)) {
+				return i;
+			}
+		}
+		return n;
+	}
+
+	map_lock(map);
+
+	for (size_t k = 0; k < n; k += MAP_BATCH_SIZE) {
+		const char *block = (const char *)keys + k * map->key_size;
+		size_t m = n - k < MAP_BATCH_SIZE ? n - k : MAP_BATCH_SIZE;
+		size_t generation = map->generation;
+
+		map_batch_hash(map, block, m, h_0, h_1);
+
+		for (size_t i = 0; i < m; i++) {
+			const void *key = block + i * map->key_size;
+			if (generation != map->generation) {
+				/* An earlier insertion rehashed the map */
+				h_0[i] = map->hash(key, map->key_size, map->seed_0);
+				h_1[i] = map->hash(key, map->key_size, map->seed_1);
+			}
+
+			if (!map_insert_hashed(map, key,
+			                       (const char *)values +
+			                           (k + i) * map->value_size,
+			                       h_0[i], h_1[i])) {
+				map_unlock(map);
+				return k + i;
+			}
+		}
+	}
+
+	map_unlock(map);
+	return n;
+}
+
+size_t map_delete_batch(map_t *map, const void *keys, size_t n) {
+	size_t h_0[MAP_BATCH_SIZE], h_1[MAP_BATCH_SIZE];
+	size_t deleted = 0;
+
+	if (map->swiss) {
+		for (size_t i = 0; i < n; i++) {
+			deleted += swiss_delete(map->swiss,
+			                        (const char *)keys + i * map->key_size);
+		}
+		return deleted;
+	}
+
+	map_lock(map);
+
+	for (size_t k = 0; k < n; k += MAP_BATCH_SIZE) {
+		const char *block = (const char *)keys + k * map->key_size;
+		size_t m = n - k < MAP_BATCH_SIZE ? n - k : MAP_BATCH_SIZE;
+
+		size_t generation = map->generation;
+
+		map_batch_hash(map, block, m, h_0, h_1);
+
+		for (size_t i = 0; i < m; i++) {
+			const void *key = block + i * map->key_size;
+			if (generation != map->generation) {
+				/* A shrink rehashed the map */
+				h_0[i] = map->hash(key, map->key_size, map->seed_0);
+				h_1[i] = map->hash(key, map->key_size, map->seed_1);
+			}
+
+			deleted += map_delete_hashed(map, key, h_0[i], h_1[i]);
+		}
+	}
+
+	map_unlock(map);
+	return deleted;
+}
+
+/* Grows the tables once so that count entries fit under the maximum load,
+ * and reserves their entry storage in one slab. Deletions do not shrink the
+ * tables below that size until map_shrink_to_fit. */
+bool map_reserve(map_t *map, size_t count) {
+	bool reserved = true;
+
+	if (map->swiss) {
+		return swiss_reserve(map->swiss, count);
+	}
+
+	map_lock(map);
+
+	size_t fit_size = map_fit_size(map, count);
+	size_t new_size =
+	    fit_size < map->table_size ? map->table_size : fit_size;
+
+	if (map->mapped || (map->entry_count < count &&
+	                    !map_slab_reserve(map, count - map->entry_count))) {
+		reserved = false;
+	} else if (new_size != map->table_size) {
+		map_migrate(map, SIZE_MAX);
+
+		if (map->concurrent) {
+			reserved = map_split(map, new_size);
+		} else if (!map_resize(map, new_size)) {
+			reserved = false;
+		} else {
+			map_rehash(map);
+		}
+	}
+	if (reserved) {
+		map->min_table_size = fit_size;
+	}
+
+	map_unlock(map);
+	return reserved;
+}
+
+/* Bulk loads count key/value pairs into tables sized for them up front, so
+ * the load never resizes. Returns the number of pairs inserted. */
+size_t map_build(map_t *map, const void *keys, const void *values,
+                 size_t count) {
+	if (!map_reserve(map, map->entry_count + count)) {
+		return 0;
+	}
+
+	return map_insert_batch(map, keys, values, count);
+}
+
+/* Iteration walks the slabs in address order and yields the entries whose
+ * live bit is set, so it reads entry memory front to back. An iterator covers
+ * a range of entry positions, counted over all slabs; the map must not be
+ * modified while it is in use. */
+static void map_iter_seek(map_t *map, map_iter_t *iter, size_t begin,
+                          size_t end) {
+	*iter = (map_iter_t){.map = map, .slab = 0, .entry = begin,
+	                     .remaining = end - begin};
+
+	while (iter->slab < map->slab_count &&
+	       map->slabs[iter->slab]->entry_count <= iter->entry) {
+		iter->entry -= map->slabs[iter->slab++]->entry_count;
+	}
+}
+
+/* A swiss map iterates over its slots instead */
+static size_t map_iter_positions(map_t *map) {
+	if (map->swiss) {
+		return swiss_capacity(map->swiss);
+	}
+
+	size_t positions = 0;
+	for (size_t i = 0; i < map->slab_count; i++) {
+		positions += map->slabs[i]->entry_count;
+	}
+	return positions;
+}
+
+void map_iter_begin(map_t *map, map_iter_t *iter) {
+	map_iter_seek(map, iter, 0, map_iter_positions(map));
+}
+
+/* Starts iter on part of parts disjoint ranges that together cover the map,
+ * so that each can be scanned by a thread of its own. */
+void map_iter_range(map_t *map, map_iter_t *iter, size_t part, size_t parts) {
+	size_t positions = map_iter_positions(map);
+
+	if (part >= parts) {
+		map_iter_seek(map, iter, positions, positions);
+	} else {
+		map_iter_seek(map, iter, positions / parts * part +
+		                             positions % parts * part / parts,
+		              positions / parts * (part + 1) +
+		                  positions % parts * (part + 1) / parts);
+	}
+}
+
+/* Stores the key and value of the next entry and returns true, or returns
+ * false once the range is exhausted. */
+bool map_iter_next(map_iter_t *iter, const void **key, void **value) {
+	map_t *map = iter->map;
+
+	while (map->swiss && iter->remaining) {
+		iter->remaining--;
+		if (swiss_entry(map->swiss, iter->entry++, key, value)) {
+			return true;
+		}
+	}
+
+	while (iter->remaining && iter->slab < map->slab_count) {
+		slab_t *slab = map->slabs[iter->slab];
+		size_t i = iter->entry;
+
+		if (i == slab->entry_count) {
+			iter->slab++;
+			iter->entry = 0;
+			continue;
+		}
+
+		/* Bits past entry_count are never set, but a word without a live
+		 * bit reaches past the end of a slab whose size is not a multiple
+		 * of 64. Clamped first, so that the overshoot is not charged to
+		 * the range. */
+		uint64_t live = slab->live[i / 64] >> (i % 64);
+		size_t skip = live ? (size_t)__builtin_ctzl(live) : 64 - i % 64;
+		if (i + skip > slab->entry_count) {
+			skip = slab->entry_count - i;
+		}
+		if (skip >= iter->remaining) {
+			iter->remaining = 0;
+			break;
+		}
+
+		iter->entry += skip;
+		iter->remaining -= skip;
+		if (live) {
+			char *item = slab->entries + iter->entry * map->entry_stride;
+			iter->entry++;
+			iter->remaining--;
+			*key = item;
+			*value = map_entry_value(map, item);
+			return true;
+		}
 	}
 
 	return false;
-}
\ No newline at end of file
+}
+
+static size_t map_for_each_iter(map_iter_t *iter,
+                                void (*f)(const void *, void *, void *),
+                                void *context) {
+	const void *key;
+	void *value;
+	size_t count = 0;
+
+	for (; map_iter_next(iter, &key, &value); count++) {
+		f(key, value, context);
+	}
+
+	return count;
+}
+
+/* Calls f with the key, the value and context for every entry, in slab
+ * order, and returns the number of entries visited. Writers of a concurrent
+ * map are held off until it returns. */
+size_t map_for_each(map_t *map, void (*f)(const void *, void *, void *),
+                    void *context) {
+	map_iter_t iter;
+
+	map_lock(map);
+	map_iter_begin(map, &iter);
+	size_t count = map_for_each_iter(&iter, f, context);
+	map_unlock(map);
+	return count;
+}
+
+/* map_for_each over the range map_iter_range assigns to part */
+size_t map_for_each_range(map_t *map, size_t part, size_t parts,
+                          void (*f)(const void *, void *, void *),
+                          void *context) {
+	map_iter_t iter;
+
+	map_iter_range(map, &iter, part, parts);
+	return map_for_each_iter(&iter, f, context);
+}
+
+/* Calls f with the value of key, if present, and returns that value. f may
+ * modify the value, also in concurrent mode, where it is given the value of
+ * a copy of the entry (see map_entry_copy), and NULL is returned if that
+ * cannot be allocated. Mapped maps are read-only. */
+void *map_for(map_t *map, const void *key, void (*f)(void *)) {
+	if (!key || map->mapped) {
+		return NULL;
+	} else if (map->swiss) {
+		void *value = swiss_lookup(map->swiss, key, NULL);
+		if (value) {
+			f(value);
+		}
+		return value;
+	}
+
+	map_lock(map);
+
+	size_t h_0 = map->hash(key, map->key_size, map->seed_0);
+	size_t h_1 = map->hash(key, map->key_size, map->seed_1);
+	void *item = map_probe_hashed(map, key, h_0, h_1);
+	void *value = NULL;
+	if (item && map->concurrent) {
+		void *copy = map_entry_copy(map, item);
+		if (copy) {
+			value = map_entry_value(map, copy);
+			f(value);
+			map_entry_swap(map, item, copy, h_0, h_1);
+		}
+	} else if (item) {
+		value = map_entry_value(map, item);
+		f(value);
+	}
+
+	map_unlock(map);
+	return value;
+}
+
+/* Header of a map_save file. Every region starts at an offset aligned to
+ * BUCKET_ALIGNMENT (entries to the map's alignment if larger), so that the
+ * seeds, the tables and the entries can be used in place. Slots hold the file
+ * offset of their entry, which is never 0; the stash is stored as STASH_SIZE
+ * offsets followed by its tags. Files are only portable between machines of
+ * the same byte order and pointer size. */
+typedef struct map_file_t {
+	char magic[8];
+	uint64_t byte_order;
+	uint64_t pointer_size;
+
+	uint64_t key_size, value_size, alignment;
+	uint64_t entry_stride, hash_cache, hash_offset;
+	uint64_t table_size, seed_size, entry_count;
+
+	uint64_t seed_0, seed_1, table_0, table_1, stash, entries;
+	uint64_t file_size;
+} map_file_t;
+
+static uint64_t map_file_align(uint64_t offset, uint64_t alignment) {
+	return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+/* Fills in the region offsets of file from its geometry */
+static void map_file_layout(map_file_t *file) {
+	uint64_t table_bytes = (uint64_t)sizeof(bucket_t) << file->table_size;
+	uint64_t alignment = file->alignment > BUCKET_ALIGNMENT
+	                         ? file->alignment
+	                         : BUCKET_ALIGNMENT;
+
+	memcpy(file->magic, MAP_FILE_MAGIC, sizeof(file->magic));
+	file->byte_order = MAP_FILE_BYTE_ORDER;
+	file->pointer_size = sizeof(void *);
+
+	file->seed_0 = map_file_align(sizeof(map_file_t), BUCKET_ALIGNMENT);
+	file->seed_1 =
+	    map_file_align(file->seed_0 + file->seed_size, BUCKET_ALIGNMENT);
+	file->table_0 =
+	    map_file_align(file->seed_1 + file->seed_size, BUCKET_ALIGNMENT);
+	file->table_1 = file->table_0 + table_bytes;
+	file->stash = file->table_1 + table_bytes;
+	file->entries = map_file_align(
+	    file->stash + STASH_SIZE * (sizeof(uint64_t) + sizeof(uint16_t)),
+	    alignment);
+	file->file_size = file->entries + file->entry_count * file->entry_stride;
+}
+
+/* The entry a slot points at, also in a mapped map */
+static const void *map_slot_entry(map_t *map, const void *slot) {
+	return map->mapped ? map->mapped + (uintptr_t)slot : slot;
+}
+
+/* Entries are numbered in the order their slots are written: table_0,
+ * table_1, then the stash. The entries region follows that order, so that
+ * each slot can be given its offset as it goes out. */
+static bool map_file_write(map_t *map, const map_file_t *file,
+                           FILE *stream) {
+	uint64_t next = file->entries;
+	bucket_t *tables[2] = {map->table_0, map->table_1};
+
+	fwrite(file, sizeof(map_file_t), 1, stream);
+	fseeko(stream, file->seed_0, SEEK_SET);
+	fwrite(map->seed_0, map->seed_size, 1, stream);
+	fseeko(stream, file->seed_1, SEEK_SET);
+	fwrite(map->seed_1, map->seed_size, 1, stream);
+
+	fseeko(stream, file->table_0, SEEK_SET);
+	for (size_t t = 0; t < 2; t++) {
+		for (size_t i = 0; i < (1UL << map->table_size); i++) {
+			bucket_t bucket = tables[t][i];
+			for (size_t j = 0; j < BUCKET_SIZE; j++) {
+				if (bucket.slot[j]) {
+					bucket.slot[j] = (void *)(uintptr_t)next;
+					next += map->entry_stride;
+				}
+			}
+			fwrite(&bucket, sizeof(bucket_t), 1, stream);
+		}
+	}
+
+	uint64_t stash[STASH_SIZE];
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		stash[i] = map->stash[i] ? next : 0;
+		next += map->stash[i] ? map->entry_stride : 0;
+	}
+	fwrite(stash, sizeof(stash), 1, stream);
+	fwrite(map->stash_tag, sizeof(map->stash_tag), 1, stream);
+
+	/* Padded by hand, the file must reach entries even if there are none */
+	for (uint64_t at = file->stash + sizeof(stash) + sizeof(map->stash_tag);
+	     at < file->entries; at++) {
+		fputc(0, stream);
+	}
+	for (size_t t = 0; t < 2; t++) {
+		for (size_t i = 0; i < (1UL << map->table_size); i++) {
+			for (size_t j = 0; j < BUCKET_SIZE; j++) {
+				if (tables[t][i].slot[j]) {
+					fwrite(map_slot_entry(map, tables[t][i].slot[j]),
+					       map->entry_stride, 1, stream);
+				}
+			}
+		}
+	}
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		if (map->stash[i]) {
+			fwrite(map_slot_entry(map, map->stash[i]), map->entry_stride, 1,
+			       stream);
+		}
+	}
+
+	return !ferror(stream) && next == file->file_size;
+}
+
+/* Writes map to path in the format map_open_mmap serves lookups from. String
+ * maps, whose keys point into their arena, cannot be saved. */
+bool map_save(map_t *map, const char *path) {
+	if (map->str_keys || map->swiss) {
+		return false;
+	}
+
+	FILE *stream = fopen(path, "wb");
+	if (!stream) {
+		return false;
+	}
+
+	map_lock(map);
+	map_migrate(map, SIZE_MAX);
+
+	map_file_t file = {.key_size = map->key_size,
+	                   .value_size = map->value_size,
+	                   .alignment = map->alignment,
+	                   .entry_stride = map->entry_stride,
+	                   .hash_cache = map->hash_cache,
+	                   .hash_offset = map->hash_offset,
+	                   .table_size = map->table_size,
+	                   .seed_size = map->seed_size,
+	                   .entry_count = map->entry_count};
+	map_file_layout(&file);
+	bool written = map_file_write(map, &file, stream);
+
+	map_unlock(map);
+	return fclose(stream) == 0 && written;
+}
+
+/* A single slab over the entries region lets iteration work unchanged */
+static bool map_mapped_slab(map_t *map, size_t count, const char *entries) {
+	size_t words = map_slab_words(count);
+	slab_t *slab = malloc(sizeof(slab_t) + words * sizeof(uint64_t));
+	slab_t **slabs = malloc(sizeof(slab_t *));
+
+	if (slab == NULL || slabs == NULL) {
+		free(slab);
+		free(slabs);
+		return false;
+	}
+
+	slab->entry_count = count;
+	slab->entries = (char *)entries;
+	memset(slab->live, 0xff, words * sizeof(uint64_t));
+	if (count % 64) {
+		slab->live[words - 1] = (1UL << (count % 64)) - 1;
+	}
+
+	slabs[0] = slab;
+	map->slabs = slabs;
+	map->slab_count = map->slab_size = 1;
+	map->slab_current = slab;
+	return true;
+}
+
+/* Whether offset, read from a slot of file, is empty or the start of one of
+ * its entries */
+static bool map_file_offset_valid(const map_file_t *file, uint64_t offset) {
+	return offset == 0 ||
+	       (offset >= file->entries &&
+	        offset - file->entries < file->entry_count * file->entry_stride &&
+	        (offset - file->entries) % file->entry_stride == 0);
+}
+
+/* Checks every slot of the tables and the stash of a mapped file, so that
+ * no lookup of a corrupt file dereferences outside its entries */
+static bool map_file_slots_valid(const map_file_t *file, const char *mapped) {
+	const bucket_t *tables[2] = {(const bucket_t *)(mapped + file->table_0),
+	                             (const bucket_t *)(mapped + file->table_1)};
+	const uint64_t *stash = (const uint64_t *)(mapped + file->stash);
+
+	for (size_t t = 0; t < 2; t++) {
+		for (size_t i = 0; i < (1UL << file->table_size); i++) {
+			for (size_t j = 0; j < BUCKET_SIZE; j++) {
+				uintptr_t offset = (uintptr_t)tables[t][i].slot[j];
+				if (!map_file_offset_valid(file, offset)) {
+					return false;
+				}
+			}
+		}
+	}
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		if (!map_file_offset_valid(file, stash[i])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Opens a file written by map_save as a read-only map that serves lookups
+ * straight from a shared mapping of the file, so that processes opening the
+ * same file share its page cache. Lookups, batch lookups and iteration work
+ * as usual, from any number of threads; whatever would modify the map fails.
+ * The map hashes and compares with the defaults of map_alloc, a map saved
+ * with others must be given them again before its first lookup. Returns NULL
+ * if the file is not a map, or if any of its slots points outside its
+ * entries. */
+map_t *map_open_mmap(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	const char *mapped = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(map_file_t)) {
+		mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		return NULL;
+	}
+
+	map_file_t file, layout;
+	memcpy(&file, mapped, sizeof(map_file_t));
+	layout = file;
+	if (file.table_size <= MAP_FILE_MAX_TABLE_SIZE) {
+		map_file_layout(&layout);
+	}
+
+	/* The entry geometry must be the one map_alloc gives the key and value
+	 * sizes, and the entries must fit the file without the layout having
+	 * wrapped around, before any slot can be checked against them. */
+	map_t *map = NULL;
+	if (file.table_size <= MAP_FILE_MAX_TABLE_SIZE &&
+	    memcmp(&file, &layout, sizeof(map_file_t)) == 0 &&
+	    file.file_size == (uint64_t)st.st_size &&
+	    file.seed_size == SEED_SIZE && file.alignment &&
+	    file.entry_stride >= file.key_size && file.entry_stride &&
+	    file.entry_stride % file.alignment == 0 && file.hash_cache <= 1 &&
+	    file.entry_count <= (uint64_t)st.st_size / file.entry_stride) {
+		map = map_alloc(file.key_size, file.value_size, file.alignment);
+	}
+	if (map && !(map_set_hash_cache(map, file.hash_cache) &&
+	             map->entry_stride == file.entry_stride &&
+	             (!file.hash_cache || map->hash_offset == file.hash_offset) &&
+	             map_file_slots_valid(&file, mapped))) {
+		map_free(map);
+		map = NULL;
+	}
+	if (map && (!file.entry_count ||
+	            map_mapped_slab(map, file.entry_count,
+	                            mapped + file.entries))) {
+		free(map->table_0);
+		free(map->table_1);
+		free(map->seed_0);
+		free(map->seed_1);
+
+		map->seed_0 = (void *)(mapped + file.seed_0);
+		map->seed_1 = (void *)(mapped + file.seed_1);
+		map->table_0 = (bucket_t *)(mapped + file.table_0);
+		map->table_1 = (bucket_t *)(mapped + file.table_1);
+		map->table_size = file.table_size;
+		map->entry_count = file.entry_count;
+		map->entry_stride = file.entry_stride;
+		map->hash_cache = file.hash_cache;
+		map->hash_offset = file.hash_offset;
+
+		const uint64_t *stash = (const uint64_t *)(mapped + file.stash);
+		for (size_t i = 0; i < STASH_SIZE; i++) {
+			map->stash[i] = (void *)(uintptr_t)stash[i];
+		}
+		memcpy(map->stash_tag, stash + STASH_SIZE, sizeof(map->stash_tag));
+
+		map->mapped = mapped;
+		map->mapped_size = st.st_size;
+		return map;
+	}
+
+	if (map) {
+		map_free(map);
+	}
+	munmap((void *)mapped, st.st_size);
+	return NULL;
+}
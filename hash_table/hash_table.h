@@ -3,6 +3,7 @@
 
 #include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,11 +11,55 @@
 #include "hash.h"
 
 typedef struct map_t map_t;
+
+#define MAP_STATS_PROBE_LENGTHS 8
+
+/* Filled in by map_get_stats when built with MAP_STATS. probe_length counts
+ * probes by the number of keys they compared, the last bin collecting all
+ * longer ones. */
+typedef struct map_stats_t {
+	size_t probes;
+	size_t hits_0, hits_1, hits_stash, misses;
+	size_t probe_length[MAP_STATS_PROBE_LENGTHS];
+
+	size_t cuckoo_searches, cuckoo_nodes, cuckoo_kicks, cuckoo_failures;
+	size_t stash_puts, stash_count;
+
+	size_t resizes, shrinks, migrated_buckets;
+	size_t rehashes, rehash_retries;
+	double rehash_seconds;
+} map_stats_t;
+
+/* Key of a map_alloc_str map: hash is a fingerprint of the bytes */
+typedef struct map_str_t {
+	const char *data;
+	size_t length;
+	size_t hash;
+} map_str_t;
+
+/* Position of an iteration over the entries of a map, see map_iter_begin */
+typedef struct map_iter_t {
+	map_t *map;
+	size_t slab;
+	size_t entry;
+	size_t remaining;
+} map_iter_t;
+
+/* Storage engine of a map, chosen at allocation, see map_alloc_engine */
+typedef enum map_engine_t {
+	MAP_ENGINE_CUCKOO,
+	MAP_ENGINE_SWISS,
+} map_engine_t;
+
 typedef size_t (*write_t)(void *restrict, const void *restrict, size_t);
 typedef int (*compare_t)(const void *, const void *);
 
 map_t *map_alloc(size_t key_size, size_t value_size, size_t alignment);
+map_t *map_alloc_engine(size_t key_size, size_t value_size, size_t alignment,
+                        map_engine_t engine);
 map_t *map_alloc_strn(size_t key_size, size_t value_size);
+map_t *map_alloc_str(size_t value_size, size_t alignment);
+map_str_t map_str_key(const char *data, size_t length);
 void map_free(map_t *map);
 
 void map_set_hash(map_t *map,
@@ -27,19 +72,48 @@ void map_set_key_write(map_t *map,
 void map_set_value_write(map_t *map,
                          void (*value_write)(void *restrict,
                                              const void *restrict, size_t));
+void map_set_incremental(map_t *map, bool incremental);
+bool map_set_hash_cache(map_t *map, bool hash_cache);
+bool map_set_concurrent(map_t *map, bool concurrent);
+void map_set_max_load(map_t *map, float max_load);
 
 bool map_insert(map_t *map, const void *key, const void *value);
+void *map_upsert(map_t *map, const void *key, const void *value,
+                 bool *created);
+void *map_find_or_insert(map_t *map, const void *key, const void *value,
+                         bool *created);
 bool map_delete(map_t *map, const void *key);
 bool map_search(map_t *map, const void *key);
 void *map_lookup(map_t *map, const void *key, void *lookup_dst);
 
-void *map_for(map_t *map, const void *key, void (*f)(void *));
-void *map_for_each(map_t *map, void (*f)(void *));
-size_t map_count(map_t *map);
+size_t map_lookup_batch(map_t *map, const void *keys, size_t n,
+                        void *out_values, bool *out_found);
+size_t map_insert_batch(map_t *map, const void *keys, const void *values,
+                        size_t n);
+size_t map_delete_batch(map_t *map, const void *keys, size_t n);
+
+bool map_save(map_t *map, const char *path);
+map_t *map_open_mmap(const char *path);
 
-static void map_rehash(map_t *map);
+bool map_reserve(map_t *map, size_t count);
+bool map_shrink_to_fit(map_t *map);
+size_t map_build(map_t *map, const void *keys, const void *values,
+                 size_t count);
 
-static void *map_cuckoo(map_t *map, void *item, size_t max_iter);
+void map_iter_begin(map_t *map, map_iter_t *iter);
+void map_iter_range(map_t *map, map_iter_t *iter, size_t part, size_t parts);
+bool map_iter_next(map_iter_t *iter, const void **key, void **value);
+
+void *map_for(map_t *map, const void *key, void (*f)(void *));
+size_t map_for_each(map_t *map, void (*f)(const void *, void *, void *),
+                    void *context);
+size_t map_for_each_range(map_t *map, size_t part, size_t parts,
+                          void (*f)(const void *, void *, void *),
+                          void *context);
+size_t map_count(map_t *map);
+size_t map_capacity(map_t *map);
+bool map_get_stats(map_t *map, map_stats_t *stats);
+void map_reset_stats(map_t *map);
 
 void map_print(map_t *map);
 
@@ -0,0 +1,854 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hash_table.h"
+
+/* Behaviour tests for map_t. Random operations on size_t keys are mirrored
+ * in a reference array indexed by key, over a universe small enough that
+ * keys are inserted and deleted many times over, and the map must agree
+ * with it after every step. */
+
+#define UNIVERSE 4096UL
+#define READERS 4UL
+#define WRITERS 2UL
+#define PER_WRITER 20000UL
+#define VALUE_BITS 20
+
+typedef struct reference_t {
+	bool present[UNIVERSE];
+	size_t value[UNIVERSE];
+	size_t count;
+} reference_t;
+
+/* xorshift64, so that a failing sequence of operations repeats */
+static uint64_t test_state = 0x9e3779b97f4a7c15UL;
+
+static size_t test_rand(size_t n) {
+	test_state ^= test_state << 13;
+	test_state ^= test_state >> 7;
+	test_state ^= test_state << 17;
+	return test_state % n;
+}
+
+static map_t *test_map(void) {
+	map_t *map = map_alloc(sizeof(size_t), sizeof(size_t), _Alignof(size_t));
+	assert(map);
+	return map;
+}
+
+static void test_count_entry(const void *key, void *value, void *context) {
+	assert(*(const size_t *)key < UNIVERSE);
+	(void)value;
+	(*(size_t *)context)++;
+}
+
+/* Every key of the universe is looked up, and iteration visits count entries */
+static void test_agree(map_t *map, const reference_t *ref) {
+	size_t visited = 0;
+
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		size_t value = 0;
+		assert(map_search(map, &k) == ref->present[k]);
+		assert((map_lookup(map, &k, &value) != NULL) == ref->present[k]);
+		assert(!ref->present[k] || value == ref->value[k]);
+	}
+
+	assert(map_count(map) == ref->count);
+	assert(map_for_each(map, test_count_entry, &visited) == ref->count);
+	assert(visited == ref->count);
+}
+
+static void test_reference_step(map_t *map, reference_t *ref) {
+	size_t k = test_rand(UNIVERSE), v = test_rand(SIZE_MAX);
+
+	switch (test_rand(3)) {
+	case 0:
+		assert(map_insert(map, &k, &v));
+		if (!ref->present[k]) {
+			ref->present[k] = true;
+			ref->value[k] = v;
+			ref->count++;
+		}
+		break;
+	case 1:
+		assert(map_delete(map, &k) == ref->present[k]);
+		ref->count -= ref->present[k];
+		ref->present[k] = false;
+		break;
+	default:
+		v = 0;
+		assert(map_search(map, &k) == ref->present[k]);
+		assert((map_lookup(map, &k, &v) != NULL) == ref->present[k]);
+		assert(!ref->present[k] || v == ref->value[k]);
+	}
+}
+
+/* Runs steps random operations, checking the whole universe every
+ * UNIVERSE steps. An existing key keeps its value on insertion. */
+static void test_reference(map_t *map, size_t steps) {
+	reference_t *ref = calloc(1, sizeof(reference_t));
+	assert(ref);
+
+	for (size_t i = 1; i <= steps; i++) {
+		test_reference_step(map, ref);
+		if (i % UNIVERSE == 0) {
+			test_agree(map, ref);
+		}
+	}
+	test_agree(map, ref);
+
+	/* Empty it again, through growth and the free list in reverse */
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		assert(map_delete(map, &k) == ref->present[k]);
+		ref->count -= ref->present[k];
+		ref->present[k] = false;
+	}
+	test_agree(map, ref);
+	free(ref);
+}
+
+/* map_find_or_insert leaves the value of an existing key alone, and map_upsert
+ * overwrites it. Both report whether the key was new in created and return
+ * the slot map_lookup finds. A NULL value inserts a zero-filled one, and
+ * map_upsert refuses it. */
+static void test_upsert(map_t *map) {
+	reference_t *ref = calloc(1, sizeof(reference_t));
+	assert(map && ref);
+
+	for (size_t i = 1; i <= 8 * UNIVERSE; i++) {
+		size_t k = test_rand(UNIVERSE), v = test_rand(SIZE_MAX), *slot;
+		bool created = ref->present[k];
+
+		switch (test_rand(4)) {
+		case 0:
+			slot = map_find_or_insert(map, &k, &v, &created);
+			break;
+		case 1:
+			slot = map_upsert(map, &k, &v, &created);
+			ref->value[k] = v;
+			break;
+		case 2:
+			v = 0;
+			slot = map_find_or_insert(map, &k, NULL, NULL);
+			created = !ref->present[k];
+			break;
+		default:
+			assert(map_delete(map, &k) == ref->present[k]);
+			ref->count -= ref->present[k];
+			ref->present[k] = false;
+			continue;
+		}
+
+		assert(slot && created == !ref->present[k]);
+		if (created) {
+			ref->present[k] = true;
+			ref->value[k] = v;
+			ref->count++;
+		}
+		assert(*slot == ref->value[k]);
+		assert(map_lookup(map, &k, NULL) == slot);
+
+		if (i % UNIVERSE == 0) {
+			test_agree(map, ref);
+		}
+	}
+	test_agree(map, ref);
+	assert(!map_upsert(map, &(size_t){0}, NULL, NULL));
+
+	free(ref);
+	map_free(map);
+}
+
+/* Looks up a few random keys one at a time and as a batch */
+static void test_sample(map_t *map, const reference_t *ref) {
+	size_t keys[8], values[8];
+	bool found[8];
+
+	for (size_t j = 0; j < 8; j++) {
+		size_t v = 0;
+		keys[j] = test_rand(UNIVERSE);
+		assert((map_lookup(map, &keys[j], &v) != NULL) ==
+		       ref->present[keys[j]]);
+		assert(!ref->present[keys[j]] || v == ref->value[keys[j]]);
+	}
+
+	map_lookup_batch(map, keys, 8, values, found);
+	for (size_t j = 0; j < 8; j++) {
+		assert(found[j] == ref->present[keys[j]]);
+		assert(!found[j] || values[j] == ref->value[keys[j]]);
+	}
+}
+
+/* With incremental growth every insertion that grows the map leaves the old
+ * tables to be migrated MIGRATE_STEP buckets per operation. Filling the map
+ * from empty with three insertions to each deletion keeps a migration under
+ * way for most of the operations, and every one of them is followed by a
+ * sample of lookups. Turning incremental growth off finishes a migration
+ * at once. */
+static void test_incremental(void) {
+	for (size_t round = 0; round < 4; round++) {
+		map_t *map = test_map();
+		reference_t *ref = calloc(1, sizeof(reference_t));
+		assert(ref);
+		map_set_incremental(map, true);
+
+		while (ref->count < UNIVERSE * 3 / 4) {
+			size_t k = test_rand(UNIVERSE), v = test_rand(SIZE_MAX);
+
+			if (test_rand(4)) {
+				assert(map_insert(map, &k, &v));
+				if (!ref->present[k]) {
+					ref->present[k] = true;
+					ref->value[k] = v;
+					ref->count++;
+				}
+			} else {
+				assert(map_delete(map, &k) == ref->present[k]);
+				ref->count -= ref->present[k];
+				ref->present[k] = false;
+			}
+			assert(map_count(map) == ref->count);
+			test_sample(map, ref);
+		}
+
+		map_set_incremental(map, false);
+		test_agree(map, ref);
+		free(ref);
+		map_free(map);
+	}
+}
+
+/* Random batches of up to a few blocks, so most end in a partial block,
+ * with keys repeated within a batch. A key inserted twice keeps its first
+ * value and one deleted twice counts once; map_lookup must agree with
+ * every lookup a batch makes. */
+static void test_batch(map_t *map) {
+	reference_t *ref = calloc(1, sizeof(reference_t));
+	size_t keys[100], values[100];
+	bool found[100];
+	assert(map && ref);
+
+	for (size_t i = 1; i <= 4 * UNIVERSE; i++) {
+		size_t n = test_rand(100), expect = 0;
+
+		for (size_t j = 0; j < n; j++) {
+			keys[j] = j && !test_rand(4) ? keys[test_rand(j)]
+			                             : test_rand(UNIVERSE);
+			values[j] = test_rand(SIZE_MAX);
+		}
+
+		switch (test_rand(3)) {
+		case 0:
+			assert(map_insert_batch(map, keys, values, n) == n);
+			for (size_t j = 0; j < n; j++) {
+				if (!ref->present[keys[j]]) {
+					ref->present[keys[j]] = true;
+					ref->value[keys[j]] = values[j];
+					ref->count++;
+				}
+			}
+			break;
+		case 1:
+			for (size_t j = 0; j < n; j++) {
+				expect += ref->present[keys[j]];
+				ref->count -= ref->present[keys[j]];
+				ref->present[keys[j]] = false;
+			}
+			assert(map_delete_batch(map, keys, n) == expect);
+			break;
+		default:
+			for (size_t j = 0; j < n; j++) {
+				expect += ref->present[keys[j]];
+			}
+			assert(map_lookup_batch(map, keys, n, NULL, NULL) == expect);
+			assert(map_lookup_batch(map, keys, n, values, NULL) == expect);
+			assert(map_lookup_batch(map, keys, n, values, found) == expect);
+			for (size_t j = 0; j < n; j++) {
+				size_t v = 0;
+				assert(found[j] == ref->present[keys[j]]);
+				assert((map_lookup(map, &keys[j], &v) != NULL) == found[j]);
+				assert(!found[j] || (values[j] == ref->value[keys[j]] &&
+				                     values[j] == v));
+			}
+		}
+
+		if (i % UNIVERSE == 0) {
+			test_agree(map, ref);
+		}
+	}
+	test_agree(map, ref);
+
+	free(ref);
+	map_free(map);
+}
+
+static void test_default(void) {
+	map_t *map = test_map();
+	test_reference(map, 16 * UNIVERSE);
+	map_free(map);
+}
+
+/* The same operations through map_t on the swiss engine */
+static void test_swiss_engine(void) {
+	map_t *map = map_alloc_engine(sizeof(size_t), sizeof(size_t),
+	                              _Alignof(size_t), MAP_ENGINE_SWISS);
+	assert(map);
+	test_reference(map, 16 * UNIVERSE);
+	assert(map_shrink_to_fit(map));
+	map_free(map);
+}
+
+/* The reference run with the hashes cached in the entries. Each run grows
+ * the map from empty and shrinks it back, incrementally in the second, and
+ * at a maximum load of 0.95 the third also rehashes after failed
+ * insertions and fills the stash. The cache can only be toggled while the
+ * map is empty. */
+static void test_hash_cache(void) {
+	for (size_t run = 0; run < 3; run++) {
+		map_t *map = test_map();
+		assert(map_set_hash_cache(map, true));
+		map_set_incremental(map, run == 1);
+		if (run == 2) {
+			map_set_max_load(map, 0.95f);
+		}
+
+		test_reference(map, 16 * UNIVERSE);
+
+		assert(map_insert(map, &(size_t){1}, &(size_t){1}));
+		assert(!map_set_hash_cache(map, false));
+		assert(map_delete(map, &(size_t){1}));
+		assert(map_set_hash_cache(map, false));
+		map_free(map);
+	}
+}
+
+/* A map only grows once it holds the maximum load of its slots. At 0.9
+ * and 0.95 insertions near the limit need long cuckoo searches and the
+ * stash, and no key may be lost on the way. */
+static void test_max_load(void) {
+	const float loads[] = {0.9f, 0.95f};
+	size_t n = 16 * UNIVERSE;
+
+	for (size_t l = 0; l < 2; l++) {
+		map_t *map = test_map();
+		map_set_max_load(map, loads[l]);
+		size_t capacity = map_capacity(map), grown = 0;
+
+		for (size_t k = 0; k < n; k++) {
+			assert(map_insert(map, &k, &k));
+			if (map_capacity(map) == capacity) {
+				continue;
+			}
+
+			/* Grown by the insertion of k, with k entries before it */
+			assert(capacity * loads[l] <= k);
+			assert(map_capacity(map) == 2 * capacity);
+			capacity = map_capacity(map);
+			grown++;
+			for (size_t j = 0; j <= k; j++) {
+				size_t v;
+				assert(map_lookup(map, &j, &v) && v == j);
+			}
+		}
+		assert(grown > 4);
+		assert(map_count(map) == n);
+
+		for (size_t k = 0; k < n; k++) {
+			size_t v;
+			assert(map_lookup(map, &k, &v) && v == k);
+		}
+		map_free(map);
+	}
+}
+
+/* map_build sizes the tables for all of its pairs up front, to the smallest
+ * capacity that holds them under the maximum load, here 0.5. map_reserve
+ * picks the same size and holds it through the insertions it was made for
+ * and through deleting them again, until map_shrink_to_fit. */
+static void test_reserve(void) {
+	size_t n = 16 * UNIVERSE;
+	size_t *keys = malloc(n * sizeof(size_t));
+	size_t *values = malloc(n * sizeof(size_t));
+	assert(keys && values);
+	for (size_t i = 0; i < n; i++) {
+		keys[i] = i * 0x9e3779b97f4a7c15UL;
+		values[i] = i;
+	}
+
+	map_t *built = test_map();
+	map_set_max_load(built, 0.5f);
+	assert(map_build(built, keys, values, n) == n);
+	size_t capacity = map_capacity(built);
+	assert(n < capacity / 2 && capacity / 4 <= n);
+	assert(map_count(built) == n);
+	for (size_t i = 0; i < n; i++) {
+		size_t v;
+		assert(map_lookup(built, &keys[i], &v) && v == i);
+	}
+	map_free(built);
+
+	map_t *map = test_map();
+	map_set_max_load(map, 0.5f);
+	assert(map_reserve(map, n));
+	assert(map_capacity(map) == capacity);
+	for (size_t i = 0; i < n; i++) {
+		assert(map_insert(map, &keys[i], &values[i]));
+		assert(map_capacity(map) == capacity);
+	}
+	for (size_t i = 0; i < n; i++) {
+		assert(map_delete(map, &keys[i]));
+		assert(map_capacity(map) == capacity);
+	}
+	assert(map_shrink_to_fit(map));
+	assert(map_capacity(map) < capacity);
+	map_free(map);
+
+	free(keys);
+	free(values);
+}
+
+static void test_str_entry(const void *key, void *value, void *context) {
+	const map_str_t *s = key;
+	assert(*(size_t *)value == s->length);
+	assert(memcmp(s->data, context, s->length) == 0);
+}
+
+/* String keys are prefixes of one random text with NULs in it, so they
+ * share their bytes, from the empty key to ones longer than an arena chunk.
+ * The map keeps copies of the bytes: the text is wiped once inserted and
+ * keys are looked up in a copy of it. Deleted keys can be inserted again. */
+static void test_str_keys(void) {
+	size_t longest = 100000, lengths[1026], n = 0;
+	char *text = malloc(longest), *copy = malloc(longest);
+	map_t *map = map_alloc_str(sizeof(size_t), _Alignof(size_t));
+	assert(text && copy && map);
+
+	for (size_t i = 0; i < longest; i++) {
+		text[i] = test_rand(8) ? (char)('a' + test_rand(4)) : '\0';
+	}
+	memcpy(copy, text, longest);
+	for (size_t length = 0; length < 1024; length++) {
+		lengths[n++] = length;
+	}
+	lengths[n++] = 70000;
+	lengths[n++] = longest;
+
+	for (size_t i = 0; i < n; i++) {
+		map_str_t key = map_str_key(text, lengths[i]);
+		assert(map_insert(map, &key, &lengths[i]));
+	}
+	memset(text, 0, longest);
+	assert(map_count(map) == n);
+
+	for (size_t i = 0; i < n; i++) {
+		map_str_t key = map_str_key(copy, lengths[i]);
+		size_t v;
+		assert(map_lookup(map, &key, &v) && v == lengths[i]);
+		if (lengths[i]) {
+			copy[lengths[i] - 1] ^= 1;
+			key = map_str_key(copy, lengths[i]);
+			assert(!map_search(map, &key));
+			copy[lengths[i] - 1] ^= 1;
+		}
+	}
+	assert(map_for_each(map, test_str_entry, copy) == n);
+
+	for (size_t i = 0; i < n; i += 2) {
+		map_str_t key = map_str_key(copy, lengths[i]);
+		assert(map_delete(map, &key));
+		assert(!map_search(map, &key));
+	}
+	assert(map_count(map) == n / 2);
+	for (size_t i = 0; i < n; i += 2) {
+		map_str_t key = map_str_key(copy, lengths[i]);
+		size_t v = 2 * lengths[i];
+		assert(map_insert(map, &key, &v));
+	}
+	for (size_t i = 0; i < n; i++) {
+		map_str_t key = map_str_key(copy, lengths[i]);
+		size_t v;
+		assert(map_lookup(map, &key, &v));
+		assert(v == (i % 2 ? 1 : 2) * lengths[i]);
+	}
+
+	map_free(map);
+	free(text);
+	free(copy);
+}
+
+/* Keys far apart in value still land in the same map */
+static void test_sparse_keys(void) {
+	map_t *map = test_map();
+	size_t n = 100000;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t k = i * 0x9e3779b97f4a7c15UL;
+		assert(map_insert(map, &k, &i));
+	}
+	assert(map_count(map) == n);
+	for (size_t i = 0; i < n; i++) {
+		size_t k = i * 0x9e3779b97f4a7c15UL, v;
+		assert(map_lookup(map, &k, &v) && v == i);
+	}
+	for (size_t i = 0; i < n; i += 2) {
+		size_t k = i * 0x9e3779b97f4a7c15UL;
+		assert(map_delete(map, &k));
+		assert(!map_delete(map, &k));
+	}
+	assert(map_count(map) == n / 2);
+	map_free(map);
+}
+
+static void test_sum_entry(const void *key, void *value, void *context) {
+	size_t *sum = context;
+	(void)value;
+	sum[0]++;
+	sum[1] += *(const size_t *)key;
+}
+
+/* map_reserve leaves a slab of exactly the reserved size, here never a
+ * multiple of 64, and deleting the last keys placed in it makes it end in
+ * dead entries. However the map is split into parts, they must visit
+ * every entry once between them. */
+static void test_iter_ranges(void) {
+	for (size_t reserved = 65; reserved < 300; reserved += 37) {
+		map_t *map = test_map();
+		size_t n = reserved + 30, count = 0, key_sum = 0;
+
+		assert(map_reserve(map, reserved));
+		for (size_t k = 0; k < n; k++) {
+			assert(map_insert(map, &k, &k));
+		}
+		for (size_t k = 0; k < n; k++) {
+			if (reserved - 20 <= k && k < reserved) {
+				assert(map_delete(map, &k));
+			} else {
+				count++;
+				key_sum += k;
+			}
+		}
+		assert(map_count(map) == count);
+
+		for (size_t parts = 1; parts <= 60; parts++) {
+			size_t sum[2] = {0, 0};
+			for (size_t part = 0; part < parts; part++) {
+				map_for_each_range(map, part, parts, test_sum_entry, sum);
+			}
+			assert(sum[0] == count && sum[1] == key_sum);
+
+			size_t visited = 0;
+			for (size_t part = 0; part < parts; part++) {
+				map_iter_t iter;
+				const void *key;
+				void *value;
+
+				map_iter_range(map, &iter, part, parts);
+				while (map_iter_next(&iter, &key, &value)) {
+					assert(*(const size_t *)value == *(const size_t *)key);
+					visited++;
+				}
+			}
+			assert(visited == count);
+		}
+
+		map_free(map);
+	}
+}
+
+/* Deleting nearly everything shrinks the tables many times over, and the
+ * slot of every remaining entry stays where map_find_or_insert put it.
+ * map_shrink_to_fit then compacts them, keeping the keys and values. */
+static void test_pointer_stability(bool concurrent) {
+	map_t *map = test_map();
+	assert(map_set_concurrent(map, concurrent));
+	size_t n = 64 * UNIVERSE;
+	size_t **slot = malloc(n * sizeof(size_t *));
+	assert(slot);
+
+	for (size_t k = 0; k < n; k++) {
+		bool created;
+		slot[k] = map_find_or_insert(map, &k, &k, &created);
+		assert(slot[k] && created);
+	}
+	for (size_t k = 0; k < n; k++) {
+		if (k % 64) {
+			assert(map_delete(map, &k));
+		}
+	}
+	assert(map_count(map) == n / 64);
+	for (size_t k = 0; k < n; k += 64) {
+		assert(map_lookup(map, &k, NULL) == slot[k] && *slot[k] == k);
+	}
+
+	assert(map_shrink_to_fit(map));
+	assert(map_count(map) == n / 64);
+	for (size_t k = 0; k < n; k++) {
+		size_t *value = map_lookup(map, &k, NULL);
+		assert((value != NULL) == (k % 64 == 0));
+		assert(!value || *value == k);
+	}
+
+	free(slot);
+	map_free(map);
+}
+
+typedef struct test_thread_t {
+	map_t *map;
+	size_t id;
+	bool *done;
+} test_thread_t;
+
+/* Value of a stable key: the key, and a count below it */
+static void test_bump(void *value) {
+	size_t *v = value, mask = (1UL << VALUE_BITS) - 1;
+	*v = (*v & ~mask) | ((*v + 1) & mask);
+}
+
+/* Writer id inserts keys (id + 1) * 2^32 + i, growing the map, and deletes
+ * them again, shrinking it. In between it changes the values of the stable
+ * keys through map_upsert and map_for. */
+static void *test_writer(void *arg) {
+	test_thread_t *thread = arg;
+	size_t base = (thread->id + 1) << 32;
+
+	for (size_t i = 0; i < PER_WRITER; i++) {
+		size_t k = base + i, stable = i % UNIVERSE;
+		assert(map_insert(thread->map, &k, &k));
+
+		if (i % 8 == 0) {
+			size_t v = stable << VALUE_BITS | (i & ((1UL << VALUE_BITS) - 1));
+			bool created = true;
+			assert(map_upsert(thread->map, &stable, &v, &created) && !created);
+		} else if (i % 8 == 4) {
+			assert(map_for(thread->map, &stable, test_bump));
+		}
+	}
+	for (size_t i = 0; i < PER_WRITER; i++) {
+		size_t k = base + i, v = 0;
+		assert(map_lookup(thread->map, &k, &v) && v == k);
+		assert(map_delete(thread->map, &k));
+	}
+
+	return NULL;
+}
+
+/* The stable keys must always be found with a value of theirs, and keys
+ * outside every writer's range never */
+static void *test_reader(void *arg) {
+	test_thread_t *thread = arg;
+	size_t keys[64], values[64];
+	bool found[64];
+
+	for (size_t round = 0; !__atomic_load_n(thread->done, __ATOMIC_RELAXED);
+	     round++) {
+		for (size_t k = 0; k < UNIVERSE; k++) {
+			size_t v = 0, absent = ~k;
+			assert(map_lookup(thread->map, &k, &v) && v >> VALUE_BITS == k);
+			assert(!map_search(thread->map, &absent));
+		}
+
+		for (size_t i = 0; i < 64; i++) {
+			keys[i] = i % 2 ? (round * 64 + i) % UNIVERSE : ~i;
+		}
+		assert(map_lookup_batch(thread->map, keys, 64, values, found) == 32);
+		for (size_t i = 0; i < 64; i++) {
+			assert(found[i] == (i % 2 == 1));
+			assert(!found[i] || values[i] >> VALUE_BITS == keys[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/* Readers probe a concurrent map without a lock while writers grow, shrink
+ * and rehash it and replace the entries the readers are copying from */
+static void test_threads(void) {
+	map_t *map = test_map();
+	pthread_t writers[WRITERS], readers[READERS];
+	test_thread_t args[WRITERS + READERS];
+	bool done = false;
+
+	assert(map_set_concurrent(map, true));
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		size_t v = k << VALUE_BITS;
+		assert(map_insert(map, &k, &v));
+	}
+
+	for (size_t i = 0; i < WRITERS + READERS; i++) {
+		args[i] = (test_thread_t){.map = map, .id = i, .done = &done};
+	}
+	for (size_t i = 0; i < READERS; i++) {
+		assert(!pthread_create(&readers[i], NULL, test_reader,
+		                       &args[WRITERS + i]));
+	}
+	for (size_t i = 0; i < WRITERS; i++) {
+		assert(!pthread_create(&writers[i], NULL, test_writer, &args[i]));
+	}
+	for (size_t i = 0; i < WRITERS; i++) {
+		pthread_join(writers[i], NULL);
+	}
+	__atomic_store_n(&done, true, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < READERS; i++) {
+		pthread_join(readers[i], NULL);
+	}
+
+	assert(map_count(map) == UNIVERSE);
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		size_t v = 0;
+		assert(map_lookup(map, &k, &v) && v >> VALUE_BITS == k);
+	}
+	map_free(map);
+}
+
+/* Words of the map_save header, as hash_table.c lays it out */
+enum {
+	FILE_ENTRY_STRIDE = 6,
+	FILE_TABLE_0 = 14,
+	FILE_STASH = 16,
+	FILE_ENTRIES = 17,
+	FILE_SIZE = 18
+};
+
+static void test_write_file(const char *path, const char *data, size_t size) {
+	FILE *stream = fopen(path, "wb");
+	assert(stream && fwrite(data, 1, size, stream) == size);
+	assert(fclose(stream) == 0);
+}
+
+/* Whether the file at path, with the word at offset set to word, opens */
+static bool test_open_corrupt(const char *path, const char *data, size_t size,
+                              size_t offset, uint64_t word) {
+	char *copy = malloc(size);
+	assert(copy);
+	memcpy(copy, data, size);
+	memcpy(copy + offset, &word, sizeof(word));
+	test_write_file(path, copy, size);
+	free(copy);
+
+	map_t *map = map_open_mmap(path);
+	if (map) {
+		map_free(map);
+	}
+	return map != NULL;
+}
+
+/* A saved map serves every lookup from its mapping, and a file that is
+ * truncated or has a slot pointing anywhere but at one of its entries does
+ * not open at all */
+static void test_snapshot(void) {
+	char path[] = "/tmp/hash_table_test_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	close(fd);
+
+	map_t *map = test_map();
+	for (size_t k = 0; k < UNIVERSE; k += 2) {
+		size_t v = k + 1;
+		assert(map_insert(map, &k, &v));
+	}
+	assert(map_save(map, path));
+	map_free(map);
+
+	map = map_open_mmap(path);
+	assert(map && map_count(map) == UNIVERSE / 2);
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		size_t v = 0;
+		assert((map_lookup(map, &k, &v) != NULL) == (k % 2 == 0));
+		assert(k % 2 || v == k + 1);
+	}
+
+	size_t keys[UNIVERSE], values[UNIVERSE];
+	bool found[UNIVERSE];
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		keys[k] = k;
+	}
+	assert(map_lookup_batch(map, keys, UNIVERSE, values, found) ==
+	       UNIVERSE / 2);
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		assert(found[k] == (k % 2 == 0));
+		assert(k % 2 || values[k] == k + 1);
+	}
+	assert(!map_insert(map, &(size_t){1}, &(size_t){1}));
+
+	/* Nothing can be written, so a batch fails at its first key */
+	assert(map_insert_batch(map, keys + 1, values, 40) == 0);
+	assert(map_delete_batch(map, keys, 40) == 0);
+	assert(map_count(map) == UNIVERSE / 2);
+	map_free(map);
+
+	FILE *stream = fopen(path, "rb");
+	assert(stream && fseek(stream, 0, SEEK_END) == 0);
+	size_t size = ftell(stream);
+	char *data = malloc(size);
+	rewind(stream);
+	assert(data && fread(data, 1, size, stream) == size);
+	fclose(stream);
+
+	const uint64_t *header = (const uint64_t *)data;
+	uint64_t stride = header[FILE_ENTRY_STRIDE];
+	uint64_t entries = header[FILE_ENTRIES];
+	uint64_t table_0 = header[FILE_TABLE_0];
+
+	/* The first slot in use of table_0. Buckets take 64 bytes, four tags
+	 * then four slots. */
+	size_t slot = table_0 + sizeof(uint64_t);
+	while (*(const uint64_t *)(data + slot) == 0) {
+		slot += sizeof(uint64_t);
+		if ((slot - table_0) % 64 == sizeof(uint64_t) * 5) {
+			slot += 64 - sizeof(uint64_t) * 4;
+		}
+	}
+	assert(slot < header[FILE_STASH]);
+
+	assert(test_open_corrupt(path, data, size, slot, entries));
+	assert(!test_open_corrupt(path, data, size, slot, entries - stride));
+	assert(!test_open_corrupt(path, data, size, slot, entries + 1));
+	assert(!test_open_corrupt(path, data, size, slot, size));
+	assert(!test_open_corrupt(path, data, size, slot, UINT64_MAX - 7));
+	assert(!test_open_corrupt(path, data, size, header[FILE_STASH], size));
+	assert(!test_open_corrupt(path, data, size, header[FILE_STASH], 8));
+	assert(!test_open_corrupt(path, data, size,
+	                          FILE_SIZE * sizeof(uint64_t), size - stride));
+
+	test_write_file(path, data, size - stride);
+	assert(!map_open_mmap(path));
+
+	free(data);
+	unlink(path);
+}
+
+int main(void) {
+	test_default();
+	test_swiss_engine();
+	test_hash_cache();
+	test_max_load();
+	test_reserve();
+	test_str_keys();
+	test_incremental();
+	test_batch(test_map());
+	test_batch(map_alloc_engine(sizeof(size_t), sizeof(size_t),
+	                            _Alignof(size_t), MAP_ENGINE_SWISS));
+
+	test_upsert(test_map());
+	test_upsert(map_alloc_engine(sizeof(size_t), sizeof(size_t),
+	                             _Alignof(size_t), MAP_ENGINE_SWISS));
+
+	map_t *concurrent = test_map();
+	assert(map_set_concurrent(concurrent, true));
+	test_batch(concurrent);
+	concurrent = test_map();
+	assert(map_set_concurrent(concurrent, true));
+	test_upsert(concurrent);
+	test_sparse_keys();
+	test_iter_ranges();
+	test_pointer_stability(false);
+	test_pointer_stability(true);
+	test_snapshot();
+	test_threads();
+
+	puts("hash_table_test: ok");
+	return 0;
+}
@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <stdio.h>
+
+/* Included rather than linked, so that pmul_portable and the kernels behind
+ * each batch function can be called directly */
+#include "hash.c"
+
+/* Every pmul path must give pmul_portable's products, and every batch kernel
+ * the values of its single key hash, for any n and any alignment of the
+ * keys. wyhash and strnwyhash are checked on keys of every length and
+ * alignment. */
+
+#define TEST_MAX_N 70
+
+static uint64_t test_state = 0x9e3779b97f4a7c15UL;
+
+static size_t test_next(void) {
+	test_state ^= test_state << 13;
+	test_state ^= test_state >> 7;
+	test_state ^= test_state << 17;
+	return test_state;
+}
+
+static const size_t test_edge[] = {
+    0, 1, 2, 3, 0x1b, 0x7fffffffffffffffUL, 0x8000000000000000UL,
+    0xf000000000000000UL, 0xffffffffffffffffUL, 0x0123456789abcdefUL};
+
+#define TEST_EDGE_COUNT (sizeof(test_edge) / sizeof(test_edge[0]))
+
+static void test_pmul_portable(void) {
+	/* x^63 * x wraps to x^4 + x^3 + x + 1 */
+	assert(pmul_portable(0x8000000000000000UL, 2) == 0x1b);
+	for (size_t i = 0; i < TEST_EDGE_COUNT; i++) {
+		assert(pmul_portable(test_edge[i], 0) == 0);
+		assert(pmul_portable(test_edge[i], 1) == test_edge[i]);
+	}
+	for (size_t i = 0; i < 1000; i++) {
+		size_t a = test_next(), b = test_next(), c = test_next();
+		assert(pmul_portable(a, b) == pmul_portable(b, a));
+		assert(pmul_portable(a, b ^ c) ==
+		       (pmul_portable(a, b) ^ pmul_portable(a, c)));
+	}
+}
+
+static void test_pmul(size_t (*f)(size_t, size_t)) {
+	for (size_t i = 0; i < TEST_EDGE_COUNT; i++) {
+		for (size_t j = 0; j < TEST_EDGE_COUNT; j++) {
+			assert(f(test_edge[i], test_edge[j]) ==
+			       pmul_portable(test_edge[i], test_edge[j]));
+		}
+	}
+	for (size_t i = 0; i < 100000; i++) {
+		size_t a = test_next(), b = test_next();
+		assert(f(a, b) == pmul_portable(a, b));
+	}
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static size_t test_pmul_clmul(size_t a, size_t b) { return pmul_clmul(a, b); }
+#endif
+
+/* wyhash of every length through its short, 16 byte and 48 byte paths, so
+ * that each tail length 0 to 16 follows each. A key copied to the end of a
+ * buffer of its exact size, at any alignment, must hash the same, and
+ * flipping any one of its bytes or changing the seed must change the
+ * hash. */
+static void test_wyhash(const size_t *seed) {
+	unsigned char data[2 * 48 + 16 + 16];
+	const size_t other_seed = *seed ^ 1;
+
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = (unsigned char)test_next();
+	}
+
+	for (size_t length = 0; length <= sizeof(data); length++) {
+		size_t h = wyhash(data, length, seed);
+		assert(h != wyhash(data, length, &other_seed));
+		assert(length == 0 || h != wyhash(data, length - 1, seed));
+
+		for (size_t offset = 0; offset < 8; offset++) {
+			unsigned char *buffer = malloc(offset + length);
+			unsigned char *key = buffer + offset;
+			assert(buffer);
+			memcpy(key, data, length);
+			assert(wyhash(key, length, seed) == h);
+
+			for (size_t i = 0; i < length; i++) {
+				key[i] ^= 1;
+				assert(wyhash(key, length, seed) != h);
+				key[i] ^= 1;
+			}
+			free(buffer);
+		}
+	}
+}
+
+/* strnwyhash hashes up to the first NUL or key_size bytes, whichever comes
+ * first, and ignores everything after it */
+static void test_strnwyhash(const size_t *seed) {
+	char text[] = "shared prefix\0tail one";
+	char other[] = "shared prefix\0another tail";
+
+	assert(strnwyhash(text, sizeof(text), seed) == wyhash(text, 13, seed));
+	assert(strnwyhash(text, sizeof(text), seed) ==
+	       strnwyhash(other, sizeof(other), seed));
+	assert(strnwyhash(text, 6, seed) == wyhash(text, 6, seed));
+	assert(strnwyhash(text, 6, seed) != strnwyhash(text, 7, seed));
+	assert(strnwyhash("", 16, seed) == wyhash(text, 0, seed));
+}
+
+/* Runs batch over every n up to TEST_MAX_N, from an aligned and a misaligned
+ * start, and checks it against hash key by key without writing past out[n] */
+static void test_batch(hash_batch_t batch, hash_t hash, const void *seed) {
+	size_t keys[TEST_MAX_N + 1], out[TEST_MAX_N + 2];
+
+	for (size_t i = 0; i <= TEST_MAX_N; i++) {
+		keys[i] = i < TEST_EDGE_COUNT ? test_edge[i] : test_next();
+	}
+
+	for (size_t start = 0; start < 2; start++) {
+		for (size_t n = 0; n + start <= TEST_MAX_N; n++) {
+			out[n + 1] = 0x5a5a5a5a5a5a5a5aUL;
+			batch(keys + start, n, seed, out + 1);
+			for (size_t i = 0; i < n; i++) {
+				assert(out[i + 1] == hash(&keys[start + i], sizeof(size_t),
+				                          seed));
+			}
+			assert(out[n + 1] == 0x5a5a5a5a5a5a5a5aUL);
+		}
+	}
+}
+
+static void test_batches(const size_t *seed) {
+	test_batch(xhash_batch, xhash, seed);
+	test_batch(xhash_batch, xhash, NULL);
+	test_batch(zhash2_batch, zhash2, seed);
+	test_batch(zhash2_batch, zhash2, NULL);
+	test_batch(zhash_batch, zhash, seed);
+}
+
+/* The batch functions under each kernel the CPU can run, not only the one
+ * pmul_init chose */
+static void test_kernels(void) {
+	size_t *seed = malloc(SEED_SIZE);
+	assert(seed);
+	for (size_t i = 0; i < SEED_SIZE / sizeof(size_t); i++) {
+		seed[i] = test_next();
+	}
+
+	assert(hash_batch_for(xhash) == xhash_batch);
+	assert(hash_batch_for(zhash2) == zhash2_batch);
+	assert(hash_batch_for(zhash) == zhash_batch);
+	assert(hash_batch_for(wyhash) == NULL);
+
+	test_batches(seed);
+
+	void (*chosen_xhash)(const size_t *, size_t, size_t, size_t *) =
+	    xhash_kernel;
+	void (*chosen_zhash)(const size_t *, size_t, const size_t *, size_t *) =
+	    zhash_kernel;
+
+	xhash_kernel = xhash_batch_scalar;
+	zhash_kernel = zhash_batch_pmul;
+	test_batches(seed);
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (__builtin_cpu_supports("avx2")) {
+		xhash_kernel = xhash_batch_avx2;
+		test_batches(seed);
+	}
+	if (__builtin_cpu_supports("avx512dq")) {
+		xhash_kernel = xhash_batch_avx512;
+		test_batches(seed);
+	}
+	if (pmul_has_clmul) {
+		zhash_kernel = zhash_batch_clmul;
+		test_batches(seed);
+	}
+	if (pmul_has_clmul && __builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("vpclmulqdq")) {
+		zhash_kernel = zhash_batch_vpclmul;
+		test_batches(seed);
+	}
+#endif
+
+	xhash_kernel = chosen_xhash;
+	zhash_kernel = chosen_zhash;
+	free(seed);
+}
+
+int main(void) {
+	test_pmul_portable();
+	test_pmul(pmul);
+#if defined(__x86_64__) && defined(__GNUC__)
+	if (pmul_has_clmul) {
+		test_pmul(test_pmul_clmul);
+	}
+#endif
+	test_kernels();
+
+	size_t seed = test_next();
+	test_wyhash(&seed);
+	test_strnwyhash(&seed);
+
+	printf("hash_test: ok (pmul %s)\n",
+	       pmul_accelerated() ? "accelerated" : "portable");
+	return 0;
+}
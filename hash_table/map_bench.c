@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "hash_table.h"
+
+/* Compares the map engines on 8-byte keys and values: insertion, lookups
+ * that hit and miss, and deletion, in nanoseconds per operation.
+ *
+ *     map_bench [count] */
+
+static double bench_clock(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+/* splitmix64, so that keys are distinct and spread over all bits */
+static uint64_t bench_key(uint64_t i) {
+	uint64_t z = i * 0x9e3779b97f4a7c15ULL + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void bench_engine(const char *name, map_engine_t engine,
+                         const uint64_t *keys, const uint64_t *misses,
+                         size_t n) {
+	map_t *map = map_alloc_engine(sizeof(uint64_t), sizeof(uint64_t),
+	                              _Alignof(uint64_t), engine);
+	if (!map) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		return;
+	}
+
+	uint64_t value, sum = 0;
+	size_t found = 0;
+
+	double t_0 = bench_clock();
+	for (size_t i = 0; i < n; i++) {
+		map_insert(map, &keys[i], &keys[i]);
+	}
+	double t_1 = bench_clock();
+	for (size_t i = 0; i < n; i++) {
+		found += map_lookup(map, &keys[i], &value) != NULL;
+		sum += value;
+	}
+	double t_2 = bench_clock();
+	for (size_t i = 0; i < n; i++) {
+		found += map_lookup(map, &misses[i], &value) != NULL;
+	}
+	double t_3 = bench_clock();
+	found += map_lookup_batch(map, keys, n, NULL, NULL);
+	double t_4 = bench_clock();
+	for (size_t i = 0; i < n; i++) {
+		found += map_delete(map, &keys[i]);
+	}
+	double t_5 = bench_clock();
+
+	printf("%-8s %10.1f %10.1f %10.1f %10.1f %10.1f   (%zu, %llx)\n", name,
+	       1e9 * (t_1 - t_0) / n, 1e9 * (t_2 - t_1) / n,
+	       1e9 * (t_3 - t_2) / n, 1e9 * (t_4 - t_3) / n,
+	       1e9 * (t_5 - t_4) / n, found, (unsigned long long)sum);
+
+	map_free(map);
+}
+
+int main(int argc, char **argv) {
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	uint64_t *keys = malloc(n * sizeof(uint64_t));
+	uint64_t *misses = malloc(n * sizeof(uint64_t));
+
+	if (!n || !keys || !misses) {
+		free(keys);
+		free(misses);
+		return 1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		keys[i] = bench_key(i);
+		misses[i] = bench_key(n + i);
+	}
+
+	printf("%zu keys, ns/op\n", n);
+	printf("%-8s %10s %10s %10s %10s %10s\n", "engine", "insert", "hit",
+	       "miss", "batch", "delete");
+	bench_engine("cuckoo", MAP_ENGINE_CUCKOO, keys, misses, n);
+	bench_engine("swiss", MAP_ENGINE_SWISS, keys, misses, n);
+
+	free(keys);
+	free(misses);
+	return 0;
+}
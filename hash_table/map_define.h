@@ -0,0 +1,303 @@
+#ifndef MAP_DEFINE_H
+#define MAP_DEFINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+/* MAP_DEFINE(name, K, V, hash_fn, eq_fn) emits a cuckoo map from K to V
+ * named name_t, with static inline name_alloc, name_free, name_count,
+ * name_insert, name_lookup, name_search and name_delete. Keys and values are
+ * stored inline in the buckets and every size is a compile-time constant, so
+ * the bucket scans unroll and a hash_fn visible in the including translation
+ * unit is inlined. hash_fn has the hash_t signature and eq_fn(a, b) compares
+ * two K values, e.g. MAP_DEFINE_EQ for scalar keys. Buckets are aligned to
+ * MAP_DEFINE_ALIGNMENT and padded to a multiple of it, so that a bucket that
+ * fits a cache line takes exactly one. */
+
+#define MAP_DEFINE_BUCKET_SIZE 4UL
+#define MAP_DEFINE_INIT_SIZE 4UL
+#define MAP_DEFINE_MAX_KICKS 32UL
+#define MAP_DEFINE_MAX_REBUILDS 4UL
+#define MAP_DEFINE_ALIGNMENT 64UL
+#define MAP_DEFINE_TAG(h) ((uint16_t)((h) >> 48) ? (uint16_t)((h) >> 48) : 1)
+#define MAP_DEFINE_EQ(a, b) ((a) == (b))
+
+#define MAP_DEFINE(name, K, V, hash_fn, eq_fn)                                 \
+typedef struct name##_bucket_t {                                               \
+	_Alignas(MAP_DEFINE_ALIGNMENT) uint16_t tag[MAP_DEFINE_BUCKET_SIZE];       \
+	K key[MAP_DEFINE_BUCKET_SIZE];                                             \
+	V value[MAP_DEFINE_BUCKET_SIZE];                                           \
+} name##_bucket_t;                                                             \
+                                                                               \
+/* aligned_alloc takes sizes that are multiples of the alignment */            \
+_Static_assert(sizeof(name##_bucket_t) % MAP_DEFINE_ALIGNMENT == 0,            \
+               #name "_bucket_t is not padded to MAP_DEFINE_ALIGNMENT");       \
+                                                                               \
+typedef struct name##_t {                                                      \
+	size_t entry_count;                                                        \
+	size_t table_size;                                                         \
+	void *seed_0, *seed_1;                                                     \
+	name##_bucket_t *table_0, *table_1;                                        \
+} name##_t;                                                                    \
+                                                                               \
+static inline size_t name##_index(const name##_t *map, size_t h) {             \
+	return h & ((1UL << map->table_size) - 1);                                 \
+}                                                                              \
+                                                                               \
+static inline name##_bucket_t *name##_table_alloc(size_t table_size) {         \
+	size_t size = sizeof(name##_bucket_t) << table_size;                       \
+	name##_bucket_t *table = aligned_alloc(MAP_DEFINE_ALIGNMENT, size);        \
+	if (table) {                                                               \
+		memset(table, 0, size);                                                \
+	}                                                                          \
+	return table;                                                              \
+}                                                                              \
+                                                                               \
+/* Puts key, value and tag into slot j of bucket and hands back the key and    \
+ * value that were there. Returns their tag. */                                \
+static inline uint16_t name##_swap(name##_bucket_t *bucket, size_t j,          \
+                                   uint16_t tag, K *key, V *value) {           \
+	K evicted_key = bucket->key[j];                                            \
+	V evicted_value = bucket->value[j];                                        \
+	uint16_t evicted_tag = bucket->tag[j];                                     \
+	bucket->tag[j] = tag;                                                      \
+	bucket->key[j] = *key;                                                     \
+	bucket->value[j] = *value;                                                 \
+	*key = evicted_key;                                                        \
+	*value = evicted_value;                                                    \
+	return evicted_tag;                                                        \
+}                                                                              \
+                                                                               \
+/* Places key and value by cuckoo displacement. On failure the evictions are   \
+ * undone in reverse, so that the tables are as they were and no entry is      \
+ * lost, and key and value still hold the pair to place. */                    \
+static inline bool name##_place(name##_t *map, K *key, V *value) {             \
+	name##_bucket_t *path[2 * MAP_DEFINE_MAX_KICKS];                           \
+	uint8_t path_slot[2 * MAP_DEFINE_MAX_KICKS];                               \
+	uint16_t path_tag[2 * MAP_DEFINE_MAX_KICKS];                               \
+	size_t n = 0;                                                              \
+                                                                               \
+	for (size_t i = 0; i < MAP_DEFINE_MAX_KICKS; i++) {                        \
+		name##_bucket_t *tables[2] = {map->table_0, map->table_1};             \
+		void *seeds[2] = {map->seed_0, map->seed_1};                           \
+                                                                               \
+		for (size_t t = 0; t < 2; t++) {                                       \
+			size_t h = hash_fn(key, sizeof(K), seeds[t]);                      \
+			name##_bucket_t *bucket = &tables[t][name##_index(map, h)];        \
+			uint16_t tag = MAP_DEFINE_TAG(h);                                  \
+                                                                               \
+			for (size_t j = 0; j < MAP_DEFINE_BUCKET_SIZE; j++) {              \
+				if (!bucket->tag[j]) {                                         \
+					name##_swap(bucket, j, tag, key, value);                   \
+					return true;                                               \
+				}                                                              \
+			}                                                                  \
+                                                                               \
+			size_t j = (h >> 32 ^ i) % MAP_DEFINE_BUCKET_SIZE;                 \
+			path[n] = bucket;                                                  \
+			path_slot[n] = (uint8_t)j;                                         \
+			path_tag[n++] = name##_swap(bucket, j, tag, key, value);           \
+		}                                                                      \
+	}                                                                          \
+                                                                               \
+	while (n-- > 0) {                                                          \
+		name##_swap(path[n], path_slot[n], path_tag[n], key, value);           \
+	}                                                                          \
+	return false;                                                              \
+}                                                                              \
+                                                                               \
+/* Moves every entry, plus the pair at key and value when key is not NULL,     \
+ * into fresh tables of 2^table_size buckets. New seeds are drawn until the    \
+ * placement succeeds, growing the tables after repeated failures. The new     \
+ * seeds go to buffers of their own, so that a failed allocation can leave     \
+ * the map as it was, seeds included. */                                       \
+static inline bool name##_rebuild(name##_t *map, size_t table_size, K *key,    \
+                                  V *value) {                                  \
+	name##_bucket_t *old_table_0 = map->table_0, *old_table_1 = map->table_1;  \
+	void *old_seed_0 = map->seed_0, *old_seed_1 = map->seed_1;                 \
+	size_t old_size = map->table_size;                                         \
+	void *seed_0 = aligned_alloc(MAP_DEFINE_ALIGNMENT, SEED_SIZE);             \
+	void *seed_1 = aligned_alloc(MAP_DEFINE_ALIGNMENT, SEED_SIZE);             \
+                                                                               \
+	for (size_t attempt = 0;; attempt++) {                                     \
+		if (attempt && attempt % MAP_DEFINE_MAX_REBUILDS == 0) {               \
+			table_size++;                                                      \
+		}                                                                      \
+                                                                               \
+		name##_bucket_t *table_0 = NULL, *table_1 = NULL;                      \
+		if (seed_0 && seed_1) {                                                \
+			table_0 = name##_table_alloc(table_size);                          \
+			table_1 = name##_table_alloc(table_size);                          \
+		}                                                                      \
+		if (!table_0 || !table_1) {                                            \
+			free(table_0);                                                     \
+			free(table_1);                                                     \
+			free(seed_0);                                                      \
+			free(seed_1);                                                      \
+			map->table_0 = old_table_0;                                        \
+			map->table_1 = old_table_1;                                        \
+			map->seed_0 = old_seed_0;                                          \
+			map->seed_1 = old_seed_1;                                          \
+			map->table_size = old_size;                                        \
+			return false;                                                      \
+		}                                                                      \
+                                                                               \
+		arc4random_buf(seed_0, SEED_SIZE);                                     \
+		arc4random_buf(seed_1, SEED_SIZE);                                     \
+		map->seed_0 = seed_0;                                                  \
+		map->seed_1 = seed_1;                                                  \
+		map->table_0 = table_0;                                                \
+		map->table_1 = table_1;                                                \
+		map->table_size = table_size;                                          \
+                                                                               \
+		bool placed = true;                                                    \
+		if (key) {                                                             \
+			K k = *key;                                                        \
+			V v = *value;                                                      \
+			placed = name##_place(map, &k, &v);                                \
+		}                                                                      \
+		for (size_t i = 0; placed && i < (1UL << old_size); i++) {             \
+			name##_bucket_t *buckets[2] = {&old_table_0[i], &old_table_1[i]};  \
+			for (size_t j = 0; placed && j < MAP_DEFINE_BUCKET_SIZE; j++) {    \
+				for (size_t t = 0; placed && t < 2; t++) {                     \
+					if (buckets[t]->tag[j]) {                                  \
+						K k = buckets[t]->key[j];                              \
+						V v = buckets[t]->value[j];                            \
+						placed = name##_place(map, &k, &v);                    \
+					}                                                          \
+				}                                                              \
+			}                                                                  \
+		}                                                                      \
+                                                                               \
+		if (placed) {                                                          \
+			free(old_table_0);                                                 \
+			free(old_table_1);                                                 \
+			free(old_seed_0);                                                  \
+			free(old_seed_1);                                                  \
+			return true;                                                       \
+		}                                                                      \
+                                                                               \
+		free(table_0);                                                         \
+		free(table_1);                                                         \
+	}                                                                          \
+}                                                                              \
+                                                                               \
+static inline name##_t *name##_alloc(void) {                                   \
+	name##_t *map = malloc(sizeof(name##_t));                                  \
+	void *seed_0 = aligned_alloc(MAP_DEFINE_ALIGNMENT, SEED_SIZE);             \
+	void *seed_1 = aligned_alloc(MAP_DEFINE_ALIGNMENT, SEED_SIZE);             \
+	name##_bucket_t *table_0 = name##_table_alloc(MAP_DEFINE_INIT_SIZE);       \
+	name##_bucket_t *table_1 = name##_table_alloc(MAP_DEFINE_INIT_SIZE);       \
+                                                                               \
+	if (map && seed_0 && seed_1 && table_0 && table_1) {                       \
+		*map = (name##_t){.entry_count = 0,                                    \
+		                  .table_size = MAP_DEFINE_INIT_SIZE,                  \
+		                  .seed_0 = seed_0,                                    \
+		                  .seed_1 = seed_1,                                    \
+		                  .table_0 = table_0,                                  \
+		                  .table_1 = table_1};                                 \
+		arc4random_buf(seed_0, SEED_SIZE);                                     \
+		arc4random_buf(seed_1, SEED_SIZE);                                     \
+		return map;                                                            \
+	} else {                                                                   \
+		free(map);                                                             \
+		free(seed_0);                                                          \
+		free(seed_1);                                                          \
+		free(table_0);                                                         \
+		free(table_1);                                                         \
+		return NULL;                                                           \
+	}                                                                          \
+}                                                                              \
+                                                                               \
+static inline void name##_free(name##_t *map) {                                \
+	if (map) {                                                                 \
+		free(map->table_0);                                                    \
+		free(map->table_1);                                                    \
+		free(map->seed_0);                                                     \
+		free(map->seed_1);                                                     \
+		free(map);                                                             \
+	}                                                                          \
+}                                                                              \
+                                                                               \
+static inline size_t name##_count(const name##_t *map) {                       \
+	return map->entry_count;                                                   \
+}                                                                              \
+                                                                               \
+static inline V *name##_lookup(name##_t *map, K key) {                         \
+	size_t h_0 = hash_fn(&key, sizeof(K), map->seed_0);                        \
+	size_t h_1 = hash_fn(&key, sizeof(K), map->seed_1);                        \
+	name##_bucket_t *bucket_0 = &map->table_0[name##_index(map, h_0)];         \
+	name##_bucket_t *bucket_1 = &map->table_1[name##_index(map, h_1)];         \
+	uint16_t tag_0 = MAP_DEFINE_TAG(h_0), tag_1 = MAP_DEFINE_TAG(h_1);         \
+                                                                               \
+	for (size_t j = 0; j < MAP_DEFINE_BUCKET_SIZE; j++) {                      \
+		if (bucket_0->tag[j] == tag_0 && eq_fn(bucket_0->key[j], key)) {       \
+			return &bucket_0->value[j];                                        \
+		}                                                                      \
+	}                                                                          \
+	for (size_t j = 0; j < MAP_DEFINE_BUCKET_SIZE; j++) {                      \
+		if (bucket_1->tag[j] == tag_1 && eq_fn(bucket_1->key[j], key)) {       \
+			return &bucket_1->value[j];                                        \
+		}                                                                      \
+	}                                                                          \
+                                                                               \
+	return NULL;                                                               \
+}                                                                              \
+                                                                               \
+static inline bool name##_search(name##_t *map, K key) {                       \
+	return name##_lookup(map, key) != NULL;                                    \
+}                                                                              \
+                                                                               \
+static inline bool name##_insert(name##_t *map, K key, V value) {              \
+	if (name##_lookup(map, key)) {                                             \
+		return true;                                                           \
+	}                                                                          \
+                                                                               \
+	size_t capacity = 2 * MAP_DEFINE_BUCKET_SIZE << map->table_size;           \
+	if (8 * (map->entry_count + 1) > 7 * capacity) {                           \
+		if (!name##_rebuild(map, map->table_size + 1, NULL, NULL)) {           \
+			return false;                                                      \
+		}                                                                      \
+	}                                                                          \
+                                                                               \
+	K k = key;                                                                 \
+	V v = value;                                                               \
+	if (!name##_place(map, &k, &v) &&                                          \
+	    !name##_rebuild(map, map->table_size, &k, &v)) {                       \
+		return false;                                                          \
+	}                                                                          \
+                                                                               \
+	map->entry_count++;                                                        \
+	return true;                                                               \
+}                                                                              \
+                                                                               \
+static inline bool name##_delete(name##_t *map, K key) {                       \
+	size_t h_0 = hash_fn(&key, sizeof(K), map->seed_0);                        \
+	size_t h_1 = hash_fn(&key, sizeof(K), map->seed_1);                        \
+	name##_bucket_t *bucket_0 = &map->table_0[name##_index(map, h_0)];         \
+	name##_bucket_t *bucket_1 = &map->table_1[name##_index(map, h_1)];         \
+	uint16_t tag_0 = MAP_DEFINE_TAG(h_0), tag_1 = MAP_DEFINE_TAG(h_1);         \
+                                                                               \
+	for (size_t j = 0; j < MAP_DEFINE_BUCKET_SIZE; j++) {                      \
+		if (bucket_0->tag[j] == tag_0 && eq_fn(bucket_0->key[j], key)) {       \
+			bucket_0->tag[j] = 0;                                              \
+			map->entry_count--;                                                \
+			return true;                                                       \
+		}                                                                      \
+	}                                                                          \
+	for (size_t j = 0; j < MAP_DEFINE_BUCKET_SIZE; j++) {                      \
+		if (bucket_1->tag[j] == tag_1 && eq_fn(bucket_1->key[j], key)) {       \
+			bucket_1->tag[j] = 0;                                              \
+			map->entry_count--;                                                \
+			return true;                                                       \
+		}                                                                      \
+	}                                                                          \
+                                                                               \
+	return false;                                                              \
+}
+
+#endif
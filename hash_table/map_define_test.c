@@ -0,0 +1,151 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "map_define.h"
+
+/* Behaviour tests for MAP_DEFINE. Allocations of the maps go through
+ * test_aligned_alloc, which fails once test_allocs_left runs out, so that the
+ * failure paths of a rebuild can be driven from here. */
+
+#define UNIVERSE 4096UL
+#define COLLIDING (1UL << 40) /* keys from here on share one bucket pair */
+
+static size_t test_allocs_left = SIZE_MAX;
+
+static void *test_aligned_alloc(size_t alignment, size_t size) {
+	if (test_allocs_left == 0) {
+		return NULL;
+	}
+	test_allocs_left -= test_allocs_left != SIZE_MAX;
+	return aligned_alloc(alignment, size);
+}
+
+#define aligned_alloc test_aligned_alloc
+
+/* Seeded, but every colliding key hashes to the seed itself */
+static inline size_t test_hash(const void *key, size_t key_size,
+                               const void *seed) {
+	size_t k = key_size == sizeof(uint32_t) ? *(const uint32_t *)key
+	                                        : *(const size_t *)key;
+	size_t h = *(const size_t *)seed;
+
+	if (k >= COLLIDING) {
+		return h;
+	}
+	k ^= h;
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdUL;
+	return k ^ (k >> 33);
+}
+
+MAP_DEFINE(test_map, size_t, size_t, test_hash, MAP_DEFINE_EQ)
+MAP_DEFINE(test_small, uint32_t, uint16_t, test_hash, MAP_DEFINE_EQ)
+
+static uint64_t test_state = 0x9e3779b97f4a7c15UL;
+
+static size_t test_rand(size_t n) {
+	test_state ^= test_state << 13;
+	test_state ^= test_state >> 7;
+	test_state ^= test_state << 17;
+	return test_state % n;
+}
+
+static void test_reference(void) {
+	test_map_t *map = test_map_alloc();
+	bool *present = calloc(UNIVERSE, sizeof(bool));
+	size_t *value = calloc(UNIVERSE, sizeof(size_t)), count = 0;
+	assert(map && present && value);
+
+	for (size_t i = 0; i < 64 * UNIVERSE; i++) {
+		size_t k = test_rand(UNIVERSE), v = test_rand(SIZE_MAX);
+
+		if (test_rand(2)) {
+			assert(test_map_insert(map, k, v));
+			if (!present[k]) {
+				present[k] = true;
+				value[k] = v;
+				count++;
+			}
+		} else {
+			assert(test_map_delete(map, k) == present[k]);
+			count -= present[k];
+			present[k] = false;
+		}
+
+		size_t *found = test_map_lookup(map, k);
+		assert((found != NULL) == present[k]);
+		assert(!found || *found == value[k]);
+		assert(test_map_count(map) == count);
+	}
+
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		size_t *found = test_map_lookup(map, k);
+		assert((found != NULL) == present[k]);
+		assert(!found || *found == value[k]);
+	}
+
+	test_map_free(map);
+	free(present);
+	free(value);
+}
+
+static void test_alignment(void) {
+	test_small_t *map = test_small_alloc();
+	assert(map);
+
+	assert(sizeof(test_small_bucket_t) == MAP_DEFINE_ALIGNMENT);
+	assert(sizeof(test_map_bucket_t) % MAP_DEFINE_ALIGNMENT == 0);
+	for (uint32_t k = 0; k < 10000; k++) {
+		assert(test_small_insert(map, k, (uint16_t)k));
+		assert((uintptr_t)map->table_0 % MAP_DEFINE_ALIGNMENT == 0);
+		assert((uintptr_t)map->table_1 % MAP_DEFINE_ALIGNMENT == 0);
+	}
+	for (uint32_t k = 0; k < 10000; k++) {
+		assert(*test_small_lookup(map, k) == (uint16_t)k);
+	}
+
+	test_small_free(map);
+}
+
+/* 2 * MAP_DEFINE_BUCKET_SIZE colliding keys fill their bucket pair, so the
+ * next one sends the insertion into rebuilds that can never succeed. Each
+ * number of allocations lets them get a little further before one fails,
+ * and the map must come out of it unchanged. */
+static void test_rebuild_failure(void) {
+	for (size_t allowed = 0; allowed <= 8; allowed++) {
+		test_map_t *map = test_map_alloc();
+		assert(map);
+
+		for (size_t k = 0; k < 100; k++) {
+			assert(test_map_insert(map, k, k + 1));
+		}
+		for (size_t i = 0; i < 2 * MAP_DEFINE_BUCKET_SIZE; i++) {
+			assert(test_map_insert(map, COLLIDING + i, i));
+		}
+
+		test_allocs_left = allowed;
+		assert(!test_map_insert(map, COLLIDING + 2 * MAP_DEFINE_BUCKET_SIZE,
+		                        0));
+		test_allocs_left = SIZE_MAX;
+
+		assert(test_map_count(map) == 100 + 2 * MAP_DEFINE_BUCKET_SIZE);
+		for (size_t k = 0; k < 100; k++) {
+			assert(*test_map_lookup(map, k) == k + 1);
+		}
+		for (size_t i = 0; i < 2 * MAP_DEFINE_BUCKET_SIZE; i++) {
+			assert(*test_map_lookup(map, COLLIDING + i) == i);
+		}
+		assert(!test_map_search(map, COLLIDING + 2 * MAP_DEFINE_BUCKET_SIZE));
+
+		test_map_free(map);
+	}
+}
+
+int main(void) {
+	test_reference();
+	test_alignment();
+	test_rebuild_failure();
+
+	puts("map_define_test: ok");
+	return 0;
+}
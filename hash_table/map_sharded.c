@@ -0,0 +1,336 @@
+#include "map_sharded.h"
+
+#include <pthread.h>
+
+#define SHARD_ALIGNMENT 64UL
+
+/* Every shard is an independent map behind its own lock, padded to a cache
+ * line so that neighbouring locks do not share one. Each shard grows and
+ * rehashes on its own. */
+typedef struct shard_t {
+	_Alignas(SHARD_ALIGNMENT) pthread_mutex_t lock;
+	map_t *map;
+} shard_t;
+
+struct map_sharded_t {
+	size_t shard_bits;
+	size_t key_size;
+	size_t value_size;
+
+	size_t (*hash)(const void *, size_t, const void *);
+	void *seed;
+
+	shard_t *shards;
+};
+
+static size_t map_sharded_count_shards(map_sharded_t *sharded) {
+	return 1UL << sharded->shard_bits;
+}
+
+/* Shards are picked from the high bits of a hash under a seed of their own,
+ * independent of the seeds the shard maps index their tables with. */
+static size_t map_sharded_shard(map_sharded_t *sharded, const void *key) {
+	if (!sharded->shard_bits) {
+		return 0;
+	}
+	size_t h = sharded->hash(key, sharded->key_size, sharded->seed);
+	return h >> (8 * sizeof(size_t) - sharded->shard_bits);
+}
+
+void map_sharded_free(map_sharded_t *sharded) {
+	if (sharded) {
+		for (size_t i = 0; i < map_sharded_count_shards(sharded); i++) {
+			if (sharded->shards[i].map) {
+				pthread_mutex_destroy(&sharded->shards[i].lock);
+				map_free(sharded->shards[i].map);
+			}
+		}
+		free(sharded->shards);
+		free(sharded->seed);
+		free(sharded);
+	}
+}
+
+/* shard_count is rounded up to a power of two */
+map_sharded_t *map_sharded_alloc(size_t shard_count, size_t key_size,
+                                 size_t value_size, size_t alignment) {
+	size_t shard_bits = 0;
+	while ((1UL << shard_bits) < shard_count) {
+		shard_bits++;
+	}
+
+	map_sharded_t *sharded = malloc(sizeof(map_sharded_t));
+	void *seed = aligned_alloc(SHARD_ALIGNMENT, SEED_SIZE);
+	shard_t *shards =
+	    aligned_alloc(SHARD_ALIGNMENT, sizeof(shard_t) << shard_bits);
+
+	if (sharded != NULL && seed != NULL && shards != NULL) {
+		*sharded = (map_sharded_t){.shard_bits = shard_bits,
+		                           .key_size = key_size,
+		                           .value_size = value_size,
+		                           .hash = zhash,
+		                           .seed = seed,
+		                           .shards = shards};
+		arc4random_buf(seed, SEED_SIZE);
+
+		for (size_t i = 0; i < (1UL << shard_bits); i++) {
+			shards[i].map = NULL;
+		}
+		/* map_sharded_free destroys the locks of the shards with a map */
+		for (size_t i = 0; i < (1UL << shard_bits); i++) {
+			if (pthread_mutex_init(&shards[i].lock, NULL) != 0) {
+				map_sharded_free(sharded);
+				return NULL;
+			}
+			if (!(shards[i].map = map_alloc(key_size, value_size, alignment))) {
+				pthread_mutex_destroy(&shards[i].lock);
+				map_sharded_free(sharded);
+				return NULL;
+			}
+		}
+		return sharded;
+	} else {
+		free(sharded);
+		free(seed);
+		free(shards);
+		return NULL;
+	}
+}
+
+/* Not thread safe: call before the map is shared */
+void map_sharded_set_hash(map_sharded_t *sharded,
+                          size_t (*hash)(const void *, size_t, const void *)) {
+	sharded->hash = hash;
+	for (size_t i = 0; i < map_sharded_count_shards(sharded); i++) {
+		map_set_hash(sharded->shards[i].map, hash);
+	}
+}
+
+bool map_sharded_insert(map_sharded_t *sharded, const void *key,
+                        const void *value) {
+	shard_t *shard = &sharded->shards[map_sharded_shard(sharded, key)];
+
+	pthread_mutex_lock(&shard->lock);
+	bool inserted = map_insert(shard->map, key, value);
+	pthread_mutex_unlock(&shard->lock);
+
+	return inserted;
+}
+
+bool map_sharded_delete(map_sharded_t *sharded, const void *key) {
+	shard_t *shard = &sharded->shards[map_sharded_shard(sharded, key)];
+
+	pthread_mutex_lock(&shard->lock);
+	bool deleted = map_delete(shard->map, key);
+	pthread_mutex_unlock(&shard->lock);
+
+	return deleted;
+}
+
+/* The value is copied out under the shard lock, as the slot itself may move
+ * or be freed once the lock is dropped. */
+bool map_sharded_lookup(map_sharded_t *sharded, const void *key,
+                        void *lookup_dst) {
+	shard_t *shard = &sharded->shards[map_sharded_shard(sharded, key)];
+
+	pthread_mutex_lock(&shard->lock);
+	bool found = map_lookup(shard->map, key, lookup_dst) != NULL;
+	pthread_mutex_unlock(&shard->lock);
+
+	return found;
+}
+
+size_t map_sharded_count(map_sharded_t *sharded) {
+	size_t count = 0;
+
+	for (size_t i = 0; i < map_sharded_count_shards(sharded); i++) {
+		pthread_mutex_lock(&sharded->shards[i].lock);
+		count += map_count(sharded->shards[i].map);
+		pthread_mutex_unlock(&sharded->shards[i].lock);
+	}
+
+	return count;
+}
+
+/* Batches are grouped by shard with a counting sort, so that each shard lock
+ * is taken once per batch and the keys of a shard go through the shard map's
+ * own prefetching batch call. order lists the key indices shard by shard and
+ * shard i owns order[offset[i], offset[i + 1]). The values and found
+ * buffers are only allocated for the operations that use them. */
+typedef struct shard_batch_t {
+	size_t *order;
+	size_t *offset;
+	char *keys;
+	char *values;
+	bool *found;
+} shard_batch_t;
+
+static void shard_batch_free(shard_batch_t *batch) {
+	free(batch->order);
+	free(batch->offset);
+	free(batch->keys);
+	free(batch->values);
+	free(batch->found);
+}
+
+static bool shard_batch_alloc(map_sharded_t *sharded, shard_batch_t *batch,
+                              const void *keys, size_t n, bool with_values,
+                              bool with_found) {
+	size_t shard_count = map_sharded_count_shards(sharded);
+	size_t *shard = malloc(sizeof(size_t) * n);
+	size_t *cursor = malloc(sizeof(size_t) * shard_count);
+
+	*batch = (shard_batch_t){
+	    .order = malloc(sizeof(size_t) * n),
+	    .offset = calloc(shard_count + 1, sizeof(size_t)),
+	    .keys = malloc(sharded->key_size * n),
+	    .values = with_values ? malloc(sharded->value_size * n) : NULL,
+	    .found = with_found ? malloc(sizeof(bool) * n) : NULL};
+
+	if (shard && cursor && batch->order && batch->offset && batch->keys &&
+	    (batch->values || !with_values) && (batch->found || !with_found)) {
+		for (size_t i = 0; i < n; i++) {
+			shard[i] = map_sharded_shard(
+			    sharded, (const char *)keys + i * sharded->key_size);
+			batch->offset[shard[i] + 1]++;
+		}
+		for (size_t s = 0; s < shard_count; s++) {
+			batch->offset[s + 1] += batch->offset[s];
+		}
+
+		memcpy(cursor, batch->offset, sizeof(size_t) * shard_count);
+		for (size_t i = 0; i < n; i++) {
+			size_t j = cursor[shard[i]]++;
+			batch->order[j] = i;
+			memcpy(batch->keys + j * sharded->key_size,
+			       (const char *)keys + i * sharded->key_size,
+			       sharded->key_size);
+		}
+
+		free(shard);
+		free(cursor);
+		return true;
+	} else {
+		free(shard);
+		free(cursor);
+		shard_batch_free(batch);
+		return false;
+	}
+}
+
+/* The batch operations store the number of keys found, pairs inserted or
+ * keys deleted in *out_count, and return false if the batch could not be set
+ * up, in which case nothing was done and the count is 0. */
+bool map_sharded_lookup_batch(map_sharded_t *sharded, const void *keys,
+                              size_t n, void *out_values, bool *out_found,
+                              size_t *out_count) {
+	shard_batch_t batch;
+	size_t found = 0;
+
+	*out_count = 0;
+	if (!n) {
+		return true;
+	} else if (!shard_batch_alloc(sharded, &batch, keys, n,
+	                              out_values != NULL, true)) {
+		return false;
+	}
+
+	for (size_t s = 0; s < map_sharded_count_shards(sharded); s++) {
+		size_t first = batch.offset[s], count = batch.offset[s + 1] - first;
+		shard_t *shard = &sharded->shards[s];
+
+		if (count) {
+			pthread_mutex_lock(&shard->lock);
+			found += map_lookup_batch(
+			    shard->map, batch.keys + first * sharded->key_size, count,
+			    out_values ? batch.values + first * sharded->value_size
+			               : NULL,
+			    batch.found + first);
+			pthread_mutex_unlock(&shard->lock);
+		}
+	}
+
+	for (size_t j = 0; j < n; j++) {
+		size_t i = batch.order[j];
+		if (out_values && batch.found[j]) {
+			memcpy((char *)out_values + i * sharded->value_size,
+			       batch.values + j * sharded->value_size,
+			       sharded->value_size);
+		}
+		if (out_found) {
+			out_found[i] = batch.found[j];
+		}
+	}
+
+	shard_batch_free(&batch);
+	*out_count = found;
+	return true;
+}
+
+/* Also returns false if an insertion failed. Unlike map_insert_batch the
+ * count is not a prefix of the input, as shards fail independently. */
+bool map_sharded_insert_batch(map_sharded_t *sharded, const void *keys,
+                              const void *values, size_t n,
+                              size_t *out_count) {
+	shard_batch_t batch;
+	size_t inserted = 0;
+
+	*out_count = 0;
+	if (!n) {
+		return true;
+	} else if (!shard_batch_alloc(sharded, &batch, keys, n, true, false)) {
+		return false;
+	}
+
+	for (size_t j = 0; j < n; j++) {
+		memcpy(batch.values + j * sharded->value_size,
+		       (const char *)values + batch.order[j] * sharded->value_size,
+		       sharded->value_size);
+	}
+
+	for (size_t s = 0; s < map_sharded_count_shards(sharded); s++) {
+		size_t first = batch.offset[s], count = batch.offset[s + 1] - first;
+		shard_t *shard = &sharded->shards[s];
+
+		if (count) {
+			pthread_mutex_lock(&shard->lock);
+			inserted += map_insert_batch(
+			    shard->map, batch.keys + first * sharded->key_size,
+			    batch.values + first * sharded->value_size, count);
+			pthread_mutex_unlock(&shard->lock);
+		}
+	}
+
+	shard_batch_free(&batch);
+	*out_count = inserted;
+	return inserted == n;
+}
+
+bool map_sharded_delete_batch(map_sharded_t *sharded, const void *keys,
+                              size_t n, size_t *out_count) {
+	shard_batch_t batch;
+	size_t deleted = 0;
+
+	*out_count = 0;
+	if (!n) {
+		return true;
+	} else if (!shard_batch_alloc(sharded, &batch, keys, n, false, false)) {
+		return false;
+	}
+
+	for (size_t s = 0; s < map_sharded_count_shards(sharded); s++) {
+		size_t first = batch.offset[s], count = batch.offset[s + 1] - first;
+		shard_t *shard = &sharded->shards[s];
+
+		if (count) {
+			pthread_mutex_lock(&shard->lock);
+			deleted += map_delete_batch(
+			    shard->map, batch.keys + first * sharded->key_size, count);
+			pthread_mutex_unlock(&shard->lock);
+		}
+	}
+
+	shard_batch_free(&batch);
+	*out_count = deleted;
+	return true;
+}
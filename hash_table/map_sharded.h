@@ -0,0 +1,34 @@
+#ifndef MAP_SHARDED_H
+#define MAP_SHARDED_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "hash_table.h"
+
+typedef struct map_sharded_t map_sharded_t;
+
+map_sharded_t *map_sharded_alloc(size_t shard_count, size_t key_size,
+                                 size_t value_size, size_t alignment);
+void map_sharded_free(map_sharded_t *sharded);
+
+void map_sharded_set_hash(map_sharded_t *sharded,
+                          size_t (*hash)(const void *, size_t, const void *));
+
+bool map_sharded_insert(map_sharded_t *sharded, const void *key,
+                        const void *value);
+bool map_sharded_delete(map_sharded_t *sharded, const void *key);
+bool map_sharded_lookup(map_sharded_t *sharded, const void *key,
+                        void *lookup_dst);
+
+bool map_sharded_lookup_batch(map_sharded_t *sharded, const void *keys,
+                              size_t n, void *out_values, bool *out_found,
+                              size_t *out_count);
+bool map_sharded_insert_batch(map_sharded_t *sharded, const void *keys,
+                              const void *values, size_t n, size_t *out_count);
+bool map_sharded_delete_batch(map_sharded_t *sharded, const void *keys,
+                              size_t n, size_t *out_count);
+
+size_t map_sharded_count(map_sharded_t *sharded);
+
+#endif
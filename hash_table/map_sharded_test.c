@@ -0,0 +1,189 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#include "map_sharded.h"
+
+/* Behaviour tests for map_sharded_t: one thread against a reference array,
+ * one key at a time and in batches, then threads writing and reading
+ * disjoint key ranges at once. */
+
+#define UNIVERSE 4096UL
+#define THREADS 8UL
+#define PER_THREAD 51200UL /* half of it in batches of 64 */
+
+static uint64_t test_state = 0x9e3779b97f4a7c15UL;
+
+static size_t test_rand(size_t n) {
+	test_state ^= test_state << 13;
+	test_state ^= test_state >> 7;
+	test_state ^= test_state << 17;
+	return test_state % n;
+}
+
+static void test_agree(map_sharded_t *sharded, const bool *present,
+                       const size_t *value, size_t count) {
+	static size_t keys[UNIVERSE], values[UNIVERSE];
+	static bool found[UNIVERSE];
+
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		size_t v = 0;
+		keys[k] = k;
+		assert(map_sharded_lookup(sharded, &k, &v) == present[k]);
+		assert(!present[k] || v == value[k]);
+	}
+	assert(map_sharded_count(sharded) == count);
+
+	size_t found_count;
+	assert(map_sharded_lookup_batch(sharded, keys, UNIVERSE, values, found,
+	                                &found_count));
+	assert(found_count == count);
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		assert(found[k] == present[k]);
+		assert(!present[k] || values[k] == value[k]);
+	}
+
+	assert(map_sharded_lookup_batch(sharded, keys, UNIVERSE, NULL, NULL,
+	                                &found_count));
+	assert(found_count == count);
+	assert(map_sharded_lookup_batch(sharded, keys, 0, NULL, NULL,
+	                                &found_count));
+	assert(found_count == 0);
+}
+
+/* Random single and batched operations. A batch of keys gets its values
+ * from the same block, so that a key repeated in it can be checked. */
+static void test_reference(size_t shard_count) {
+	map_sharded_t *sharded = map_sharded_alloc(
+	    shard_count, sizeof(size_t), sizeof(size_t), _Alignof(size_t));
+	bool *present = calloc(UNIVERSE, sizeof(bool));
+	size_t *value = calloc(UNIVERSE, sizeof(size_t)), count = 0;
+	assert(sharded && present && value);
+
+	for (size_t i = 1; i <= 16 * UNIVERSE; i++) {
+		size_t keys[8], values[8], n = 1 + test_rand(8), done;
+
+		for (size_t j = 0; j < n; j++) {
+			keys[j] = test_rand(UNIVERSE);
+			values[j] = test_rand(SIZE_MAX);
+		}
+
+		switch (test_rand(4)) {
+		case 0:
+			assert(map_sharded_insert(sharded, keys, values));
+			n = 1;
+			break;
+		case 1:
+			assert(map_sharded_insert_batch(sharded, keys, values, n, &done));
+			assert(done == n);
+			break;
+		case 2:
+			assert(map_sharded_delete(sharded, keys) == present[keys[0]]);
+			count -= present[keys[0]];
+			present[keys[0]] = false;
+			continue;
+		default: {
+			size_t deleted = 0;
+			for (size_t j = 0; j < n; j++) {
+				deleted += present[keys[j]];
+				count -= present[keys[j]];
+				present[keys[j]] = false;
+			}
+			assert(map_sharded_delete_batch(sharded, keys, n, &done));
+			assert(done == deleted);
+			continue;
+		}
+		}
+
+		/* An existing key keeps its value, the first of a batch wins */
+		for (size_t j = 0; j < n; j++) {
+			if (!present[keys[j]]) {
+				present[keys[j]] = true;
+				value[keys[j]] = values[j];
+				count++;
+			}
+		}
+
+		if (i % UNIVERSE == 0) {
+			test_agree(sharded, present, value, count);
+		}
+	}
+	test_agree(sharded, present, value, count);
+
+	map_sharded_free(sharded);
+	free(present);
+	free(value);
+}
+
+typedef struct test_thread_t {
+	map_sharded_t *sharded;
+	size_t id;
+} test_thread_t;
+
+/* Inserts its range, half of it in batches, checks it, and deletes every
+ * other key */
+static void *test_thread(void *arg) {
+	test_thread_t *thread = arg;
+	size_t base = (thread->id + 1) << 32;
+	size_t keys[64], inserted;
+
+	for (size_t i = 0; i < PER_THREAD / 2; i++) {
+		size_t k = base + i;
+		assert(map_sharded_insert(thread->sharded, &k, &k));
+	}
+	for (size_t i = PER_THREAD / 2; i < PER_THREAD; i += 64) {
+		for (size_t j = 0; j < 64; j++) {
+			keys[j] = base + i + j;
+		}
+		assert(map_sharded_insert_batch(thread->sharded, keys, keys, 64,
+		                                &inserted));
+		assert(inserted == 64);
+	}
+
+	for (size_t i = 0; i < PER_THREAD; i++) {
+		size_t k = base + i, v;
+		assert(map_sharded_lookup(thread->sharded, &k, &v) && v == k);
+	}
+	for (size_t i = 0; i < PER_THREAD; i += 2) {
+		size_t k = base + i;
+		assert(map_sharded_delete(thread->sharded, &k));
+	}
+
+	return NULL;
+}
+
+static void test_threads(void) {
+	map_sharded_t *sharded = map_sharded_alloc(
+	    16, sizeof(size_t), sizeof(size_t), _Alignof(size_t));
+	pthread_t threads[THREADS];
+	test_thread_t args[THREADS];
+	assert(sharded);
+
+	for (size_t i = 0; i < THREADS; i++) {
+		args[i] = (test_thread_t){.sharded = sharded, .id = i};
+		assert(!pthread_create(&threads[i], NULL, test_thread, &args[i]));
+	}
+	for (size_t i = 0; i < THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	assert(map_sharded_count(sharded) == THREADS * PER_THREAD / 2);
+	for (size_t id = 0; id < THREADS; id++) {
+		for (size_t i = 0; i < PER_THREAD; i++) {
+			size_t k = ((id + 1) << 32) + i;
+			assert(map_sharded_lookup(sharded, &k, NULL) == (i % 2 == 1));
+		}
+	}
+
+	map_sharded_free(sharded);
+}
+
+int main(void) {
+	test_reference(1);
+	test_reference(5);
+	test_reference(64);
+	test_threads();
+
+	puts("map_sharded_test: ok");
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "hash_table.h"
+
+/* Counters of a map built with MAP_STATS after a known sequence of
+ * operations. Every insertion, lookup and deletion probes the map once, and
+ * each resize doubles it. Which table a key was found in, and how long the
+ * cuckoo searches were, depend on the seeds, so only their totals are
+ * checked. */
+
+#define KEYS 10000UL
+
+static void test_probe_totals(const map_stats_t *stats) {
+	size_t lengths = 0;
+	for (size_t i = 0; i < MAP_STATS_PROBE_LENGTHS; i++) {
+		lengths += stats->probe_length[i];
+	}
+	assert(lengths == stats->probes);
+	assert(stats->probe_length[0] <= stats->misses);
+	assert(stats->hits_0 + stats->hits_1 + stats->hits_stash +
+	           stats->misses ==
+	       stats->probes);
+}
+
+/* Growth from the initial capacity doubles it once per resize */
+static size_t test_doublings(size_t from, size_t to) {
+	size_t doublings = 0;
+	for (; from < to; from *= 2) {
+		doublings++;
+	}
+	return doublings;
+}
+
+static void test_counters(bool incremental) {
+	map_t *map = map_alloc(sizeof(size_t), sizeof(size_t), _Alignof(size_t));
+	map_stats_t stats;
+	assert(map);
+	map_set_incremental(map, incremental);
+
+	size_t capacity = map_capacity(map);
+	assert(map_get_stats(map, &stats));
+	assert(stats.probes == 0 && stats.resizes == 0 && stats.shrinks == 0);
+
+	/* Insertions of new keys miss once each */
+	for (size_t k = 0; k < KEYS; k++) {
+		assert(map_insert(map, &k, &k));
+	}
+	assert(map_get_stats(map, &stats));
+	test_probe_totals(&stats);
+	assert(stats.probes == KEYS && stats.misses == KEYS);
+	assert(stats.resizes == test_doublings(capacity, map_capacity(map)));
+	assert(stats.resizes > 0 && stats.shrinks == 0);
+	if (incremental) {
+		assert(stats.migrated_buckets > 0);
+	} else {
+		assert(stats.migrated_buckets == 0);
+		assert(stats.rehashes >= stats.resizes);
+	}
+	assert(stats.cuckoo_failures <= stats.cuckoo_searches);
+	assert(stats.stash_count <= stats.stash_puts);
+
+	/* Present keys hit, absent ones miss, and nothing else changes */
+	map_reset_stats(map);
+	assert(map_get_stats(map, &stats));
+	assert(stats.probes == 0 && stats.resizes == 0);
+	for (size_t k = 0; k < 2 * KEYS; k++) {
+		assert(map_search(map, &k) == (k < KEYS));
+	}
+	assert(map_get_stats(map, &stats));
+	test_probe_totals(&stats);
+	assert(stats.probes == 2 * KEYS && stats.misses == KEYS);
+	assert(stats.resizes == 0 && stats.cuckoo_searches == 0);
+
+	/* Deleting every key shrinks the map back down */
+	capacity = map_capacity(map);
+	map_reset_stats(map);
+	for (size_t k = 0; k < KEYS; k++) {
+		assert(map_delete(map, &k));
+	}
+	assert(map_get_stats(map, &stats));
+	test_probe_totals(&stats);
+	assert(stats.probes == KEYS && stats.misses == 0);
+	assert(stats.shrinks > 0 && stats.resizes == 0);
+	assert(map_capacity(map) < capacity);
+
+	map_free(map);
+}
+
+int main(void) {
+	test_counters(false);
+	test_counters(true);
+
+	puts("map_stats_test: ok");
+	return 0;
+}
@@ -0,0 +1,93 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "hash_set.h"
+
+/* Compares the batched operations of set_t with one key at a time:
+ * insertion, searches that hit and miss, in nanoseconds per key.
+ *
+ *     set_bench [count] */
+
+static double bench_clock(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+}
+
+/* splitmix64, so that keys are distinct, nonzero and spread over all bits */
+static uint64_t bench_key(uint64_t i) {
+	uint64_t z = i * 0x9e3779b97f4a7c15ULL + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31)) | 1;
+}
+
+static void bench_set(const char *name, bool batch, const size_t *keys,
+                      const size_t *misses, size_t n) {
+	set_t *set = set_alloc();
+	if (!set) {
+		fprintf(stderr, "%s: allocation failed\n", name);
+		return;
+	}
+
+	size_t found = 0;
+
+	double t_0 = bench_clock();
+	if (batch) {
+		set_insert_batch(set, keys, n);
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			set_insert(set, keys[i]);
+		}
+	}
+	double t_1 = bench_clock();
+	if (batch) {
+		found += set_search_batch(set, keys, n, NULL);
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			found += set_search(set, keys[i]);
+		}
+	}
+	double t_2 = bench_clock();
+	if (batch) {
+		found += set_search_batch(set, misses, n, NULL);
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			found += set_search(set, misses[i]);
+		}
+	}
+	double t_3 = bench_clock();
+
+	printf("%-8s %10.1f %10.1f %10.1f   (%zu)\n", name,
+	       1e9 * (t_1 - t_0) / n, 1e9 * (t_2 - t_1) / n,
+	       1e9 * (t_3 - t_2) / n, found);
+
+	set_free(set);
+}
+
+int main(int argc, char **argv) {
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 300000;
+	size_t *keys = malloc(n * sizeof(size_t));
+	size_t *misses = malloc(n * sizeof(size_t));
+
+	if (!n || !keys || !misses) {
+		free(keys);
+		free(misses);
+		return 1;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		keys[i] = bench_key(i);
+		misses[i] = bench_key(n + i);
+	}
+
+	printf("%zu keys, ns/key\n", n);
+	printf("%-8s %10s %10s %10s\n", "set", "insert", "hit", "miss");
+	bench_set("single", false, keys, misses, n);
+	bench_set("batch", true, keys, misses, n);
+
+	free(keys);
+	free(misses);
+	return 0;
+}
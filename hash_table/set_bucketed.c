@@ -0,0 +1,366 @@
+#include "set_bucketed.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#define BUCKET_SIZE 8UL
+#define BUCKET_ALIGNMENT 64UL
+#define STASH_SIZE 8UL
+#define SET_INIT_SIZE 4UL
+#define MAX_KICKS 500UL
+#define REHASH_TRIES 8UL
+#define SET_BATCH_SIZE 32UL
+#define MAX_LOAD 0.9
+
+/* Like the set of hash_set.c, but every key has two cache line buckets of
+ * BUCKET_SIZE slots, one in each table, instead of two single slots. A
+ * lookup still reads two lines and compares each with one SIMD compare,
+ * while the extra slots let the tables fill to MAX_LOAD before they grow.
+ * 0 marks an empty slot, so it is not a valid key. */
+typedef struct bucket_t {
+	_Alignas(BUCKET_ALIGNMENT) size_t key[BUCKET_SIZE];
+} bucket_t;
+
+struct set_bucketed_t {
+	size_t table_size; /* log2 of the buckets in each table */
+	size_t key_count;
+	size_t kick; /* LCG state picking the slots the cuckoo walk evicts */
+	size_t h_0[8][256], h_1[8][256];
+	size_t stash[STASH_SIZE];
+	bucket_t *table_0, *table_1;
+};
+
+static void generate_hash(size_t m, size_t n, size_t T[m][n]) {
+	arc4random_buf(T, sizeof(size_t) * m * n);
+}
+
+static inline size_t hash(size_t key, size_t T[8][256]) {
+	size_t H = 0;
+	for (size_t i = 0; i < sizeof(size_t); i++) {
+		H ^= T[i][(unsigned char)(key >> 8 * i)];
+	}
+
+	return H;
+}
+
+static inline bucket_t *set_bucket_0(set_bucketed_t *set, size_t key) {
+	return &set->table_0[hash(key, set->h_0) &
+	                     ((1UL << set->table_size) - 1)];
+}
+
+static inline bucket_t *set_bucket_1(set_bucketed_t *set, size_t key) {
+	return &set->table_1[hash(key, set->h_1) &
+	                     ((1UL << set->table_size) - 1)];
+}
+
+/* Bit i is set when slot i of bucket holds key */
+static inline unsigned bucket_match(const bucket_t *bucket, size_t key) {
+#if defined(__AVX512F__)
+	return _mm512_cmpeq_epi64_mask(_mm512_load_si512(bucket->key),
+	                               _mm512_set1_epi64((long long)key));
+#elif defined(__AVX2__)
+	__m256i k = _mm256_set1_epi64x((long long)key);
+	__m256i lo = _mm256_cmpeq_epi64(
+	    _mm256_load_si256((const __m256i *)bucket->key), k);
+	__m256i hi = _mm256_cmpeq_epi64(
+	    _mm256_load_si256((const __m256i *)(bucket->key + 4)), k);
+	return (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(lo)) |
+	       (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4;
+#else
+	unsigned match = 0;
+	for (size_t i = 0; i < BUCKET_SIZE; i++) {
+		match |= (unsigned)(bucket->key[i] == key) << i;
+	}
+	return match;
+#endif
+}
+
+static inline size_t set_capacity(size_t table_size) {
+	return 2 * BUCKET_SIZE << table_size;
+}
+
+static size_t set_fit_size(size_t count) {
+	size_t table_size = SET_INIT_SIZE;
+
+	while (count > MAX_LOAD * set_capacity(table_size)) {
+		table_size++;
+	}
+
+	return table_size;
+}
+
+set_bucketed_t *set_bucketed_alloc(void) {
+	set_bucketed_t *set = malloc(sizeof(set_bucketed_t));
+	size_t size = sizeof(bucket_t) << SET_INIT_SIZE;
+	bucket_t *table_0 = aligned_alloc(BUCKET_ALIGNMENT, size);
+	bucket_t *table_1 = aligned_alloc(BUCKET_ALIGNMENT, size);
+
+	if (set != NULL && table_0 != NULL && table_1 != NULL) {
+		*set = (set_bucketed_t){.table_size = SET_INIT_SIZE,
+		                        .key_count = 0,
+		                        .kick = 0,
+		                        .stash = {0},
+		                        .table_0 = table_0,
+		                        .table_1 = table_1};
+
+		memset(table_0, 0, size);
+		memset(table_1, 0, size);
+		generate_hash(8, 256, set->h_0);
+		generate_hash(8, 256, set->h_1);
+		return set;
+	} else {
+		free(set);
+		free(table_0);
+		free(table_1);
+		return NULL;
+	}
+}
+
+void set_bucketed_free(set_bucketed_t *set) {
+	if (set) {
+		free(set->table_0);
+		free(set->table_1);
+		free(set);
+	}
+}
+
+/* Places key in a free slot of one of its buckets, evicting keys to their
+ * other bucket for up to MAX_KICKS steps. Returns 0, or the key left over
+ * when the walk gave up. */
+static size_t set_cuckoo(set_bucketed_t *set, size_t key) {
+	for (size_t i = 0; i < MAX_KICKS; i++) {
+		bucket_t *bucket[2] = {set_bucket_0(set, key), set_bucket_1(set, key)};
+
+		for (size_t t = 0; t < 2; t++) {
+			unsigned free_slots = bucket_match(bucket[t], 0);
+			if (free_slots) {
+				bucket[t]->key[__builtin_ctz(free_slots)] = key;
+				return 0;
+			}
+		}
+
+		set->kick = set->kick * 6364136223846793005UL + 1442695040888963407UL;
+		size_t victim = set->kick >> 60;
+		size_t *slot = &bucket[victim & 1]->key[victim >> 1];
+		size_t evicted = *slot;
+		*slot = key;
+		key = evicted;
+	}
+
+	return key;
+}
+
+/* set_cuckoo, falling back to the stash. Returns false if that is full too,
+ * in which case some key, not necessarily key, has been dropped. */
+static bool set_put(set_bucketed_t *set, size_t key) {
+	key = set_cuckoo(set, key);
+
+	for (size_t i = 0; i < STASH_SIZE && key; i++) {
+		if (!set->stash[i]) {
+			set->stash[i] = key;
+			key = 0;
+		}
+	}
+
+	return key == 0;
+}
+
+/* Moves every key into fresh tables of 2^table_size buckets under new
+ * hashes, growing them further if REHASH_TRIES seedings in a row leave the
+ * stash overflowing. Returns false, leaving the set as it was, if memory
+ * runs out. */
+static bool set_rebuild(set_bucketed_t *set, size_t table_size) {
+	bucket_t *old_0 = set->table_0, *old_1 = set->table_1;
+	size_t old_size = set->table_size, old_stash[STASH_SIZE];
+	size_t (*old_hash)[2][8][256] = malloc(sizeof(*old_hash));
+
+	if (!old_hash) {
+		return false;
+	}
+	memcpy((*old_hash)[0], set->h_0, sizeof(set->h_0));
+	memcpy((*old_hash)[1], set->h_1, sizeof(set->h_1));
+	memcpy(old_stash, set->stash, sizeof(old_stash));
+
+	for (size_t tries = 0;; tries++) {
+		if (tries && tries % REHASH_TRIES == 0) {
+			table_size++;
+		}
+
+		size_t size = sizeof(bucket_t) << table_size;
+		if (tries % REHASH_TRIES == 0) {
+			if (set->table_0 != old_0) {
+				free(set->table_0);
+				free(set->table_1);
+			}
+			set->table_0 = aligned_alloc(BUCKET_ALIGNMENT, size);
+			set->table_1 = aligned_alloc(BUCKET_ALIGNMENT, size);
+			if (!set->table_0 || !set->table_1) {
+				free(set->table_0);
+				free(set->table_1);
+				break;
+			}
+		}
+
+		set->table_size = table_size;
+		memset(set->table_0, 0, size);
+		memset(set->table_1, 0, size);
+		memset(set->stash, 0, sizeof(set->stash));
+		generate_hash(8, 256, set->h_0);
+		generate_hash(8, 256, set->h_1);
+
+		bool placed = true;
+		for (size_t i = 0; i < (1UL << old_size) && placed; i++) {
+			for (size_t j = 0; j < BUCKET_SIZE && placed; j++) {
+				placed = (!old_0[i].key[j] || set_put(set, old_0[i].key[j])) &&
+				         (!old_1[i].key[j] || set_put(set, old_1[i].key[j]));
+			}
+		}
+		for (size_t i = 0; i < STASH_SIZE && placed; i++) {
+			placed = !old_stash[i] || set_put(set, old_stash[i]);
+		}
+
+		if (placed) {
+			free(old_0);
+			free(old_1);
+			free(old_hash);
+			return true;
+		}
+	}
+
+	set->table_0 = old_0;
+	set->table_1 = old_1;
+	set->table_size = old_size;
+	memcpy(set->h_0, (*old_hash)[0], sizeof(set->h_0));
+	memcpy(set->h_1, (*old_hash)[1], sizeof(set->h_1));
+	memcpy(set->stash, old_stash, sizeof(old_stash));
+	free(old_hash);
+	return false;
+}
+
+bool set_bucketed_search(set_bucketed_t *set, size_t key) {
+	if (!key) {
+		return false;
+	}
+
+	if (bucket_match(set_bucket_0(set, key), key) |
+	    bucket_match(set_bucket_1(set, key), key)) {
+		return true;
+	}
+
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		if (key == set->stash[i]) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* The set grows before it would pass MAX_LOAD, and is rebuilt under new
+ * hashes before an insertion could find the stash full. */
+bool set_bucketed_insert(set_bucketed_t *set, size_t key) {
+	if (!key) {
+		return false; // 0 is not a valid key
+	} else if (set_bucketed_search(set, key)) {
+		return true;
+	}
+
+	if (set->key_count + 1 > MAX_LOAD * set_capacity(set->table_size) &&
+	    !set_rebuild(set, set->table_size + 1)) {
+		return false;
+	}
+
+	bool stash_full = true;
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		stash_full &= set->stash[i] != 0;
+	}
+	if (stash_full && !set_rebuild(set, set->table_size)) {
+		return false;
+	}
+
+	/* The stash has a free slot, so nothing can be dropped */
+	set_put(set, key);
+
+	set->key_count++;
+	return true;
+}
+
+bool set_bucketed_delete(set_bucketed_t *set, size_t key) {
+	if (!key) {
+		return false;
+	}
+
+	bucket_t *bucket[2] = {set_bucket_0(set, key), set_bucket_1(set, key)};
+
+	for (size_t t = 0; t < 2; t++) {
+		unsigned match = bucket_match(bucket[t], key);
+		if (match) {
+			bucket[t]->key[__builtin_ctz(match)] = 0;
+			set->key_count--;
+			return true;
+		}
+	}
+
+	for (size_t i = 0; i < STASH_SIZE; i++) {
+		if (set->stash[i] == key) {
+			set->stash[i] = 0;
+			set->key_count--;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Hashes a block of keys and prefetches both of their buckets before the
+ * first one is compared. found may be NULL; returns the number present. */
+size_t set_bucketed_search_batch(set_bucketed_t *set, const size_t *keys,
+                                 size_t n, bool *found) {
+	bucket_t *bucket_0[SET_BATCH_SIZE], *bucket_1[SET_BATCH_SIZE];
+	size_t count = 0;
+
+	for (size_t k = 0; k < n; k += SET_BATCH_SIZE) {
+		size_t m = n - k < SET_BATCH_SIZE ? n - k : SET_BATCH_SIZE;
+
+		for (size_t i = 0; i < m; i++) {
+			bucket_0[i] = set_bucket_0(set, keys[k + i]);
+			bucket_1[i] = set_bucket_1(set, keys[k + i]);
+			__builtin_prefetch(bucket_0[i]);
+			__builtin_prefetch(bucket_1[i]);
+		}
+
+		for (size_t i = 0; i < m; i++) {
+			size_t key = keys[k + i];
+			bool hit = key && (bucket_match(bucket_0[i], key) |
+			                   bucket_match(bucket_1[i], key));
+
+			for (size_t j = 0; j < STASH_SIZE && key && !hit; j++) {
+				hit = key == set->stash[j];
+			}
+
+			if (found) {
+				found[k + i] = hit;
+			}
+			count += hit;
+		}
+	}
+
+	return count;
+}
+
+/* Sizes the tables for count keys at once, so that loading them does not
+ * grow the set step by step */
+bool set_bucketed_reserve(set_bucketed_t *set, size_t count) {
+	size_t table_size = set_fit_size(count);
+	return table_size <= set->table_size || set_rebuild(set, table_size);
+}
+
+size_t set_bucketed_count(set_bucketed_t *set) { return set->key_count; }
+
+size_t set_bucketed_capacity(set_bucketed_t *set) {
+	return set_capacity(set->table_size);
+}
@@ -0,0 +1,23 @@
+#ifndef SET_BUCKETED_H
+#define SET_BUCKETED_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct set_bucketed_t set_bucketed_t;
+
+set_bucketed_t *set_bucketed_alloc(void);
+void set_bucketed_free(set_bucketed_t *set);
+
+bool set_bucketed_insert(set_bucketed_t *set, size_t key);
+bool set_bucketed_delete(set_bucketed_t *set, size_t key);
+bool set_bucketed_search(set_bucketed_t *set, size_t key);
+
+size_t set_bucketed_search_batch(set_bucketed_t *set, const size_t *keys,
+                                 size_t n, bool *found);
+
+bool set_bucketed_reserve(set_bucketed_t *set, size_t count);
+size_t set_bucketed_count(set_bucketed_t *set);
+size_t set_bucketed_capacity(set_bucketed_t *set);
+
+#endif
@@ -0,0 +1,132 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "set_bucketed.h"
+
+/* Behaviour tests for set_bucketed_t: random operations mirrored in a
+ * reference array, and a set reserved ahead of a load that must not grow
+ * and must stay under its maximum load. */
+
+#define UNIVERSE 4096UL
+#define LOAD 200000UL
+
+static uint64_t test_state = 0x9e3779b97f4a7c15UL;
+
+static size_t test_rand(size_t n) {
+	test_state ^= test_state << 13;
+	test_state ^= test_state >> 7;
+	test_state ^= test_state << 17;
+	return test_state % n;
+}
+
+/* splitmix64, so that keys are distinct, nonzero and spread over all bits */
+static size_t test_key(uint64_t i) {
+	uint64_t z = i * 0x9e3779b97f4a7c15ULL + 0x9e3779b97f4a7c15ULL;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return (z ^ (z >> 31)) | 1;
+}
+
+/* Every key of the universe, one at a time and in a batch */
+static void test_agree(set_bucketed_t *set, const bool *present,
+                       size_t count) {
+	static size_t keys[UNIVERSE];
+	static bool found[UNIVERSE];
+
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		keys[k] = k;
+		assert(set_bucketed_search(set, k) == present[k]);
+	}
+	assert(set_bucketed_count(set) == count);
+	assert(count <= 0.9 * set_bucketed_capacity(set));
+
+	assert(set_bucketed_search_batch(set, keys, UNIVERSE, found) == count);
+	assert(set_bucketed_search_batch(set, keys, UNIVERSE, NULL) == count);
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		assert(found[k] == present[k]);
+	}
+}
+
+static void test_reference(void) {
+	set_bucketed_t *set = set_bucketed_alloc();
+	bool *present = calloc(UNIVERSE, sizeof(bool));
+	size_t count = 0;
+	assert(set && present);
+
+	assert(!set_bucketed_insert(set, 0));
+	assert(!set_bucketed_delete(set, 0));
+	assert(!set_bucketed_search(set, 0));
+
+	for (size_t i = 1; i <= 64 * UNIVERSE; i++) {
+		size_t k = 1 + test_rand(UNIVERSE - 1);
+
+		if (test_rand(2)) {
+			assert(set_bucketed_insert(set, k));
+			count += !present[k];
+			present[k] = true;
+		} else {
+			assert(set_bucketed_delete(set, k) == present[k]);
+			count -= present[k];
+			present[k] = false;
+		}
+		assert(set_bucketed_search(set, k) == present[k]);
+
+		if (i % (4 * UNIVERSE) == 0) {
+			test_agree(set, present, count);
+		}
+	}
+
+	set_bucketed_free(set);
+	free(present);
+}
+
+/* After set_bucketed_reserve, LOAD insertions keep the capacity, which
+ * only grows once the reservation is exceeded */
+static void test_reserve(void) {
+	set_bucketed_t *set = set_bucketed_alloc();
+	size_t *keys = malloc(LOAD * sizeof(size_t));
+	bool *found = malloc(LOAD * sizeof(bool));
+	assert(set && keys && found);
+
+	assert(set_bucketed_reserve(set, LOAD));
+	size_t capacity = set_bucketed_capacity(set);
+	assert(LOAD <= 0.9 * capacity);
+	assert(set_bucketed_reserve(set, LOAD / 2));
+	assert(set_bucketed_capacity(set) == capacity);
+
+	for (size_t i = 0; i < LOAD; i++) {
+		keys[i] = test_key(i);
+		assert(set_bucketed_insert(set, keys[i]));
+	}
+	assert(set_bucketed_capacity(set) == capacity);
+	assert(set_bucketed_count(set) == LOAD);
+	assert(set_bucketed_search_batch(set, keys, LOAD, found) == LOAD);
+
+	for (size_t i = 0; i < LOAD; i += 2) {
+		assert(set_bucketed_delete(set, keys[i]));
+	}
+	set_bucketed_search_batch(set, keys, LOAD, found);
+	for (size_t i = 0; i < LOAD; i++) {
+		assert(found[i] == (i % 2 == 1));
+		assert(!set_bucketed_search(set, test_key(LOAD + i)));
+	}
+
+	for (size_t i = LOAD; i < 2 * capacity; i++) {
+		assert(set_bucketed_insert(set, test_key(i)));
+	}
+	assert(set_bucketed_capacity(set) > capacity);
+	assert(set_bucketed_count(set) <= 0.9 * set_bucketed_capacity(set));
+
+	set_bucketed_free(set);
+	free(keys);
+	free(found);
+}
+
+int main(void) {
+	test_reference();
+	test_reserve();
+
+	puts("set_bucketed_test: ok");
+	return 0;
+}
@@ -0,0 +1,665 @@
+#include "set_concurrent.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define BUCKET_SIZE 8UL
+#define BUCKET_ALIGNMENT 64UL
+#define SET_INIT_SIZE 4UL
+#define LOCK_STRIPES 1024UL
+#define WRITER_SLOTS 64UL
+#define MAX_LOAD 0.75
+#define CUCKOO_MAX_NODES 1024UL
+#define CUCKOO_ROOT UINT32_MAX
+#define SET_BATCH_SIZE 32UL
+#define SPINS_BEFORE_YIELD 64UL
+
+/* A size_t set for many threads, laid out like set_bucketed: two tables of
+ * 8-slot cache line buckets under tabulation hashing, 0 marking empty slots.
+ *
+ * Searches, inserts and deletes take no lock. Every bucket belongs to one of
+ * LOCK_STRIPES stripe words, which are odd while a key is being moved
+ * between buckets; a scan of the two buckets of a key retries if either
+ * stripe was odd or changed under it, so it never misses a key in flight.
+ * An insert publishes its key into a free slot it scanned with one compare
+ * and swap from 0, and a delete clears the slot the same way, so writers to
+ * the same bucket only ever retry on a lost swap. Two inserts of one key may
+ * each publish a copy; after its swap an insert scans again and removes all
+ * but the first copy under the stripe pair of the key.
+ *
+ * Only an insert that finds both buckets full takes a lock, a mutex around
+ * cuckoo displacement and growth. Displacement moves each key into its
+ * other bucket under the stripes of both, compare and swapping the free
+ * slot so that it cannot overwrite a concurrent insert. Growth stops
+ * writers: each thread counts its operations in progress in one of
+ * WRITER_SLOTS cache lines, and growth freezes the table, waits for those
+ * counts to drain, fills a private table and publishes it with one pointer
+ * store. Searches carry on in the frozen table meanwhile. Replaced tables
+ * are only freed by set_concurrent_free, since searches may still be in
+ * them; together they take at most as much memory as the current one. */
+typedef struct bucket_t {
+	_Alignas(BUCKET_ALIGNMENT) size_t key[BUCKET_SIZE];
+} bucket_t;
+
+typedef struct set_table_t {
+	size_t table_size; /* log2 of the buckets in each table */
+	bool frozen; /* set once growth has begun replacing the table */
+	size_t h_0[8][256], h_1[8][256];
+	size_t stripes[LOCK_STRIPES];
+	bucket_t *table_0, *table_1;
+	struct set_table_t *retired; /* the table this one replaced */
+} set_table_t;
+
+/* Shared by the threads that hash to it, so that writers do not all contend
+ * on one line */
+typedef struct set_writer_t {
+	_Alignas(BUCKET_ALIGNMENT) size_t active; /* operations in progress */
+	size_t key_count; /* keys added less keys removed, modulo 2^64 */
+} set_writer_t;
+
+struct set_concurrent_t {
+	set_table_t *table;
+	pthread_mutex_t lock; /* displacement and growth */
+	set_writer_t writers[WRITER_SLOTS];
+};
+
+typedef enum set_put_t { SET_PRESENT, SET_PLACED, SET_FULL } set_put_t;
+typedef enum set_room_t { SET_ROOM, SET_RETRY, SET_NO_PATH } set_room_t;
+
+/* A node of the breadth first search for a displacement path: the key in
+ * slot of the parent bucket would move into this one */
+typedef struct cuckoo_node_t {
+	bucket_t *bucket;
+	size_t *stripe;
+	uint32_t parent;
+	uint16_t slot;
+	uint16_t which; /* the table of bucket */
+} cuckoo_node_t;
+
+static size_t writer_next;
+static __thread size_t writer_slot = SIZE_MAX;
+
+static void generate_hash(size_t m, size_t n, size_t T[m][n]) {
+	arc4random_buf(T, sizeof(size_t) * m * n);
+}
+
+static inline size_t hash(size_t key, size_t T[8][256]) {
+	size_t H = 0;
+	for (size_t i = 0; i < sizeof(size_t); i++) {
+		H ^= T[i][(unsigned char)(key >> 8 * i)];
+	}
+
+	return H;
+}
+
+static inline size_t set_index(set_table_t *t, size_t key, size_t which) {
+	return hash(key, which ? t->h_1 : t->h_0) & ((1UL << t->table_size) - 1);
+}
+
+static inline bucket_t *set_bucket(set_table_t *t, size_t index,
+                                   size_t which) {
+	return which ? &t->table_1[index] : &t->table_0[index];
+}
+
+static inline size_t *set_stripe(set_table_t *t, size_t index, size_t which) {
+	return &t->stripes[(2 * index + which) & (LOCK_STRIPES - 1)];
+}
+
+static inline size_t set_capacity(set_table_t *t) {
+	return 2 * BUCKET_SIZE << t->table_size;
+}
+
+/* Bit i is set when slot i of bucket holds key */
+static inline unsigned bucket_match(const bucket_t *bucket, size_t key) {
+	unsigned match = 0;
+	for (size_t i = 0; i < BUCKET_SIZE; i++) {
+		match |= (unsigned)(__atomic_load_n(&bucket->key[i],
+		                                    __ATOMIC_RELAXED) == key)
+		         << i;
+	}
+	return match;
+}
+
+static inline bool slot_swap(size_t *slot, size_t from, size_t to) {
+	return __atomic_compare_exchange_n(slot, &from, to, false,
+	                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* Waits a little longer on each call, yielding once spinning has not
+ * helped */
+static inline void set_relax(size_t *spins) {
+	if (++*spins < SPINS_BEFORE_YIELD) {
+#if defined(__i386__) || defined(__x86_64__)
+		_mm_pause();
+#endif
+	} else {
+		sched_yield();
+	}
+}
+
+static void stripe_lock(size_t *stripe) {
+	for (size_t spins = 0;; set_relax(&spins)) {
+		size_t version = __atomic_load_n(stripe, __ATOMIC_RELAXED);
+		if (!(version & 1) &&
+		    __atomic_compare_exchange_n(stripe, &version, version + 1, true,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	/* Keeps the slot stores from becoming visible before the odd version */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void stripe_unlock(size_t *stripe) {
+	__atomic_fetch_add(stripe, 1, __ATOMIC_RELEASE);
+}
+
+/* Two buckets may share a stripe; distinct ones are taken in address order */
+static void stripe_lock_pair(size_t *a, size_t *b) {
+	if (a == b) {
+		stripe_lock(a);
+	} else {
+		stripe_lock(a < b ? a : b);
+		stripe_lock(a < b ? b : a);
+	}
+}
+
+static void stripe_unlock_pair(size_t *a, size_t *b) {
+	stripe_unlock(a);
+	if (a != b) {
+		stripe_unlock(b);
+	}
+}
+
+static set_table_t *set_table_alloc(size_t table_size) {
+	size_t size = sizeof(bucket_t) << table_size;
+	set_table_t *t = malloc(sizeof(set_table_t));
+	bucket_t *table_0 = aligned_alloc(BUCKET_ALIGNMENT, size);
+	bucket_t *table_1 = aligned_alloc(BUCKET_ALIGNMENT, size);
+
+	if (t != NULL && table_0 != NULL && table_1 != NULL) {
+		*t = (set_table_t){.table_size = table_size,
+		                   .frozen = false,
+		                   .stripes = {0},
+		                   .table_0 = table_0,
+		                   .table_1 = table_1,
+		                   .retired = NULL};
+
+		memset(table_0, 0, size);
+		memset(table_1, 0, size);
+		generate_hash(8, 256, t->h_0);
+		generate_hash(8, 256, t->h_1);
+		return t;
+	} else {
+		free(t);
+		free(table_0);
+		free(table_1);
+		return NULL;
+	}
+}
+
+static void set_table_free(set_table_t *t) {
+	free(t->table_0);
+	free(t->table_1);
+	free(t);
+}
+
+set_concurrent_t *set_concurrent_alloc(void) {
+	set_concurrent_t *set = aligned_alloc(BUCKET_ALIGNMENT,
+	                                      sizeof(set_concurrent_t));
+	set_table_t *t = set_table_alloc(SET_INIT_SIZE);
+
+	if (set != NULL && t != NULL) {
+		*set = (set_concurrent_t){.table = t, .writers = {{0}}};
+		if (!pthread_mutex_init(&set->lock, NULL)) {
+			return set;
+		}
+	}
+
+	free(set);
+	if (t) {
+		set_table_free(t);
+	}
+	return NULL;
+}
+
+/* No other thread may use the set any more */
+void set_concurrent_free(set_concurrent_t *set) {
+	if (set) {
+		for (set_table_t *t = set->table, *next; t; t = next) {
+			next = t->retired;
+			set_table_free(t);
+		}
+		pthread_mutex_destroy(&set->lock);
+		free(set);
+	}
+}
+
+static set_writer_t *set_writer(set_concurrent_t *set) {
+	if (writer_slot == SIZE_MAX) {
+		writer_slot = __atomic_fetch_add(&writer_next, 1, __ATOMIC_RELAXED) %
+		              WRITER_SLOTS;
+	}
+	return &set->writers[writer_slot];
+}
+
+/* Announces an insert or delete on the current table, first waiting out
+ * any growth that has frozen it. Growth stores frozen before it reads the
+ * counts, and a writer counts itself before it reads frozen, so either
+ * growth waits for the writer or the writer sees the table frozen. */
+static set_table_t *set_enter(set_concurrent_t *set, set_writer_t *w) {
+	for (;;) {
+		__atomic_fetch_add(&w->active, 1, __ATOMIC_SEQ_CST);
+		set_table_t *t = __atomic_load_n(&set->table, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&t->frozen, __ATOMIC_SEQ_CST)) {
+			return t;
+		}
+
+		__atomic_fetch_sub(&w->active, 1, __ATOMIC_RELEASE);
+		for (size_t spins = 0;
+		     __atomic_load_n(&set->table, __ATOMIC_ACQUIRE) == t &&
+		     __atomic_load_n(&t->frozen, __ATOMIC_ACQUIRE);
+		     set_relax(&spins)) {
+		}
+	}
+}
+
+static inline void set_leave(set_writer_t *w) {
+	__atomic_fetch_sub(&w->active, 1, __ATOMIC_RELEASE);
+}
+
+/* Compares key, and 0, with the slots of the buckets i_0 and i_1 of key in
+ * t under their stripe versions. Returns false if a key was moved between
+ * them meanwhile, in which case the scan must be repeated. */
+static inline bool set_scan(set_table_t *t, size_t key, size_t i_0,
+                            size_t i_1, unsigned match[2], unsigned empty[2]) {
+	size_t *s_0 = set_stripe(t, i_0, 0), *s_1 = set_stripe(t, i_1, 1);
+
+	size_t v_0 = __atomic_load_n(s_0, __ATOMIC_ACQUIRE);
+	size_t v_1 = __atomic_load_n(s_1, __ATOMIC_ACQUIRE);
+	if ((v_0 | v_1) & 1) {
+		return false;
+	}
+
+	match[0] = bucket_match(&t->table_0[i_0], key);
+	match[1] = bucket_match(&t->table_1[i_1], key);
+	if (empty) {
+		empty[0] = bucket_match(&t->table_0[i_0], 0);
+		empty[1] = bucket_match(&t->table_1[i_1], 0);
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(s_0, __ATOMIC_RELAXED) == v_0 &&
+	       __atomic_load_n(s_1, __ATOMIC_RELAXED) == v_1;
+}
+
+bool set_concurrent_search(set_concurrent_t *set, size_t key) {
+	if (!key) {
+		return false;
+	}
+
+	for (size_t spins = 0;; set_relax(&spins)) {
+		set_table_t *t = __atomic_load_n(&set->table, __ATOMIC_ACQUIRE);
+		unsigned match[2];
+
+		if (set_scan(t, key, set_index(t, key, 0), set_index(t, key, 1),
+		             match, NULL) &&
+		    __atomic_load_n(&set->table, __ATOMIC_RELAXED) == t) {
+			return match[0] | match[1];
+		}
+	}
+}
+
+/* Hashes a block of keys and prefetches both of their buckets before probing
+ * any of them. The indices hold for as long as the table stays the same; a
+ * key whose probe finds it replaced is searched again from scratch. */
+size_t set_concurrent_search_batch(set_concurrent_t *set, const size_t *keys,
+                                   size_t n, bool *found) {
+	size_t i_0[SET_BATCH_SIZE], i_1[SET_BATCH_SIZE];
+	size_t count = 0;
+
+	for (size_t k = 0; k < n; k += SET_BATCH_SIZE) {
+		size_t m = n - k < SET_BATCH_SIZE ? n - k : SET_BATCH_SIZE;
+		set_table_t *t = __atomic_load_n(&set->table, __ATOMIC_ACQUIRE);
+
+		for (size_t i = 0; i < m; i++) {
+			i_0[i] = set_index(t, keys[k + i], 0);
+			i_1[i] = set_index(t, keys[k + i], 1);
+			__builtin_prefetch(&t->table_0[i_0[i]]);
+			__builtin_prefetch(&t->table_1[i_1[i]]);
+		}
+
+		for (size_t i = 0; i < m; i++) {
+			size_t key = keys[k + i], spins = 0;
+			unsigned match[2] = {0, 0};
+
+			while (key && !set_scan(t, key, i_0[i], i_1[i], match, NULL)) {
+				set_relax(&spins);
+			}
+			bool hit = match[0] | match[1];
+			if (key && __atomic_load_n(&set->table, __ATOMIC_RELAXED) != t) {
+				hit = set_concurrent_search(set, key);
+			}
+
+			if (found) {
+				found[k + i] = hit;
+			}
+			count += hit;
+		}
+	}
+
+	return count;
+}
+
+/* Publishes key into a free slot of one of its buckets in t, unless it is
+ * already there. Any number of threads may do this at once; the swap only
+ * fails if another writer took the slot first, and then the buckets are
+ * scanned again. */
+static set_put_t set_put(set_table_t *t, size_t key) {
+	size_t i_0 = set_index(t, key, 0), i_1 = set_index(t, key, 1);
+
+	for (size_t spins = 0;; set_relax(&spins)) {
+		unsigned match[2], empty[2];
+
+		if (!set_scan(t, key, i_0, i_1, match, empty)) {
+			continue;
+		} else if (match[0] | match[1]) {
+			return SET_PRESENT;
+		} else if (!(empty[0] | empty[1])) {
+			return SET_FULL;
+		}
+
+		size_t which = !empty[0];
+		bucket_t *bucket = set_bucket(t, which ? i_1 : i_0, which);
+		if (slot_swap(&bucket->key[__builtin_ctz(empty[which])], 0, key)) {
+			return SET_PLACED;
+		}
+	}
+}
+
+/* Called after publishing key: removes every copy of it but the first that
+ * inserts racing with this one published, and returns how many it removed.
+ * The swap and the fence before the scan make sure that of two such
+ * inserts at least one sees the other's copy. */
+static size_t set_settle(set_table_t *t, size_t key) {
+	size_t i_0 = set_index(t, key, 0), i_1 = set_index(t, key, 1);
+	size_t *s_0 = set_stripe(t, i_0, 0), *s_1 = set_stripe(t, i_1, 1);
+	size_t removed = 0;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (size_t spins = 0;; set_relax(&spins)) {
+		unsigned match[2];
+
+		if (!set_scan(t, key, i_0, i_1, match, NULL)) {
+			continue;
+		} else if (__builtin_popcount(match[0]) +
+		               __builtin_popcount(match[1]) <=
+		           1) {
+			return removed;
+		}
+
+		bool kept = false;
+		stripe_lock_pair(s_0, s_1);
+		for (size_t which = 0; which < 2; which++) {
+			bucket_t *bucket = set_bucket(t, which ? i_1 : i_0, which);
+			for (size_t i = 0; i < BUCKET_SIZE; i++) {
+				if (__atomic_load_n(&bucket->key[i], __ATOMIC_RELAXED) !=
+				    key) {
+					continue;
+				} else if (!kept) {
+					kept = true;
+				} else if (slot_swap(&bucket->key[i], key, 0)) {
+					removed++;
+				}
+			}
+		}
+		stripe_unlock_pair(s_0, s_1);
+	}
+}
+
+/* Moves the key in slot of from into slot free_slot of to, its other
+ * bucket, with both stripes held. The free slot is swapped from 0, since an
+ * insert may take it first, and the old one back to 0, since a delete may
+ * clear it first; in either case nothing has moved and false is returned.
+ * Also false if the slot no longer holds a key whose other bucket is to. */
+static bool set_move(set_table_t *t, cuckoo_node_t *from, cuckoo_node_t *to,
+                     size_t slot, size_t free_slot) {
+	size_t *source = &from->bucket->key[slot];
+	size_t *target = &to->bucket->key[free_slot];
+	bool moved = false;
+
+	stripe_lock_pair(from->stripe, to->stripe);
+	size_t key = __atomic_load_n(source, __ATOMIC_RELAXED);
+	if (key && set_bucket(t, set_index(t, key, to->which), to->which) ==
+	               to->bucket &&
+	    slot_swap(target, 0, key)) {
+		moved = slot_swap(source, key, 0);
+		if (!moved) {
+			/* No other writer can reach the copy while the stripes are odd */
+			__atomic_store_n(target, 0, __ATOMIC_RELAXED);
+		}
+	}
+	stripe_unlock_pair(from->stripe, to->stripe);
+
+	return moved;
+}
+
+/* Searches breadth first for a chain of keys that can each move to their
+ * other bucket, ending at a free slot, and shifts them along it starting
+ * from that slot, so that every key is in one of its buckets at all times.
+ * That frees a slot in one of the buckets of key, for the caller to put key
+ * into. A chain never visits a bucket twice, so each move reads a slot no
+ * earlier move touched. Only called with the mutex held, so no other chain
+ * is shifted at once, but inserts and deletes can change the slots under
+ * the search; a move that finds them changed gives up with SET_RETRY. */
+static set_room_t set_cuckoo(set_table_t *t, size_t key) {
+	static __thread cuckoo_node_t nodes[CUCKOO_MAX_NODES];
+	size_t head = 0, tail = 0;
+
+	for (size_t which = 0; which < 2; which++) {
+		size_t index = set_index(t, key, which);
+		nodes[tail++] = (cuckoo_node_t){
+		    .bucket = set_bucket(t, index, which),
+		    .stripe = set_stripe(t, index, which),
+		    .parent = CUCKOO_ROOT,
+		    .slot = 0,
+		    .which = (uint16_t)which};
+	}
+
+	for (; head < tail; head++) {
+		bucket_t *bucket = nodes[head].bucket;
+		size_t which = nodes[head].which;
+		unsigned free_slots = bucket_match(bucket, 0);
+
+		if (free_slots) {
+			/* Shift the chain back towards the root, one move at a time */
+			size_t free_slot = __builtin_ctz(free_slots);
+			for (size_t n = head; nodes[n].parent != CUCKOO_ROOT;
+			     n = nodes[n].parent) {
+				if (!set_move(t, &nodes[nodes[n].parent], &nodes[n],
+				              nodes[n].slot, free_slot)) {
+					return SET_RETRY;
+				}
+				free_slot = nodes[n].slot;
+			}
+			return SET_ROOM;
+		}
+
+		for (size_t slot = 0;
+		     slot < BUCKET_SIZE && tail < CUCKOO_MAX_NODES; slot++) {
+			size_t index = set_index(
+			    t, __atomic_load_n(&bucket->key[slot], __ATOMIC_RELAXED),
+			    !which);
+			bucket_t *next = set_bucket(t, index, !which);
+
+			size_t n = head;
+			while (n != CUCKOO_ROOT && nodes[n].bucket != next) {
+				n = nodes[n].parent;
+			}
+			if (n != CUCKOO_ROOT) {
+				continue; // already on the chain
+			}
+
+			nodes[tail++] = (cuckoo_node_t){
+			    .bucket = next,
+			    .stripe = set_stripe(t, index, !which),
+			    .parent = (uint32_t)head,
+			    .slot = (uint16_t)slot,
+			    .which = (uint16_t)!which};
+		}
+	}
+
+	return SET_NO_PATH;
+}
+
+/* Puts key into a private table, displacing others as needed. Returns false
+ * if no displacement path was found. */
+static bool set_place(set_table_t *t, size_t key) {
+	for (;;) {
+		if (set_put(t, key) != SET_FULL) {
+			return true;
+		} else if (set_cuckoo(t, key) == SET_NO_PATH) {
+			return false;
+		}
+	}
+}
+
+static size_t set_count(set_concurrent_t *set) {
+	size_t count = 0;
+	for (size_t i = 0; i < WRITER_SLOTS; i++) {
+		count += __atomic_load_n(&set->writers[i].key_count,
+		                         __ATOMIC_RELAXED);
+	}
+	return count;
+}
+
+/* Freezes the table, waits for the writers in it to leave, then fills a
+ * private table twice the size (or larger, if the keys do not fit) and
+ * publishes it. Called with the mutex held. If memory runs out the table is
+ * thawed again, so that writers can carry on in it. */
+static bool set_grow(set_concurrent_t *set) {
+	set_table_t *old = set->table;
+	size_t buckets = 1UL << old->table_size;
+
+	__atomic_store_n(&old->frozen, true, __ATOMIC_SEQ_CST);
+	for (size_t i = 0; i < WRITER_SLOTS; i++) {
+		for (size_t spins = 0;
+		     __atomic_load_n(&set->writers[i].active, __ATOMIC_SEQ_CST);
+		     set_relax(&spins)) {
+		}
+	}
+
+	for (size_t table_size = old->table_size + 1;; table_size++) {
+		set_table_t *t = set_table_alloc(table_size);
+		if (!t) {
+			__atomic_store_n(&old->frozen, false, __ATOMIC_SEQ_CST);
+			return false;
+		}
+
+		bool placed = true;
+		for (size_t i = 0; i < 2 * buckets && placed; i++) {
+			bucket_t *bucket = i < buckets ? &old->table_0[i]
+			                               : &old->table_1[i - buckets];
+			for (size_t j = 0; j < BUCKET_SIZE && placed; j++) {
+				size_t key = bucket->key[j];
+				placed = !key || set_place(t, key);
+			}
+		}
+
+		if (placed) {
+			t->retired = old;
+			__atomic_store_n(&set->table, t, __ATOMIC_RELEASE);
+			return true;
+		}
+		set_table_free(t);
+	}
+}
+
+/* Makes room for key, which found both of its buckets in t full, by
+ * displacement, or by growth once the set is past MAX_LOAD or no path is
+ * found. Returns false if memory runs out. */
+static bool set_make_room(set_concurrent_t *set, set_table_t *t,
+                          size_t key) {
+	bool grown = true;
+
+	pthread_mutex_lock(&set->lock);
+	if (set->table == t) {
+		if (set_count(set) + 1 > MAX_LOAD * set_capacity(t) ||
+		    set_cuckoo(t, key) == SET_NO_PATH) {
+			grown = set_grow(set);
+		}
+	}
+	pthread_mutex_unlock(&set->lock);
+
+	return grown;
+}
+
+/* Returns true if key was inserted or already present, false for 0 or when
+ * memory runs out. */
+bool set_concurrent_insert(set_concurrent_t *set, size_t key) {
+	if (!key) {
+		return false; // 0 is not a valid key
+	}
+
+	set_writer_t *w = set_writer(set);
+
+	for (;;) {
+		set_table_t *t = set_enter(set, w);
+		set_put_t put = set_put(t, key);
+		if (put == SET_PLACED) {
+			__atomic_fetch_add(&w->key_count, 1 - set_settle(t, key),
+			                   __ATOMIC_RELAXED);
+		}
+		set_leave(w);
+
+		if (put != SET_FULL) {
+			return true;
+		} else if (!set_make_room(set, t, key)) {
+			return false;
+		}
+	}
+}
+
+bool set_concurrent_delete(set_concurrent_t *set, size_t key) {
+	if (!key) {
+		return false;
+	}
+
+	set_writer_t *w = set_writer(set);
+	set_table_t *t = set_enter(set, w);
+	size_t i_0 = set_index(t, key, 0), i_1 = set_index(t, key, 1);
+	bool deleted = false;
+
+	for (size_t spins = 0;; set_relax(&spins)) {
+		unsigned match[2];
+
+		if (!set_scan(t, key, i_0, i_1, match, NULL)) {
+			continue;
+		} else if (!(match[0] | match[1])) {
+			break;
+		}
+
+		size_t which = !match[0];
+		bucket_t *bucket = set_bucket(t, which ? i_1 : i_0, which);
+		if (slot_swap(&bucket->key[__builtin_ctz(match[which])], key, 0)) {
+			deleted = true;
+			break;
+		}
+	}
+
+	if (deleted) {
+		__atomic_fetch_sub(&w->key_count, 1, __ATOMIC_RELAXED);
+	}
+	set_leave(w);
+	return deleted;
+}
+
+size_t set_concurrent_count(set_concurrent_t *set) { return set_count(set); }
@@ -0,0 +1,21 @@
+#ifndef SET_CONCURRENT_H
+#define SET_CONCURRENT_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct set_concurrent_t set_concurrent_t;
+
+set_concurrent_t *set_concurrent_alloc(void);
+void set_concurrent_free(set_concurrent_t *set);
+
+bool set_concurrent_insert(set_concurrent_t *set, size_t key);
+bool set_concurrent_delete(set_concurrent_t *set, size_t key);
+bool set_concurrent_search(set_concurrent_t *set, size_t key);
+
+size_t set_concurrent_search_batch(set_concurrent_t *set, const size_t *keys,
+                                   size_t n, bool *found);
+
+size_t set_concurrent_count(set_concurrent_t *set);
+
+#endif
@@ -0,0 +1,225 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "set_concurrent.h"
+
+/* Behaviour tests for set_concurrent_t: a single thread against a reference
+ * array, then writers growing the set while readers search it. */
+
+#define UNIVERSE 4096UL
+#define WRITERS 8UL
+#define READERS 4UL
+#define PER_WRITER 50000UL
+#define CONTENDED 64UL
+
+static uint64_t test_state = 0x9e3779b97f4a7c15UL;
+
+static size_t test_rand(size_t n) {
+	test_state ^= test_state << 13;
+	test_state ^= test_state >> 7;
+	test_state ^= test_state << 17;
+	return test_state % n;
+}
+
+static void test_reference(void) {
+	set_concurrent_t *set = set_concurrent_alloc();
+	bool *present = calloc(UNIVERSE, sizeof(bool));
+	size_t keys[UNIVERSE - 1], count = 0;
+	bool found[UNIVERSE - 1];
+	assert(set && present);
+
+	assert(!set_concurrent_insert(set, 0));
+	assert(!set_concurrent_delete(set, 0));
+	assert(!set_concurrent_search(set, 0));
+
+	for (size_t k = 1; k < UNIVERSE; k++) {
+		keys[k - 1] = k;
+	}
+
+	for (size_t i = 1; i <= 64 * UNIVERSE; i++) {
+		size_t k = 1 + test_rand(UNIVERSE - 1);
+
+		if (test_rand(2)) {
+			assert(set_concurrent_insert(set, k));
+			count += !present[k];
+			present[k] = true;
+		} else {
+			assert(set_concurrent_delete(set, k) == present[k]);
+			count -= present[k];
+			present[k] = false;
+		}
+		assert(set_concurrent_search(set, k) == present[k]);
+		assert(set_concurrent_count(set) == count);
+
+		if (i % (4 * UNIVERSE) == 0) {
+			size_t start = test_rand(UNIVERSE / 2), n = test_rand(100);
+			assert(set_concurrent_search_batch(set, keys + start, n, found) <=
+			       n);
+			for (size_t j = 0; j < n; j++) {
+				assert(found[j] == present[keys[start + j]]);
+			}
+			assert(set_concurrent_search_batch(set, keys, UNIVERSE - 1,
+			                                   NULL) == count);
+		}
+	}
+
+	set_concurrent_free(set);
+	free(present);
+}
+
+typedef struct test_thread_t {
+	set_concurrent_t *set;
+	size_t id;
+	bool *done;
+} test_thread_t;
+
+/* Writer id owns keys (id + 1) * 2^32 + 1 to + PER_WRITER: it inserts them
+ * and deletes every other one. Keys 1 to PER_WRITER / 5 are inserted by
+ * every writer, and must still be stored once. */
+static void *test_writer(void *arg) {
+	test_thread_t *thread = arg;
+	size_t base = (thread->id + 1) << 32;
+
+	for (size_t i = 1; i <= PER_WRITER; i++) {
+		assert(set_concurrent_insert(thread->set, base + i));
+		if (i % 5 == 0) {
+			assert(set_concurrent_insert(thread->set, i / 5));
+		}
+	}
+	for (size_t i = 1; i <= PER_WRITER; i += 2) {
+		assert(set_concurrent_delete(thread->set, base + i));
+		assert(!set_concurrent_search(thread->set, base + i));
+	}
+
+	return NULL;
+}
+
+/* The stable keys, inserted before the threads started, must always be
+ * found, and keys above every writer's range never */
+static void *test_reader(void *arg) {
+	test_thread_t *thread = arg;
+	size_t keys[64];
+	bool found[64];
+
+	while (!__atomic_load_n(thread->done, __ATOMIC_RELAXED)) {
+		for (size_t i = 0; i < 64; i++) {
+			keys[i] = i % 2 ? (WRITERS + 2) << 32 | i : UINT64_MAX - i;
+		}
+		assert(set_concurrent_search_batch(thread->set, keys, 64, found) ==
+		       32);
+		for (size_t i = 0; i < 64; i++) {
+			assert(found[i] == (i % 2 == 1));
+			assert(set_concurrent_search(thread->set, keys[i]) == found[i]);
+		}
+	}
+
+	return NULL;
+}
+
+static void test_threads(void) {
+	set_concurrent_t *set = set_concurrent_alloc();
+	pthread_t writers[WRITERS], readers[READERS];
+	test_thread_t args[WRITERS + READERS];
+	bool done = false;
+	assert(set);
+
+	for (size_t i = 1; i < 64; i += 2) {
+		assert(set_concurrent_insert(set, (WRITERS + 2) << 32 | i));
+	}
+
+	for (size_t i = 0; i < WRITERS + READERS; i++) {
+		args[i] = (test_thread_t){.set = set, .id = i, .done = &done};
+	}
+	for (size_t i = 0; i < READERS; i++) {
+		assert(!pthread_create(&readers[i], NULL, test_reader,
+		                       &args[WRITERS + i]));
+	}
+	for (size_t i = 0; i < WRITERS; i++) {
+		assert(!pthread_create(&writers[i], NULL, test_writer, &args[i]));
+	}
+	for (size_t i = 0; i < WRITERS; i++) {
+		pthread_join(writers[i], NULL);
+	}
+	__atomic_store_n(&done, true, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < READERS; i++) {
+		pthread_join(readers[i], NULL);
+	}
+
+	assert(set_concurrent_count(set) ==
+	       32 + PER_WRITER / 5 + WRITERS * PER_WRITER / 2);
+	for (size_t id = 0; id < WRITERS; id++) {
+		for (size_t i = 1; i <= PER_WRITER; i++) {
+			assert(set_concurrent_search(set, ((id + 1) << 32) + i) ==
+			       (i % 2 == 0));
+		}
+	}
+	for (size_t i = 1; i <= PER_WRITER / 5; i++) {
+		assert(set_concurrent_search(set, i));
+		assert(set_concurrent_delete(set, i));
+		assert(!set_concurrent_delete(set, i));
+	}
+
+	set_concurrent_free(set);
+}
+
+/* Inserts and deletes keys 1 to CONTENDED at random, so that every thread
+ * races the others on the same slots */
+static void *test_contender(void *arg) {
+	test_thread_t *thread = arg;
+	uint64_t state = thread->id + 1;
+
+	for (size_t i = 0; i < PER_WRITER; i++) {
+		state = state * 6364136223846793005UL + 1442695040888963407UL;
+		size_t key = 1 + (state >> 33) % CONTENDED;
+		if (state >> 63) {
+			assert(set_concurrent_insert(thread->set, key));
+		} else {
+			set_concurrent_delete(thread->set, key);
+		}
+	}
+
+	return NULL;
+}
+
+/* Racing inserts of one key may each publish a copy; once they are done
+ * exactly one must be left, and the count must match the keys found */
+static void test_contention(void) {
+	set_concurrent_t *set = set_concurrent_alloc();
+	pthread_t threads[WRITERS];
+	test_thread_t args[WRITERS];
+	assert(set);
+
+	for (size_t i = 0; i < WRITERS; i++) {
+		args[i] = (test_thread_t){.set = set, .id = i};
+		assert(!pthread_create(&threads[i], NULL, test_contender, &args[i]));
+	}
+	for (size_t i = 0; i < WRITERS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	size_t present = 0;
+	for (size_t key = 1; key <= CONTENDED; key++) {
+		present += set_concurrent_search(set, key);
+	}
+	assert(set_concurrent_count(set) == present);
+	for (size_t key = 1; key <= CONTENDED; key++) {
+		if (set_concurrent_search(set, key)) {
+			assert(set_concurrent_delete(set, key));
+			assert(!set_concurrent_search(set, key));
+		}
+	}
+	assert(set_concurrent_count(set) == 0);
+
+	set_concurrent_free(set);
+}
+
+int main(void) {
+	test_reference();
+	test_threads();
+	test_contention();
+
+	puts("set_concurrent_test: ok");
+	return 0;
+}
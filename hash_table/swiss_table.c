@@ -0,0 +1,424 @@
+#include "swiss_table.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SWISS_GROUP 16UL
+#define SWISS_MIN_CAPACITY 16UL
+#define SWISS_ALIGNMENT 64UL
+#define SWISS_BATCH_SIZE 32UL
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+/* Open addressing with one control byte per slot: full slots hold the low 7
+ * bits of their hash (h2), free slots one of the negative markers. Probing
+ * starts at the slot picked by the remaining bits (h1) and compares a whole
+ * group of SWISS_GROUP control bytes at once, moving on to the next group
+ * by triangular steps until a group with an empty slot ends the search. The
+ * first SWISS_GROUP - 1 control bytes are mirrored behind the last one, so
+ * that a group can be loaded from any slot without wrapping.
+ *
+ * Keys and values are stored inline in the slots, so a rehash moves them:
+ * value pointers only stay valid until the next insertion. */
+struct swiss_t {
+	size_t count;
+	size_t tombstones;
+	size_t capacity; /* a power of two */
+
+	size_t key_size;
+	size_t value_size;
+	size_t stride;
+	size_t value_offset;
+
+	size_t (*hash)(const void *restrict, size_t, const void *restrict);
+	hash_batch_t hash_batch; /* of hash, for size_t keys, or NULL */
+	int (*compare)(const void *, const void *, size_t);
+
+	void (*key_write)(void *restrict, const void *restrict, size_t);
+	void (*value_write)(void *restrict, const void *restrict, size_t);
+
+	void *seed;
+
+	int8_t *ctrl;
+	char *slots;
+};
+
+static inline size_t swiss_h1(size_t h) { return h >> 7; }
+
+static inline int8_t swiss_h2(size_t h) { return (int8_t)(h & 0x7f); }
+
+/* Bit i is set when control byte i of the group equals c */
+static inline uint32_t swiss_match(const int8_t *group, int8_t c) {
+#ifdef __SSE2__
+	__m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)));
+#else
+	uint32_t match = 0;
+	for (size_t i = 0; i < SWISS_GROUP; i++) {
+		match |= (uint32_t)(group[i] == c) << i;
+	}
+	return match;
+#endif
+}
+
+/* Bit i is set when slot i of the group is empty or deleted */
+static inline uint32_t swiss_match_free(const int8_t *group) {
+#ifdef __SSE2__
+	return (uint32_t)_mm_movemask_epi8(
+	    _mm_loadu_si128((const __m128i *)group));
+#else
+	uint32_t match = 0;
+	for (size_t i = 0; i < SWISS_GROUP; i++) {
+		match |= (uint32_t)(group[i] < 0) << i;
+	}
+	return match;
+#endif
+}
+
+static inline char *swiss_slot(swiss_t *swiss, size_t i) {
+	return swiss->slots + i * swiss->stride;
+}
+
+static inline void swiss_set_ctrl(swiss_t *swiss, size_t i, int8_t c) {
+	swiss->ctrl[i] = c;
+	if (i < SWISS_GROUP - 1) {
+		swiss->ctrl[swiss->capacity + i] = c;
+	}
+}
+
+/* Returns the slot holding key, or SIZE_MAX if there is none */
+static size_t swiss_find(swiss_t *swiss, const void *key, size_t h) {
+	size_t mask = swiss->capacity - 1;
+	size_t pos = swiss_h1(h) & mask;
+	int8_t h2 = swiss_h2(h);
+
+	for (size_t step = SWISS_GROUP;; step += SWISS_GROUP) {
+		const int8_t *group = swiss->ctrl + pos;
+
+		for (uint32_t match = swiss_match(group, h2); match;
+		     match &= match - 1) {
+			size_t i = (pos + __builtin_ctz(match)) & mask;
+			if (swiss->compare(key, swiss_slot(swiss, i), swiss->key_size) ==
+			    0) {
+				return i;
+			}
+		}
+
+		if (swiss_match(group, CTRL_EMPTY)) {
+			return SIZE_MAX;
+		}
+		pos = (pos + step) & mask;
+	}
+}
+
+/* Returns the first empty or deleted slot on the probe sequence of h. The
+ * maximum load guarantees that there is one. */
+static size_t swiss_find_free(swiss_t *swiss, size_t h) {
+	size_t mask = swiss->capacity - 1;
+	size_t pos = swiss_h1(h) & mask;
+
+	for (size_t step = SWISS_GROUP;; step += SWISS_GROUP) {
+		uint32_t match = swiss_match_free(swiss->ctrl + pos);
+		if (match) {
+			return (pos + __builtin_ctz(match)) & mask;
+		}
+		pos = (pos + step) & mask;
+	}
+}
+
+/* At most 7/8 of the slots, deleted ones included, may be in use */
+static inline bool swiss_overloaded(size_t used, size_t capacity) {
+	return used * 8 > capacity * 7;
+}
+
+static size_t swiss_fit_capacity(size_t count) {
+	size_t capacity = SWISS_MIN_CAPACITY;
+
+	while (swiss_overloaded(count, capacity)) {
+		capacity *= 2;
+	}
+
+	return capacity;
+}
+
+/* Moves every entry into fresh arrays of capacity slots, dropping the
+ * tombstones on the way. */
+static bool swiss_rehash(swiss_t *swiss, size_t capacity) {
+	size_t slots_size = (capacity * swiss->stride + SWISS_ALIGNMENT - 1) &
+	                    ~(SWISS_ALIGNMENT - 1);
+	int8_t *ctrl = malloc(capacity + SWISS_GROUP - 1);
+	char *slots = aligned_alloc(SWISS_ALIGNMENT, slots_size);
+
+	if (ctrl != NULL && slots != NULL) {
+		int8_t *old_ctrl = swiss->ctrl;
+		char *old_slots = swiss->slots;
+		size_t old_capacity = swiss->capacity;
+
+		memset(ctrl, CTRL_EMPTY, capacity + SWISS_GROUP - 1);
+		swiss->ctrl = ctrl;
+		swiss->slots = slots;
+		swiss->capacity = capacity;
+		swiss->tombstones = 0;
+
+		for (size_t i = 0; i < old_capacity; i++) {
+			if (old_ctrl[i] >= 0) {
+				char *item = old_slots + i * swiss->stride;
+				size_t h = swiss->hash(item, swiss->key_size, swiss->seed);
+				size_t j = swiss_find_free(swiss, h);
+				swiss_set_ctrl(swiss, j, swiss_h2(h));
+				memcpy(swiss_slot(swiss, j), item, swiss->stride);
+			}
+		}
+
+		free(old_ctrl);
+		free(old_slots);
+		return true;
+	} else {
+		free(ctrl);
+		free(slots);
+		return false;
+	}
+}
+
+void swiss_free(swiss_t *swiss) {
+	if (swiss) {
+		free(swiss->ctrl);
+		free(swiss->slots);
+		free(swiss->seed);
+		free(swiss);
+	}
+}
+
+swiss_t *swiss_alloc(size_t key_size, size_t value_size, size_t alignment) {
+	if (key_size == 0 || value_size == 0 || !alignment ||
+	    (alignment & (alignment - 1))) {
+		return NULL;
+	}
+
+	size_t value_offset = (key_size + alignment - 1) & ~(alignment - 1);
+	size_t stride =
+	    (value_offset + value_size + alignment - 1) & ~(alignment - 1);
+
+	swiss_t *swiss = malloc(sizeof(swiss_t));
+	void *seed = aligned_alloc(SWISS_ALIGNMENT, SEED_SIZE);
+
+	if (swiss != NULL && seed != NULL) {
+		*swiss = (swiss_t){
+		    .count = 0,
+		    .tombstones = 0,
+		    .capacity = 0,
+
+		    .key_size = key_size,
+		    .value_size = value_size,
+		    .stride = stride,
+		    .value_offset = value_offset,
+
+		    .hash = zhash,
+		    .hash_batch =
+		        key_size == sizeof(size_t) ? hash_batch_for(zhash) : NULL,
+		    .compare = memcmp,
+
+		    .key_write =
+		        (void (*)(void *restrict, const void *restrict, size_t))memcpy,
+		    .value_write =
+		        (void (*)(void *restrict, const void *restrict, size_t))memcpy,
+
+		    .seed = seed,
+		    .ctrl = NULL,
+		    .slots = NULL};
+
+		arc4random_buf(seed, SEED_SIZE);
+
+		if (swiss_rehash(swiss, SWISS_MIN_CAPACITY)) {
+			return swiss;
+		}
+		swiss_free(swiss);
+		return NULL;
+	} else {
+		free(seed);
+		free(swiss);
+		return NULL;
+	}
+}
+
+/* Changing the hash or compare function is only meaningful while empty */
+void swiss_set_hash(swiss_t *swiss,
+                    size_t (*hash)(const void *, size_t, const void *)) {
+	swiss->hash = hash;
+	swiss->hash_batch =
+	    swiss->key_size == sizeof(size_t) ? hash_batch_for(hash) : NULL;
+}
+void swiss_set_compare(swiss_t *swiss,
+                       int (*compare)(const void *, const void *, size_t)) {
+	swiss->compare = compare;
+}
+void swiss_set_key_write(swiss_t *swiss,
+                         void (*key_write)(void *restrict,
+                                           const void *restrict, size_t)) {
+	swiss->key_write = key_write;
+}
+void swiss_set_value_write(swiss_t *swiss,
+                           void (*value_write)(void *restrict,
+                                               const void *restrict,
+                                               size_t)) {
+	swiss->value_write = value_write;
+}
+
+/* Returns the value slot of key, inserting value first (or a zero-filled
+ * one for a NULL value) if the key is absent. A full table grows, unless
+ * most of its used slots are tombstones, which a rehash at the same size
+ * reclaims. */
+void *swiss_find_or_insert(swiss_t *swiss, const void *key,
+                           const void *value, bool *created) {
+	size_t h = swiss->hash(key, swiss->key_size, swiss->seed);
+	size_t i = swiss_find(swiss, key, h);
+	bool inserted = i == SIZE_MAX;
+
+	if (inserted) {
+		if (swiss_overloaded(swiss->count + swiss->tombstones + 1,
+		                     swiss->capacity)) {
+			size_t capacity = swiss->capacity;
+			if (2 * swiss->count >= swiss->tombstones) {
+				capacity *= 2;
+			}
+			if (!swiss_rehash(swiss, capacity)) {
+				return NULL;
+			}
+		}
+
+		i = swiss_find_free(swiss, h);
+		swiss->tombstones -= swiss->ctrl[i] == CTRL_DELETED;
+		swiss_set_ctrl(swiss, i, swiss_h2(h));
+
+		char *item = swiss_slot(swiss, i);
+		swiss->key_write(item, key, swiss->key_size);
+		if (value) {
+			swiss->value_write(item + swiss->value_offset, value,
+			                   swiss->value_size);
+		} else {
+			memset(item + swiss->value_offset, 0, swiss->value_size);
+		}
+		swiss->count++;
+	}
+
+	if (created) {
+		*created = inserted;
+	}
+	return swiss_slot(swiss, i) + swiss->value_offset;
+}
+
+void *swiss_upsert(swiss_t *swiss, const void *key, const void *value,
+                   bool *created) {
+	bool inserted;
+	void *slot = swiss_find_or_insert(swiss, key, value, &inserted);
+
+	if (slot && !inserted) {
+		swiss->value_write(slot, value, swiss->value_size);
+	}
+	if (slot && created) {
+		*created = inserted;
+	}
+	return slot;
+}
+
+void *swiss_lookup(swiss_t *swiss, const void *key, void *lookup_dst) {
+	size_t i =
+	    swiss_find(swiss, key, swiss->hash(key, swiss->key_size, swiss->seed));
+
+	if (i == SIZE_MAX) {
+		return NULL;
+	}
+
+	void *value = swiss_slot(swiss, i) + swiss->value_offset;
+	if (lookup_dst) {
+		swiss->value_write(lookup_dst, value, swiss->value_size);
+	}
+	return value;
+}
+
+/* A deleted slot becomes a tombstone, so that probes for keys placed behind
+ * it carry on past it. */
+bool swiss_delete(swiss_t *swiss, const void *key) {
+	size_t i =
+	    swiss_find(swiss, key, swiss->hash(key, swiss->key_size, swiss->seed));
+
+	if (i == SIZE_MAX) {
+		return false;
+	}
+
+	swiss_set_ctrl(swiss, i, CTRL_DELETED);
+	swiss->tombstones++;
+	swiss->count--;
+	return true;
+}
+
+/* Hashes a block of keys and prefetches the control group and first slot of
+ * each before any of them is probed, so that their misses overlap. */
+size_t swiss_lookup_batch(swiss_t *swiss, const void *keys, size_t n,
+                          void *out_values, bool *out_found) {
+	size_t h[SWISS_BATCH_SIZE];
+	size_t mask = swiss->capacity - 1;
+	size_t found = 0;
+
+	for (size_t k = 0; k < n; k += SWISS_BATCH_SIZE) {
+		const char *block = (const char *)keys + k * swiss->key_size;
+		size_t m = n - k < SWISS_BATCH_SIZE ? n - k : SWISS_BATCH_SIZE;
+
+		if (swiss->hash_batch) {
+			swiss->hash_batch(block, m, swiss->seed, h);
+		}
+
+		for (size_t i = 0; i < m; i++) {
+			if (!swiss->hash_batch) {
+				h[i] = swiss->hash(block + i * swiss->key_size,
+				                   swiss->key_size, swiss->seed);
+			}
+			__builtin_prefetch(swiss->ctrl + (swiss_h1(h[i]) & mask));
+			__builtin_prefetch(swiss_slot(swiss, swiss_h1(h[i]) & mask));
+		}
+
+		for (size_t i = 0; i < m; i++) {
+			size_t j = swiss_find(swiss, block + i * swiss->key_size, h[i]);
+			if (j != SIZE_MAX) {
+				if (out_values) {
+					swiss->value_write((char *)out_values +
+					                       (k + i) * swiss->value_size,
+					                   swiss_slot(swiss, j) +
+					                       swiss->value_offset,
+					                   swiss->value_size);
+				}
+				found++;
+			}
+			if (out_found) {
+				out_found[k + i] = j != SIZE_MAX;
+			}
+		}
+	}
+
+	return found;
+}
+
+bool swiss_reserve(swiss_t *swiss, size_t count) {
+	size_t capacity = swiss_fit_capacity(count);
+	return capacity <= swiss->capacity || swiss_rehash(swiss, capacity);
+}
+
+bool swiss_shrink_to_fit(swiss_t *swiss) {
+	return swiss_rehash(swiss, swiss_fit_capacity(swiss->count));
+}
+
+size_t swiss_count(swiss_t *swiss) { return swiss->count; }
+
+size_t swiss_capacity(swiss_t *swiss) { return swiss->capacity; }
+
+/* Stores the key and value of slot i and returns true if it is in use */
+bool swiss_entry(swiss_t *swiss, size_t i, const void **key, void **value) {
+	if (i >= swiss->capacity || swiss->ctrl[i] < 0) {
+		return false;
+	}
+
+	*key = swiss_slot(swiss, i);
+	*value = swiss_slot(swiss, i) + swiss->value_offset;
+	return true;
+}
@@ -0,0 +1,44 @@
+#ifndef SWISS_TABLE_H
+#define SWISS_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+typedef struct swiss_t swiss_t;
+
+swiss_t *swiss_alloc(size_t key_size, size_t value_size, size_t alignment);
+void swiss_free(swiss_t *swiss);
+
+void swiss_set_hash(swiss_t *swiss,
+                    size_t (*hash)(const void *, size_t, const void *));
+void swiss_set_compare(swiss_t *swiss,
+                       int (*compare)(const void *, const void *, size_t));
+void swiss_set_key_write(swiss_t *swiss,
+                         void (*key_write)(void *restrict,
+                                           const void *restrict, size_t));
+void swiss_set_value_write(swiss_t *swiss,
+                           void (*value_write)(void *restrict,
+                                               const void *restrict, size_t));
+
+void *swiss_find_or_insert(swiss_t *swiss, const void *key,
+                           const void *value, bool *created);
+void *swiss_upsert(swiss_t *swiss, const void *key, const void *value,
+                   bool *created);
+void *swiss_lookup(swiss_t *swiss, const void *key, void *lookup_dst);
+bool swiss_delete(swiss_t *swiss, const void *key);
+
+size_t swiss_lookup_batch(swiss_t *swiss, const void *keys, size_t n,
+                          void *out_values, bool *out_found);
+
+bool swiss_reserve(swiss_t *swiss, size_t count);
+bool swiss_shrink_to_fit(swiss_t *swiss);
+
+size_t swiss_count(swiss_t *swiss);
+size_t swiss_capacity(swiss_t *swiss);
+bool swiss_entry(swiss_t *swiss, size_t i, const void **key, void **value);
+
+#endif
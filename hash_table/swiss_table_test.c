@@ -0,0 +1,166 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "swiss_table.h"
+
+/* Behaviour tests for swiss_t. Random operations on size_t keys, and on
+ * wider keys that take the unbatched hash, are mirrored in a reference array
+ * indexed by key, which the table must agree with. */
+
+#define UNIVERSE 4096UL
+
+/* A key wider than a size_t, equal to others only in its id */
+typedef struct test_wide_t {
+	size_t id;
+	char pad[17];
+} test_wide_t;
+
+static uint64_t test_state = 0x9e3779b97f4a7c15UL;
+
+static size_t test_rand(size_t n) {
+	test_state ^= test_state << 13;
+	test_state ^= test_state >> 7;
+	test_state ^= test_state << 17;
+	return test_state % n;
+}
+
+static void test_key(size_t key_size, size_t k, void *key) {
+	if (key_size == sizeof(size_t)) {
+		*(size_t *)key = k;
+	} else {
+		memset(key, 0, key_size);
+		((test_wide_t *)key)->id = k;
+	}
+}
+
+/* Every key of the universe, looked up one at a time, in a batch, and by
+ * walking the slots */
+static void test_agree(swiss_t *swiss, size_t key_size, const bool *present,
+                       const size_t *value, size_t count) {
+	static test_wide_t keys[UNIVERSE];
+	static size_t values[UNIVERSE];
+	static bool found[UNIVERSE];
+
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		char key[sizeof(test_wide_t)];
+		size_t v = 0;
+
+		test_key(key_size, k, key);
+		memcpy((char *)keys + k * key_size, key, key_size);
+		assert((swiss_lookup(swiss, key, &v) != NULL) == present[k]);
+		assert(!present[k] || v == value[k]);
+	}
+	assert(swiss_count(swiss) == count);
+
+	assert(swiss_lookup_batch(swiss, keys, UNIVERSE, values, found) == count);
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		assert(found[k] == present[k]);
+		assert(!present[k] || values[k] == value[k]);
+	}
+
+	size_t visited = 0;
+	for (size_t i = 0; i < swiss_capacity(swiss); i++) {
+		const void *key;
+		void *v;
+		if (swiss_entry(swiss, i, &key, &v)) {
+			size_t k = *(const size_t *)key;
+			assert(k < UNIVERSE && present[k]);
+			assert(*(size_t *)v == value[k]);
+			visited++;
+		}
+	}
+	assert(visited == count);
+}
+
+/* Insertions through find_or_insert, which keeps an existing value, and
+ * upsert, which replaces it */
+static void test_reference(size_t key_size) {
+	swiss_t *swiss = swiss_alloc(key_size, sizeof(size_t), _Alignof(size_t));
+	bool *present = calloc(UNIVERSE, sizeof(bool));
+	size_t *value = calloc(UNIVERSE, sizeof(size_t)), count = 0;
+	assert(swiss && present && value);
+
+	for (size_t i = 1; i <= 64 * UNIVERSE; i++) {
+		char key[sizeof(test_wide_t)];
+		size_t k = test_rand(UNIVERSE), v = test_rand(SIZE_MAX);
+		bool created;
+		size_t *slot;
+
+		test_key(key_size, k, key);
+		switch (test_rand(3)) {
+		case 0:
+			slot = swiss_find_or_insert(swiss, key, &v, &created);
+			assert(slot && created == !present[k]);
+			if (created) {
+				value[k] = v;
+			}
+			assert(*slot == value[k]);
+			break;
+		case 1:
+			slot = swiss_upsert(swiss, key, &v, &created);
+			assert(slot && created == !present[k] && *slot == v);
+			value[k] = v;
+			break;
+		default:
+			assert(swiss_delete(swiss, key) == present[k]);
+			count -= present[k];
+			present[k] = false;
+			continue;
+		}
+		count += !present[k];
+		present[k] = true;
+
+		if (i % (4 * UNIVERSE) == 0) {
+			test_agree(swiss, key_size, present, value, count);
+		}
+	}
+
+	assert(swiss_shrink_to_fit(swiss));
+	test_agree(swiss, key_size, present, value, count);
+
+	swiss_free(swiss);
+	free(present);
+	free(value);
+}
+
+/* Slots move when an insertion rehashes, but deletions leave the others
+ * where they are, and after swiss_reserve no insertion up to the reserved
+ * count rehashes */
+static void test_pointer_stability(void) {
+	swiss_t *swiss = swiss_alloc(sizeof(size_t), sizeof(size_t),
+	                             _Alignof(size_t));
+	size_t **slot = malloc(UNIVERSE * sizeof(size_t *));
+	assert(swiss && slot);
+
+	assert(swiss_reserve(swiss, UNIVERSE));
+	size_t capacity = swiss_capacity(swiss);
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		slot[k] = swiss_find_or_insert(swiss, &k, &k, NULL);
+		assert(slot[k]);
+	}
+	assert(swiss_capacity(swiss) == capacity);
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		assert(swiss_lookup(swiss, &k, NULL) == slot[k]);
+	}
+
+	for (size_t k = 0; k < UNIVERSE; k++) {
+		if (k % 8) {
+			assert(swiss_delete(swiss, &k));
+		}
+	}
+	for (size_t k = 0; k < UNIVERSE; k += 8) {
+		assert(swiss_lookup(swiss, &k, NULL) == slot[k] && *slot[k] == k);
+	}
+
+	swiss_free(swiss);
+	free(slot);
+}
+
+int main(void) {
+	test_reference(sizeof(size_t));
+	test_reference(sizeof(test_wide_t));
+	test_pointer_stability();
+
+	puts("swiss_table_test: ok");
+	return 0;
+}